@@ -6,16 +6,50 @@
 #include <sys/socket.h>
 #include <signal.h>
 #include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <ncurses.h>
 #include <locale.h>
+#include <stddef.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <openssl/ssl.h>
+#include <zlib.h>
 
 #define BUF_SIZE 100
 #define NICKNAME_SIZE 20
+#define WIRE_HDR 3          // 압축 협상 후 프레임 머리 (길이 2바이트 + 플래그 1바이트)
+#define WIRE_MAX 192
+#define WIRE_DEFLATE 0x01
+#define MAX_PENDING 8       // 협상 응답 전에 받은 메시지 보관 수
+#define MAX_MEMBERS 306     // 방 하나의 접속자 수 (서버의 PRESENCE_MAX와 같음)
+#define ATTACH_CHUNK 65536  // 첨부 파일 조각 크기 (server.c와 같아야 한다)
+#define MAX_DOWNLOADS 4     // 동시에 받는 첨부 파일 수 (서버의 ATTACH_DOWNLOADS와 같음)
+#define RECONNECT_BASE_MSEC 500    // 다시 접속할 때 첫 대기 간격 (실패할 때마다 두 배)
+#define RECONNECT_MAX_MSEC 30000
+#define RECONNECT_STABLE_SEC 30    // 이보다 오래 붙어 있었으면 대기 간격을 처음으로 되돌린다
+#define TYPING_REFRESH_SEC 3       // 입력하는 동안 "typing"을 다시 보내는 간격 (서버는 5초 뒤에 지운다)
+#define TYPING_NAMES 3             // 서버가 입력 중 표시에 보내는 이름 수 (server.c와 같음)
 
 typedef enum {
     MSG_NICKNAME,
     MSG_CHAT,
-    MSG_LOGOUT
+    MSG_LOGOUT,
+    MSG_JOIN,
+    MSG_THROTTLE,
+    MSG_PING,
+    MSG_PONG,
+    MSG_CAPS,
+    MSG_SEARCH,
+    MSG_PRESENCE,
+    MSG_DIRECT,
+    MSG_SPOOL,
+    MSG_FILE,
+    MSG_WATCH,
+    MSG_RETRY,
+    MSG_EPHEMERAL
 } MessageType;
 
 typedef struct {
@@ -26,14 +60,65 @@ typedef struct {
 
 void error_handling(char *message);
 void handle_sigint(int sig);
+void handle_sigchld(int sig);
+int connect_server(struct sockaddr_in *addr, const char *ca_file, const char *server_ip, const char *nickname,
+                   int level, int retry_msec, int wait);
 void receive_messages(int sock, const char *my_nickname);
-void send_messages(int sock, const char *nickname);
+int send_messages(int sock, const char *nickname);
 void print_chat_message(WINDOW *chat_win, const char *nickname, const char *message, const char *my_nickname);
+void print_notice(WINDOW *chat_win, const char *notice);
+void print_watch(WINDOW *chat_win, const char *nickname, const char *content);
 void redraw_input_window();
+int tls_connect(int sock, const char *ca_file, const char *server_ip);
+void negotiate_compression(int sock, int level);
+int send_frame(int sock, ChatMessage *message);
+int recv_frame(int sock, ChatMessage *message);
+int read_full(int sock, void *buf, size_t len);
+void apply_presence(ChatMessage *message);
+void draw_member_line();
+void send_file(int sock, const char *nickname, const char *path);
+void receive_file(int sock, ChatMessage *message);
+int read_input(int sock, const char *nickname, char *input, int size);
+void apply_ephemeral(ChatMessage *message);
 
 int sock;
 WINDOW *chat_win, *input_win;
 
+// 자동 재접속: 수신 프로세스가 끊김을 알게 되면 종료하고, 입력 프로세스가 지터를 더한 지수 백오프로 다시 접속한다
+volatile sig_atomic_t receiver_done = 0;
+int reconnect_backoff = RECONNECT_BASE_MSEC;
+char current_room[BUF_SIZE];    // 다시 접속하면 이 방으로 돌아간다
+
+// 압축 (-z): 서버가 받아들이면 양방향 모두 [길이][플래그][본문] 형식으로 주고받는다
+int compress_level = 0;
+int compress_min = 0;
+z_stream deflater, inflater;
+ChatMessage pending_msgs[MAX_PENDING];  // 협상 응답보다 먼저 온 메시지
+int pending_count = 0;
+
+// 지금 방의 접속자 목록 (서버가 보내는 전체 목록과 변경분으로 맞춘다)
+char member_room[NICKNAME_SIZE];
+char members[MAX_MEMBERS][NICKNAME_SIZE];
+int member_count = 0;
+char typing_text[BUF_SIZE * 2];  // 구분선에 덧붙이는 입력 중 표시 (수신 프로세스)
+
+// 받는 중인 첨부 파일 (수신 프로세스)
+typedef struct {
+    unsigned id;
+    int fd;                 // -1: 빈 칸
+    long long size, got;
+    char path[80];
+} Download;
+Download downloads[MAX_DOWNLOADS] = {{0, -1, 0, 0, ""}, {0, -1, 0, 0, ""}, {0, -1, 0, 0, ""}, {0, -1, 0, 0, ""}};
+int upload_token = 0;   // 올리는 파일마다 붙이는 번호
+
+// 압축 사전 (server.c와 같아야 한다)
+static const char compress_dict[] =
+    "http://https://www..com 사진 파일 링크 회의 점심 내일 오늘 지금 잠깐 혹시 그럼 근데 진짜 "
+    "맞아요 알겠습니다 네 아니요 좋아요 감사합니다 고맙습니다 수고하셨습니다 안녕하세요 "
+    "ㅎㅎㅎㅎ ㅠㅠㅠㅠ ㅋㅋㅋㅋㅋㅋㅋㅋ 님께서 퇴장했습니다.\n"
+    "\x01\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0";
+
 int main(int argc, char *argv[]) {
 
     setlocale(LC_ALL, "ko_KR.UTF-8");
@@ -41,32 +126,38 @@ int main(int argc, char *argv[]) {
     struct sockaddr_in serv_adr;
     pid_t pid;
     char nickname[NICKNAME_SIZE];
+    char *ca_file = NULL;
+    int opt, level = 0;
 
-    if (argc != 3) {
-        printf("Usage: %s <IP> <port>\n", argv[0]);
+    // -t <ca.pem>: TLS로 접속하고 서버 인증서를 이 CA로 검증
+    // -z <1-9>:    압축 수준 (느린 회선용, 서버와 협상)
+    while ((opt = getopt(argc, argv, "t:z:")) != -1) {
+        if (opt == 't') {
+            ca_file = optarg;
+        } else if (opt == 'z') {
+            level = atoi(optarg);
+        } else {
+            printf("Usage: %s [-t ca.pem] [-z level] <IP> <port>\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 2) {
+        printf("Usage: %s [-t ca.pem] [-z level] <IP> <port>\n", argv[0]);
         exit(1);
     }
-
-    sock = socket(PF_INET, SOCK_STREAM, 0);
-    if (sock == -1)
-        error_handling("socket() error");
+    argv += optind - 1;
 
     memset(&serv_adr, 0, sizeof(serv_adr));
     serv_adr.sin_family = AF_INET;
     serv_adr.sin_addr.s_addr = inet_addr(argv[1]);
     serv_adr.sin_port = htons(atoi(argv[2]));
 
-    if (connect(sock, (struct sockaddr*)&serv_adr, sizeof(serv_adr)) == -1)
-        error_handling("connect() error");
-
     printf("닉네임을 입력하세요 : ");
     fgets(nickname, NICKNAME_SIZE, stdin);
     nickname[strcspn(nickname, "\n")] = 0;  // 개행 문자 제거
 
-    ChatMessage init_message = {MSG_NICKNAME, "", ""};
-    strncpy(init_message.nickname, nickname, NICKNAME_SIZE - 1);
-    init_message.nickname[NICKNAME_SIZE - 1] = '\0';
-    write(sock, &init_message, sizeof(ChatMessage));
+    srand(getpid() ^ time(NULL));
+    sock = connect_server(&serv_adr, ca_file, argv[1], nickname, level, 0, 0);
 
     // ncurses 초기화
     initscr();
@@ -78,6 +169,7 @@ int main(int argc, char *argv[]) {
     start_color();
     init_pair(1, COLOR_GREEN, COLOR_BLACK);
     init_pair(2, COLOR_YELLOW, COLOR_BLACK);
+    init_pair(3, COLOR_RED, COLOR_BLACK);
 
     // 화면 크기 가져오기
     int max_y, max_x;
@@ -103,13 +195,40 @@ int main(int argc, char *argv[]) {
 
     signal(SIGINT, handle_sigint);
 
-    pid = fork();
-    if (pid == 0) {
-        receive_messages(sock, nickname);
-    } else if (pid > 0) {
-        send_messages(sock, nickname);
-    } else {
-        error_handling("fork() error");
+    // SA_RESTART 없이 받아서 수신 프로세스가 끝나면 입력 대기(wgetch)가 깨어나게 한다
+    struct sigaction sa_chld;
+    memset(&sa_chld, 0, sizeof(sa_chld));
+    sa_chld.sa_handler = handle_sigchld;
+    sigaction(SIGCHLD, &sa_chld, NULL);
+
+    while (1) {
+        time_t started = time(NULL);
+        receiver_done = 0;
+        pid = fork();
+        if (pid == 0) {
+            receive_messages(sock, nickname);
+        } else if (pid < 0) {
+            error_handling("fork() error");
+        }
+        if (send_messages(sock, nickname) == 0) {
+            break;
+        }
+
+        // 연결이 끊겼다: 서버가 알려 준 재시도 시각(초)은 수신 프로세스의 종료 코드로 받는다
+        int status = 0;
+        waitpid(pid, &status, 0);
+        close(sock);
+        if (time(NULL) - started >= RECONNECT_STABLE_SEC) {
+            reconnect_backoff = RECONNECT_BASE_MSEC;
+        }
+        sock = connect_server(&serv_adr, ca_file, argv[1], nickname, level,
+                              WIFEXITED(status) ? WEXITSTATUS(status) * 1000 : 0, 1);
+        if (current_room[0] != '\0') {
+            ChatMessage join = {MSG_JOIN, "", ""};
+            snprintf(join.nickname, NICKNAME_SIZE, "%.*s", NICKNAME_SIZE - 1, nickname);
+            strcpy(join.content, current_room);
+            send_frame(sock, &join);
+        }
     }
     
     // ncurses 종료
@@ -120,23 +239,79 @@ int main(int argc, char *argv[]) {
 
 void receive_messages(int sock, const char *my_nickname) {
     ChatMessage message;
+    int next_pending = 0;
+    int retry_msec = 0;     // 서버가 알려 준 재시도 시각
     
     while (1) {
-        int str_len = read(sock, &message, sizeof(ChatMessage));
-        if (str_len <= 0) {
+        if (next_pending < pending_count) {
+            message = pending_msgs[next_pending++];
+        } else if (recv_frame(sock, &message) <= 0) {
             break;
         }
 
-        print_chat_message(chat_win, message.nickname, message.content, my_nickname);
+        if (message.type == MSG_PING) {
+            // 서버의 연결 확인에 바로 응답
+            ChatMessage pong = {MSG_PONG, "", ""};
+            send_frame(sock, &pong);
+            continue;
+        } else if (message.type == MSG_PRESENCE) {
+            apply_presence(&message);
+        } else if (message.type == MSG_EPHEMERAL) {
+            apply_ephemeral(&message);
+        } else if (message.type == MSG_RETRY) {
+            // 서버가 과부하로 접속을 거절했다. 곧 끊기고, 알려 준 시각이 지난 뒤 다시 접속한다.
+            char reason[16] = "";
+            sscanf(message.content, "%d %15s", &retry_msec, reason);
+            print_notice(chat_win, strcmp(reason, "full") == 0     ? "서버에 자리가 없습니다."
+                                   : strcmp(reason, "memory") == 0 ? "서버 메모리가 모자라 접속을 미룹니다."
+                                                                   : "서버가 바빠서 접속을 미룹니다.");
+        } else if (message.type == MSG_SPOOL && message.nickname[0] == '\0') {
+            // 보관된 귓속말 묶음의 끝: 받은 데까지 확인 응답을 보내면 서버가 지우고 다음 묶음을 보낸다
+            unsigned long long last_seq = 0, remaining = 0;
+            int count = 0;
+            sscanf(message.content, "%llu %d %llu", &last_seq, &count, &remaining);
+            if (count > 0) {
+                char notice[BUF_SIZE];
+                snprintf(notice, sizeof(notice), "접속하지 않은 동안 귓속말 %d개가 왔습니다.", count);
+                print_notice(chat_win, notice);
+            }
+            ChatMessage ack = {MSG_SPOOL, "", ""};
+            snprintf(ack.content, BUF_SIZE, "%llu", last_seq);
+            send_frame(sock, &ack);
+        } else if (message.type == MSG_FILE) {
+            receive_file(sock, &message);
+        } else if (message.type == MSG_WATCH) {
+            if (message.nickname[0] == '\0') {
+                print_notice(chat_win, message.content);
+            } else {
+                print_watch(chat_win, message.nickname, message.content);
+            }
+        } else if (message.type == MSG_DIRECT || message.type == MSG_SPOOL) {
+            char text[BUF_SIZE + 20];
+            if (message.nickname[0] == '\0') {
+                print_notice(chat_win, message.content);
+            } else {
+                snprintf(text, sizeof(text), "(귓속말) %s", message.content);
+                print_chat_message(chat_win, message.nickname, text, my_nickname);
+            }
+        } else if (message.type == MSG_THROTTLE
+                   || (message.type == MSG_SEARCH && message.nickname[0] == '\0')) {
+            // 검색 결과의 마지막 줄(요약)은 알림으로 보여준다
+            print_notice(chat_win, message.content);
+        } else {
+            print_chat_message(chat_win, message.nickname, message.content, my_nickname);
+        }
         
         // 입력창 다시 그리기
         redraw_input_window();
     }
-    kill(getppid(), SIGINT);
-    exit(0);
+    // 입력 프로세스가 종료를 알고 다시 접속한다 (종료 코드: 재시도까지 초)
+    print_notice(chat_win, "서버와 연결이 끊겼습니다.");
+    exit(retry_msec > 0 ? (retry_msec + 999) / 1000 : 0);
 }
 
-void send_messages(int sock, const char *nickname) {
+// 끊기면 1, 사용자가 나가면 0을 반환한다
+int send_messages(int sock, const char *nickname) {
     ChatMessage message;
     strncpy(message.nickname, nickname, NICKNAME_SIZE - 1);
     message.nickname[NICKNAME_SIZE - 1] = '\0';
@@ -146,20 +321,98 @@ void send_messages(int sock, const char *nickname) {
 
         // 사용자 입력 받기
         char input[BUF_SIZE];
-        echo();
-        mvwgetnstr(input_win, 1, 10, input, BUF_SIZE - 1);
-        noecho();
+        int got = read_input(sock, nickname, input, BUF_SIZE);
+        if (receiver_done) {
+            return 1;
+        } else if (got == ERR) {
+            continue;
+        }
 
         if (!strcmp(input, "q") || !strcmp(input, "Q")) {
             message.type = MSG_LOGOUT;
             snprintf(message.content, BUF_SIZE, "%s 님께서 퇴장했습니다.", nickname);
-            write(sock, &message, sizeof(ChatMessage));
-            break;
+            send_frame(sock, &message);
+            return 0;
+        }
+
+        // 방 이동: /join <방 이름>
+        if (!strncmp(input, "/join ", 6)) {
+            message.type = MSG_JOIN;
+            strncpy(message.content, input + 6, BUF_SIZE - 1);
+            message.content[BUF_SIZE - 1] = '\0';
+            send_frame(sock, &message);
+            strcpy(current_room, message.content);
+
+            char notice[BUF_SIZE + 32]; // 방 이름 뒤에 붙는 안내문(30바이트)까지 담는다
+            snprintf(notice, sizeof(notice), "%s 방으로 이동했습니다.", message.content);
+            print_notice(chat_win, notice);
+            continue;
+        }
+
+        // 대화 검색: /search <검색어> [from:<닉네임>] [room:<방>] [since:7d] [until:1h]
+        if (!strncmp(input, "/search ", 8)) {
+            ChatMessage query = {MSG_SEARCH, "", ""};
+            strncpy(query.nickname, nickname, NICKNAME_SIZE - 1);
+            strncpy(query.content, input + 8, BUF_SIZE - 1);
+            send_frame(sock, &query);
+            continue;
+        }
+
+        // 첨부 파일: /send <파일 경로>, /get <번호>
+        if (!strncmp(input, "/send ", 6)) {
+            send_file(sock, nickname, input + 6);
+            continue;
+        }
+        if (!strncmp(input, "/get ", 5)) {
+            ChatMessage get = {MSG_FILE, "", ""};
+            strncpy(get.nickname, nickname, NICKNAME_SIZE - 1);
+            snprintf(get.content, BUF_SIZE, "get %s", input + 5);
+            send_frame(sock, &get);
+            continue;
+        }
+
+        // 알림 키워드: /watch <키워드> [room:<방 패턴>], /unwatch <키워드>, /watch (목록)
+        if (!strcmp(input, "/watch") || !strncmp(input, "/watch ", 7) || !strncmp(input, "/unwatch ", 9)) {
+            ChatMessage watch = {MSG_WATCH, "", "list"};
+            strncpy(watch.nickname, nickname, NICKNAME_SIZE - 1);
+            if (input[1] == 'u') {
+                snprintf(watch.content, BUF_SIZE, "-%s", input + 9);
+            } else if (input[6] == ' ') {
+                snprintf(watch.content, BUF_SIZE, "+%s", input + 7);
+            }
+            send_frame(sock, &watch);
+            continue;
+        }
+
+        // 반응: /react <이모지> [<n번째 전 메시지>] (기본은 마지막 메시지, 다시 누르면 거둔다)
+        if (!strncmp(input, "/react ", 7)) {
+            ChatMessage react = {MSG_EPHEMERAL, "", ""};
+            strncpy(react.nickname, nickname, NICKNAME_SIZE - 1);
+            snprintf(react.content, BUF_SIZE, "react %s", input + 7);
+            send_frame(sock, &react);
+            continue;
         }
+
+        // 귓속말: /dm <닉네임> <내용> (접속하지 않았으면 서버가 보관했다가 로그인할 때 전달한다)
+        if (!strncmp(input, "/dm ", 4)) {
+            ChatMessage dm = {MSG_DIRECT, "", ""};
+            char *text = strchr(input + 4, ' ');
+            strncpy(dm.nickname, nickname, NICKNAME_SIZE - 1);
+            strncpy(dm.content, input + 4, BUF_SIZE - 1);
+            send_frame(sock, &dm);
+
+            if (text != NULL) {
+                char shown[BUF_SIZE + 20];
+                snprintf(shown, sizeof(shown), "(%.*s 님에게) %s", (int)(text - input - 4), input + 4, text + 1);
+                print_chat_message(chat_win, nickname, shown, nickname);
+            }
+            continue;
+        }
+
         message.type = MSG_CHAT;
         strncpy(message.content, input, BUF_SIZE - 1);
         message.content[BUF_SIZE - 1] = '\0';
-        write(sock, &message, sizeof(ChatMessage));
+        send_frame(sock, &message);
 
         print_chat_message(chat_win, nickname, message.content, nickname);
 
@@ -168,11 +421,11 @@ void send_messages(int sock, const char *nickname) {
         box(input_win, 0, 0);
         wrefresh(input_win);
     }
+    return 0;
 }
 
 void print_chat_message(WINDOW *chat_win, const char *nickname, const char *message, const char *my_nickname) {
-    int max_y, max_x;
-    getmaxyx(chat_win, max_y, max_x);
+    int max_x = getmaxx(chat_win);
 
     // 현재 커서 위치 확인
     int cur_y, cur_x;
@@ -214,6 +467,45 @@ void print_chat_message(WINDOW *chat_win, const char *nickname, const char *mess
     wrefresh(input_win);
 }
 
+// 서버 알림은 노란색으로 출력
+void print_notice(WINDOW *chat_win, const char *notice) {
+    int cur_y, cur_x;
+    getyx(chat_win, cur_y, cur_x);
+
+    wmove(chat_win, cur_y, 0);
+    wattron(chat_win, COLOR_PAIR(2));
+    wprintw(chat_win, "* %s", notice);
+    wattroff(chat_win, COLOR_PAIR(2));
+    wmove(chat_win, cur_y + 1, 0);
+    wrefresh(chat_win);
+
+    getyx(input_win, cur_y, cur_x);
+    redraw_input_window();
+    wmove(input_win, cur_y, cur_x);
+    wrefresh(input_win);
+}
+
+// 언급/키워드 알림은 빨간색으로 눈에 띄게 출력하고 소리를 낸다 (content: "<방>\n<내용>")
+void print_watch(WINDOW *chat_win, const char *nickname, const char *content) {
+    int cur_y, cur_x;
+    const char *text = strchr(content, '\n');
+    int room_len = text != NULL ? (int)(text - content) : 0;
+
+    getyx(chat_win, cur_y, cur_x);
+    wmove(chat_win, cur_y, 0);
+    wattron(chat_win, COLOR_PAIR(3) | A_BOLD);
+    wprintw(chat_win, "! [%.*s] %s: %s", room_len, content, nickname, text != NULL ? text + 1 : content);
+    wattroff(chat_win, COLOR_PAIR(3) | A_BOLD);
+    wmove(chat_win, cur_y + 1, 0);
+    wrefresh(chat_win);
+    beep();
+
+    getyx(input_win, cur_y, cur_x);
+    redraw_input_window();
+    wmove(input_win, cur_y, cur_x);
+    wrefresh(input_win);
+}
+
 void error_handling(char *message) {
     endwin();  // ncurses 종료
     fputs(message, stderr);
@@ -222,20 +514,514 @@ void error_handling(char *message) {
 }
 
 void handle_sigint(int sig) {
+    (void)sig;
     printf("\n채팅을 종료합니다.\n");
     ChatMessage logout_message = {MSG_LOGOUT, "", ""};
     strncpy(logout_message.nickname, "", NICKNAME_SIZE - 1);
     logout_message.nickname[NICKNAME_SIZE - 1] = '\0';
     snprintf(logout_message.content, BUF_SIZE, "%s 님께서 퇴장했습니다.", "");
-    send(sock, &logout_message, sizeof(logout_message), 0);
+    send_frame(sock, &logout_message);
     close(sock);
     exit(0);
 }
 
+void handle_sigchld(int sig) {
+    (void)sig;
+    receiver_done = 1;
+}
+
+// 서버에 접속해 닉네임을 알리고 구독을 켠다. wait이면 먼저 기다렸다가 접속하고, 실패할 때마다
+// 대기 간격을 두 배로 늘린다. 모두가 같은 간격으로 다시 몰리지 않도록 실제 대기는 [0, 간격) 사이에서
+// 고르게 뽑고 (full jitter), 서버가 알려 준 재시도 시각(retry_msec)은 그 앞에 더한다.
+int connect_server(struct sockaddr_in *addr, const char *ca_file, const char *server_ip, const char *nickname,
+                   int level, int retry_msec, int wait) {
+    char notice[BUF_SIZE];
+    int fd;
+
+    while (1) {
+        if (wait) {
+            int delay = retry_msec + rand() % reconnect_backoff;
+            struct timespec ts = {delay / 1000, delay % 1000 * 1000000L};
+            snprintf(notice, sizeof(notice), "%.1f초 뒤에 다시 접속합니다.", delay / 1000.0);
+            if (chat_win != NULL) {
+                print_notice(chat_win, notice);
+            } else {
+                printf("%s\n", notice);
+            }
+            while (nanosleep(&ts, &ts) == -1) {
+            }
+            reconnect_backoff = reconnect_backoff * 2 < RECONNECT_MAX_MSEC ? reconnect_backoff * 2 : RECONNECT_MAX_MSEC;
+            retry_msec = 0;
+        }
+        wait = 1;
+
+        if ((fd = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
+            error_handling("socket() error");
+        }
+        if (connect(fd, (struct sockaddr *)addr, sizeof(*addr)) == 0
+            && (ca_file == NULL || tls_connect(fd, ca_file, server_ip) == 0)) {
+            break;
+        }
+        close(fd);
+    }
+
+    // 압축은 연결마다 새로 협상한다
+    if (compress_level > 0) {
+        deflateEnd(&deflater);
+        inflateEnd(&inflater);
+        compress_level = 0;
+    }
+    pending_count = 0;
+
+    ChatMessage init_message = {MSG_NICKNAME, "", ""};
+    strncpy(init_message.nickname, nickname, NICKNAME_SIZE - 1);
+    init_message.nickname[NICKNAME_SIZE - 1] = '\0';
+    if (level >= 1 && level <= 9) {
+        snprintf(init_message.content, BUF_SIZE, "[CAPS]deflate=%d", level);
+    }
+    write(fd, &init_message, sizeof(ChatMessage));
+    if (level >= 1 && level <= 9) {
+        negotiate_compression(fd, level);
+    }
+
+    // 접속자 목록 구독 (방에 들어가면 전체 목록, 그 뒤로는 변경분이 온다)
+    ChatMessage presence_msg = {MSG_PRESENCE, "", "on"};
+    strcpy(presence_msg.nickname, init_message.nickname);
+    send_frame(fd, &presence_msg);
+
+    // 언급 알림 구독 (다른 방에서 "@닉네임"으로 부르면 알려준다)
+    ChatMessage watch_msg = {MSG_WATCH, "", "on"};
+    strcpy(watch_msg.nickname, init_message.nickname);
+    send_frame(fd, &watch_msg);
+
+    // 입력 중 표시와 반응 구독 (서버가 방마다 모아서 틱마다 보낸다)
+    ChatMessage ephemeral_msg = {MSG_EPHEMERAL, "", "on"};
+    strcpy(ephemeral_msg.nickname, init_message.nickname);
+    send_frame(fd, &ephemeral_msg);
+    return fd;
+}
+
+// 핸드셰이크 후 암복호화를 커널(kTLS)에 넘긴다.
+// 송신/수신 프로세스가 소켓을 나눠 쓰므로 이후에는 평문 소켓처럼 read()/write() 한다.
+// 핸드셰이크 중에 연결이 끊기면 -1 (다시 접속한다). 인증서를 믿을 수 없으면 종료한다.
+int tls_connect(int sock, const char *ca_file, const char *server_ip) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    SSL *ssl;
+
+    if (ctx == NULL) {
+        error_handling("SSL_CTX_new() error");
+    }
+    // 서버와 같은 이유로 TLS 1.2 + AES-GCM (OpenSSL 3.0의 kTLS 수신 지원 범위)
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_NO_TICKET);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    if (SSL_CTX_load_verify_locations(ctx, ca_file, NULL) != 1) {
+        error_handling("CA 인증서를 읽을 수 없습니다.");
+    }
+
+    ssl = SSL_new(ctx);
+    SSL_set_fd(ssl, sock);
+    X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), server_ip);
+    if (SSL_connect(ssl) != 1) {
+        if (SSL_get_verify_result(ssl) != X509_V_OK) {
+            error_handling("TLS 핸드셰이크 실패 (서버 인증서를 확인하세요)");
+        }
+        SSL_free(ssl);
+        SSL_CTX_free(ctx);
+        return -1;
+    }
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl)) != 1 || BIO_get_ktls_recv(SSL_get_rbio(ssl)) != 1) {
+        error_handling("커널 TLS(kTLS)를 사용할 수 없습니다. (sudo modprobe tls)");
+    }
+    SSL_free(ssl);
+    SSL_CTX_free(ctx);
+    return 0;
+}
+
 void redraw_input_window() {
     werase(input_win);
     box(input_win, 0, 0);
     mvwprintw(input_win, 1, 1, "메시지: ");
     wmove(input_win, 1, 10);  // 커서를 입력 위치로 이동
     wrefresh(input_win);
-}
\ No newline at end of file
+}
+// 서버의 압축 협상 응답(MSG_CAPS)을 기다린다. 그 전에 온 메시지는 보관했다가 화면에 보여준다.
+// 압축을 모르는 서버는 응답하지 않으므로 시간이 지나면 고정 크기 프레임으로 계속한다.
+void negotiate_compression(int sock, int level) {
+    struct timeval tv = {3, 0};
+    ChatMessage message;
+
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    while (read_full(sock, &message, sizeof(ChatMessage)) > 0) {
+        if (message.type != MSG_CAPS) {
+            if (pending_count < MAX_PENDING) {
+                pending_msgs[pending_count++] = message;
+            }
+            continue;
+        }
+        if (sscanf(message.content, "deflate=%d,min=%d", &compress_level, &compress_min) == 2
+            && (deflateInit2(&deflater, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK
+                || inflateInit2(&inflater, -15) != Z_OK)) {
+            error_handling("zlib 초기화 실패");
+        }
+        break;
+    }
+    tv.tv_sec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+// 협상 결과에 맞게 한 프레임을 보낸다 (짧은 메시지는 압축하지 않는다)
+int send_frame(int sock, ChatMessage *message) {
+    unsigned char wire[WIRE_MAX];
+    size_t used, zlen;
+
+    if (compress_level == 0) {
+        return write(sock, message, sizeof(ChatMessage));
+    }
+
+    // content 뒤의 0은 보내지 않는다
+    used = offsetof(ChatMessage, content) + strnlen(message->content, BUF_SIZE);
+    zlen = used;
+    wire[2] = 0;
+    if (used - offsetof(ChatMessage, content) >= (size_t)compress_min
+        && deflateReset(&deflater) == Z_OK
+        && deflateSetDictionary(&deflater, (const Bytef *)compress_dict, sizeof(compress_dict) - 1) == Z_OK) {
+        deflater.next_in = (Bytef *)message;
+        deflater.avail_in = used;
+        deflater.next_out = wire + WIRE_HDR;
+        deflater.avail_out = WIRE_MAX - WIRE_HDR;
+        if (deflate(&deflater, Z_FINISH) == Z_STREAM_END && WIRE_MAX - WIRE_HDR - deflater.avail_out < used) {
+            zlen = WIRE_MAX - WIRE_HDR - deflater.avail_out;
+            wire[2] = WIRE_DEFLATE;
+        }
+    }
+    if (wire[2] == 0) {
+        memcpy(wire + WIRE_HDR, message, used);
+    }
+    wire[0] = zlen >> 8;
+    wire[1] = zlen & 0xff;
+    return write(sock, wire, WIRE_HDR + zlen);
+}
+
+// 한 프레임을 받아 ChatMessage로 되돌린다. 연결이 끊기거나 잘못된 프레임이면 0 이하.
+int recv_frame(int sock, ChatMessage *message) {
+    unsigned char wire[WIRE_MAX];
+    size_t len;
+
+    if (compress_level == 0) {
+        // 첨부 파일 조각 사이에서 프레임이 나뉘어 올 수 있으므로 한 프레임을 다 읽는다
+        return read_full(sock, message, sizeof(ChatMessage));
+    }
+
+    if (read_full(sock, wire, WIRE_HDR) <= 0) {
+        return 0;
+    }
+    len = (wire[0] << 8) | wire[1];
+    if (len > WIRE_MAX - WIRE_HDR || read_full(sock, wire + WIRE_HDR, len) <= 0) {
+        return 0;
+    }
+
+    memset(message, 0, sizeof(ChatMessage));
+    if (!(wire[2] & WIRE_DEFLATE)) {
+        if (len > sizeof(ChatMessage)) {
+            return 0;
+        }
+        memcpy(message, wire + WIRE_HDR, len);
+        return sizeof(ChatMessage);
+    }
+    if (inflateReset(&inflater) != Z_OK
+        || inflateSetDictionary(&inflater, (const Bytef *)compress_dict, sizeof(compress_dict) - 1) != Z_OK) {
+        return 0;
+    }
+    inflater.next_in = wire + WIRE_HDR;
+    inflater.avail_in = len;
+    inflater.next_out = (Bytef *)message;
+    inflater.avail_out = sizeof(ChatMessage);
+    return inflate(&inflater, Z_FINISH) == Z_STREAM_END ? (int)sizeof(ChatMessage) : 0;
+}
+
+int read_full(int sock, void *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(sock, (char *)buf + got, len - got);
+        if (n <= 0) {
+            return n;
+        }
+        got += n;
+    }
+    return got;
+}
+
+// 접속자 목록 프레임을 반영한다. 전체 목록이 아니면 들고 난 사람을 알림으로 보여준다.
+void apply_presence(ChatMessage *message) {
+    char joined[BUF_SIZE * 2] = "", left[BUF_SIZE * 2] = "";
+    char *save, *line;
+
+    snprintf(member_room, sizeof(member_room), "%.*s", NICKNAME_SIZE - 1, message->nickname);
+    message->content[BUF_SIZE - 1] = '\0';
+    for (line = strtok_r(message->content, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+        const char *name = line + 1;
+        int i;
+        for (i = 0; i < member_count && strcmp(members[i], name) != 0; i++) {
+        }
+
+        if (line[0] == '=' && name[0] == '\0') {
+            member_count = 0;
+        } else if ((line[0] == '=' || line[0] == '+') && i == member_count && member_count < MAX_MEMBERS) {
+            strncpy(members[member_count], name, NICKNAME_SIZE - 1);
+            members[member_count++][NICKNAME_SIZE - 1] = '\0';
+            if (line[0] == '+') {
+                snprintf(joined + strlen(joined), sizeof(joined) - strlen(joined), "%s%s", joined[0] ? ", " : "", name);
+            }
+        } else if (line[0] == '-' && i < member_count) {
+            // 마지막 사람을 빈자리로 옮긴다 (순서는 상관없다)
+            member_count--;
+            memmove(members[i], members[member_count], NICKNAME_SIZE);
+            snprintf(left + strlen(left), sizeof(left) - strlen(left), "%s%s", left[0] ? ", " : "", name);
+        }
+    }
+
+    if (joined[0] != '\0') {
+        char notice[BUF_SIZE * 2 + 20];
+        snprintf(notice, sizeof(notice), "입장: %s", joined);
+        print_notice(chat_win, notice);
+    }
+    if (left[0] != '\0') {
+        char notice[BUF_SIZE * 2 + 20];
+        snprintf(notice, sizeof(notice), "퇴장: %s", left);
+        print_notice(chat_win, notice);
+    }
+    draw_member_line();
+}
+
+// 구분선 자리에 지금 방과 접속자 목록을 보여준다. 폭을 넘는 이름은 "..."으로 줄인다.
+void draw_member_line() {
+    char line[1024];
+    int max_y, max_x, cur_y, cur_x;
+    int len;
+
+    getmaxyx(stdscr, max_y, max_x);
+    len = snprintf(line, sizeof(line), " %s %d명: ", member_room, member_count);
+    for (int i = 0; i < member_count; i++) {
+        // 입력 중 표시가 들어갈 자리는 남긴다
+        int need = len + (int)strlen(members[i]) + 6 + (int)strlen(typing_text);
+        if (need > max_x - 4 || need > (int)sizeof(line)) {
+            len += snprintf(line + len, sizeof(line) - len, "...");
+            break;
+        }
+        len += snprintf(line + len, sizeof(line) - len, "%s%s", i > 0 ? ", " : "", members[i]);
+    }
+    if (typing_text[0] != '\0') {
+        len += snprintf(line + len, sizeof(line) - len, " | %s", typing_text);
+    }
+    snprintf(line + len, sizeof(line) - len, " ");
+
+    mvhline(max_y - 4, 0, ACS_HLINE, max_x);
+    mvprintw(max_y - 4, 2, "%s", line);
+    refresh();
+
+    getyx(input_win, cur_y, cur_x);
+    redraw_input_window();
+    wmove(input_win, cur_y, cur_x);
+    wrefresh(input_win);
+}
+
+// 파일을 조각으로 나눠 올린다. 조각마다 data 프레임 뒤에 원시 바이트를 sendfile()로 붙인다.
+// 다 올릴 때까지 입력은 기다리지만 수신 프로세스는 계속 채팅을 보여준다.
+// (수신 프로세스가 쓰는 PONG은 서버가 한동안 아무것도 받지 못했을 때만 오므로 조각 사이에 끼지 않는다)
+void send_file(int sock, const char *nickname, const char *path) {
+    ChatMessage frame = {MSG_FILE, "", ""};
+    struct stat st;
+    const char *name = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+    off_t off = 0;
+    int fd = open(path, O_RDONLY);
+    char notice[BUF_SIZE + 40];
+
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        snprintf(notice, sizeof(notice), "파일을 열 수 없습니다: %s", path);
+        print_notice(chat_win, notice);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    strncpy(frame.nickname, nickname, NICKNAME_SIZE - 1);
+    upload_token++;
+    snprintf(frame.content, BUF_SIZE, "put %d %lld %.60s", upload_token, (long long)st.st_size, name);
+    send_frame(sock, &frame);
+    snprintf(notice, sizeof(notice), "올리는 중: %s (%lld바이트)", name, (long long)st.st_size);
+    print_notice(chat_win, notice);
+
+    while (off < st.st_size) {
+        size_t len = st.st_size - off < ATTACH_CHUNK ? (size_t)(st.st_size - off) : ATTACH_CHUNK;
+        snprintf(frame.content, BUF_SIZE, "data %d %zu", upload_token, len);
+        send_frame(sock, &frame);
+        while (len > 0) {
+            ssize_t n = sendfile(sock, fd, &off, len);
+            if (n <= 0) {
+                close(fd);
+                error_handling("파일을 보내는 중 연결이 끊겼습니다.");
+            }
+            len -= n;
+        }
+    }
+    close(fd);
+}
+
+// 서버가 보낸 첨부 파일 프레임. data 뒤에 오는 원시 바이트는 여기서 다 읽는다.
+void receive_file(int sock, ChatMessage *message) {
+    char notice[BUF_SIZE + 80], name[BUF_SIZE];
+    static char chunk[ATTACH_CHUNK];
+    unsigned id;
+    long long size, off;
+    size_t len;
+    int k;
+
+    if (sscanf(message->content, "new %u %lld %99[^\n]", &id, &size, name) == 3) {
+        snprintf(notice, sizeof(notice), "%s 님이 파일을 올렸습니다: %s (%lld바이트, /get %u)",
+                 message->nickname, name, size, id);
+        print_notice(chat_win, notice);
+    } else if (sscanf(message->content, "begin %u %lld %99[^\n]", &id, &size, name) == 3) {
+        for (k = 0; k < MAX_DOWNLOADS && downloads[k].fd != -1; k++) {
+        }
+        if (k == MAX_DOWNLOADS) {
+            return;
+        }
+        // 같은 이름이 있으면 번호를 앞에 붙인다
+        snprintf(downloads[k].path, sizeof(downloads[k].path), "%.70s", name);
+        if (access(downloads[k].path, F_OK) == 0) {
+            snprintf(downloads[k].path, sizeof(downloads[k].path), "%u-%.60s", id, name);
+        }
+        downloads[k].fd = open(downloads[k].path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        downloads[k].id = id;
+        downloads[k].size = size;
+        downloads[k].got = 0;
+        snprintf(notice, sizeof(notice), "받는 중: %s", downloads[k].path);
+        print_notice(chat_win, notice);
+    } else if (sscanf(message->content, "data %u %lld %zu", &id, &off, &len) == 3 && len <= ATTACH_CHUNK) {
+        if (read_full(sock, chunk, len) <= 0 && len > 0) {
+            return;
+        }
+        for (k = 0; k < MAX_DOWNLOADS && !(downloads[k].fd != -1 && downloads[k].id == id); k++) {
+        }
+        if (k == MAX_DOWNLOADS) {
+            return;
+        }
+        pwrite(downloads[k].fd, chunk, len, off);
+        downloads[k].got += len;
+        if (downloads[k].got >= downloads[k].size) {
+            close(downloads[k].fd);
+            downloads[k].fd = -1;
+            snprintf(notice, sizeof(notice), "받기 완료: %s", downloads[k].path);
+            print_notice(chat_win, notice);
+        }
+    } else if (!strncmp(message->content, "error ", 6)) {
+        print_notice(chat_win, message->content + 6);
+    }
+}
+
+// 한 줄을 입력받는다. 채팅을 입력하는 동안에는 TYPING_REFRESH_SEC마다 "typing"을, 다 지우면 "idle"을 보낸다
+// (명령은 알리지 않는다. 보낸 채팅은 서버가 알아서 지운다). 수신 프로세스가 끝나면 ERR를 돌려준다.
+int read_input(int sock, const char *nickname, char *input, int size) {
+    ChatMessage typing = {MSG_EPHEMERAL, "", ""};
+    time_t announced = 0;
+    int len = 0;
+
+    strncpy(typing.nickname, nickname, NICKNAME_SIZE - 1);
+    keypad(input_win, TRUE);
+    wtimeout(input_win, 200);   // 수신 프로세스가 끝났는지 보려고 가끔 깨어난다
+    wmove(input_win, 1, 10);
+    input[0] = '\0';
+
+    while (1) {
+        int ch = wgetch(input_win);
+        if (receiver_done) {
+            return ERR;
+        } else if (ch == ERR) {
+            continue;
+        } else if (ch == '\n' || ch == '\r' || ch == KEY_ENTER) {
+            return len;
+        } else if (ch == KEY_BACKSPACE || ch == 127 || ch == '\b') {
+            // UTF-8 글자 하나를 통째로 지운다
+            while (len > 0 && (input[--len] & 0xC0) == 0x80) {
+            }
+        } else if (ch >= ' ' && ch < 256 && len < size - 1) {
+            input[len++] = ch;
+        } else {
+            continue;
+        }
+        input[len] = '\0';
+
+        // 여러 바이트로 된 글자는 마지막 바이트까지 들어온 뒤에 그린다
+        int lead = len;
+        while (lead > 0 && (input[lead - 1] & 0xC0) == 0x80) {
+            lead--;
+        }
+        if (lead > 0 && (unsigned char)input[lead - 1] >= 0xC0) {
+            unsigned char c = input[lead - 1];
+            if (len - lead + 1 < (c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2)) {
+                continue;
+            }
+        }
+        mvwprintw(input_win, 1, 10, "%s", input);
+        wclrtoeol(input_win);
+        box(input_win, 0, 0);
+        wrefresh(input_win);
+
+        if (len > 0 && input[0] != '/' && time(NULL) - announced >= TYPING_REFRESH_SEC) {
+            strcpy(typing.content, "typing");
+            send_frame(sock, &typing);
+            announced = time(NULL);
+        } else if (len == 0 && announced != 0) {
+            strcpy(typing.content, "idle");
+            send_frame(sock, &typing);
+            announced = 0;
+        }
+    }
+}
+
+// 입력 중 표시는 구분선에 덧붙이고, 반응 수는 알림 줄로 보여준다
+void apply_ephemeral(ChatMessage *message) {
+    char notice[BUF_SIZE * 2];
+    char *rest;
+    int count = 0;
+
+    message->content[BUF_SIZE - 1] = '\0';
+    if (message->nickname[0] == '\0') {
+        print_notice(chat_win, message->content);
+        return;
+    }
+    rest = strchr(message->content, '\n');
+    if (rest != NULL) {
+        *rest++ = '\0';
+    }
+
+    if (sscanf(message->content, "typing %d", &count) == 1) {
+        // "typing <수>" 뒤로 줄마다 이름
+        typing_text[0] = '\0';
+        if (count > TYPING_NAMES) {
+            snprintf(typing_text, sizeof(typing_text), "%d명 입력 중...", count);
+        } else if (count > 0) {
+            char *save, *name;
+            size_t len = 0;
+            for (name = strtok_r(rest, "\n", &save); name != NULL; name = strtok_r(NULL, "\n", &save)) {
+                len += snprintf(typing_text + len, sizeof(typing_text) - len, "%s%s", len > 0 ? ", " : "", name);
+            }
+            snprintf(typing_text + len, sizeof(typing_text) - len, " 입력 중...");
+        }
+        draw_member_line();
+    } else if (!strncmp(message->content, "react ", 6)) {
+        // "react <id> <이모지>:<수> ..." 뒤 줄에 "<보낸 사람>: <메시지 앞부분>"
+        char *counts = strchr(message->content + 6, ' ');
+        for (char *p = counts; p != NULL && *p != '\0'; p++) {
+            if (*p == ':') {
+                *p = ' ';
+            }
+        }
+        snprintf(notice, sizeof(notice), "반응 [%s] %s", rest != NULL ? rest : "",
+                 counts != NULL ? counts + 1 : "(없음)");
+        print_notice(chat_win, notice);
+    }
+}
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+#define LISTEN_FDS_START 3
+#define RESTART_DELAY_USEC 100000  // 서버가 비정상 종료했을 때 다시 띄우기 전 대기
+
+// 소켓 활성화 런처
+// 리스닝 소켓을 직접 열어 두고 LISTEN_FDS 규약으로 서버에게 넘긴다.
+// 서버가 재시작되는 동안에도 소켓은 런처가 쥐고 있으므로 들어온 연결이 대기열에 남는다.
+//
+//   ./launcher [-b backlog] <port> ./server -D [옵션]
+//
+// SIGHUP: 서버를 재시작, SIGTERM/SIGINT: 서버와 함께 종료
+
+static volatile sig_atomic_t restart_requested = 0;
+static volatile sig_atomic_t stop_requested = 0;
+
+void sighup_handler(int signo);
+void sigterm_handler(int signo);
+int open_listener(int port, int backlog);
+pid_t spawn_server(char **server_argv);
+
+int main(int argc, char **argv) {
+    struct sigaction sa;
+    int backlog = SOMAXCONN;
+    int opt, lsock;
+    int restarting = 0;
+    pid_t child;
+
+    while ((opt = getopt(argc, argv, "+b:")) != -1) {
+        switch (opt) {
+        case 'b':
+            backlog = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-b backlog] <port> <server> [server args...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind < 2) {
+        fprintf(stderr, "Usage: %s [-b backlog] <port> <server> [server args...]\n", argv[0]);
+        return 1;
+    }
+
+    if ((lsock = open_listener(atoi(argv[optind]), backlog)) < 0) {
+        return 1;
+    }
+
+    sa.sa_handler = sighup_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGHUP, &sa, NULL);
+    sa.sa_handler = sigterm_handler;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    child = spawn_server(argv + optind + 1);
+    while (!stop_requested) {
+        pid_t pid = waitpid(child, NULL, 0);
+
+        if (pid < 0 && errno == EINTR) {
+            if (restart_requested) {
+                // 서버만 내리고 소켓은 유지한다
+                kill(child, SIGTERM);
+                restarting = 1;
+                restart_requested = 0;
+            }
+            continue;
+        }
+        if (stop_requested) {
+            break;
+        }
+        if (!restarting) {
+            // 스스로 종료한 경우 (-D 없이 데몬으로 떠난 경우 포함) 너무 빨리 반복하지 않는다
+            usleep(RESTART_DELAY_USEC);
+        }
+        restarting = 0;
+        printf("서버 재시작\n");
+        fflush(stdout);
+        child = spawn_server(argv + optind + 1);
+    }
+
+    kill(child, SIGTERM);
+    waitpid(child, NULL, 0);
+    close(lsock);
+    return 0;
+}
+
+void sighup_handler(int signo) {
+    (void)signo;
+    restart_requested = 1;
+}
+
+void sigterm_handler(int signo) {
+    (void)signo;
+    stop_requested = 1;
+}
+
+// 리스닝 소켓을 만들어 LISTEN_FDS_START 번 fd에 둔다
+int open_listener(int port, int backlog) {
+    struct sockaddr_in servaddr;
+    int on = 1;
+    int sock;
+
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("socket()");
+        return -1;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    servaddr.sin_port = htons(port);
+
+    if (bind(sock, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
+        perror("bind()");
+        return -1;
+    }
+    if (listen(sock, backlog) < 0) {
+        perror("listen()");
+        return -1;
+    }
+
+    if (sock != LISTEN_FDS_START) {
+        if (dup2(sock, LISTEN_FDS_START) < 0) {
+            perror("dup2()");
+            return -1;
+        }
+        close(sock);
+    }
+    return LISTEN_FDS_START;
+}
+
+pid_t spawn_server(char **server_argv) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        char pid_str[16];
+        snprintf(pid_str, sizeof(pid_str), "%d", (int)getpid());
+        setenv("LISTEN_PID", pid_str, 1);
+        setenv("LISTEN_FDS", "1", 1);
+        execv(server_argv[0], server_argv);
+        perror("execv()");
+        _exit(127);
+    } else if (pid < 0) {
+        perror("fork()");
+        exit(1);
+    }
+    return pid;
+}
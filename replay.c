@@ -0,0 +1,593 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define BUF_SIZE 100
+#define NICKNAME_SIZE 20
+#define CAPTURE_MAGIC "VCAP"
+#define CAPTURE_VERSION 1
+#define DRAIN_USEC 2000000   // 다 보낸 뒤 늦게 도착하는 프레임을 기다리는 시간
+#define MAX_SUMMARY 16
+#define SYNTH_GAP_USEC 250   // 합성 부하에서 프레임 사이 간격 (배속 1일 때)
+
+// 트래픽 재생 도구
+// 서버의 -c 로 기록한 캡처 파일을 읽어 같은 연결을 다시 만들고, 같은 프레임을 같은 간격으로
+// (또는 N배속, 최대 속도로) 보낸다. 보낸 채팅이 다른 연결에 처음 도착할 때까지의 지연과
+// 처리량을 재서 출력하고, 이전 결과 파일과 비교할 수 있다.
+//
+//   ./replay [-s 배속] [-o 결과 파일] [-C 비교할 결과 파일] <capture> <IP> <port>
+//   ./replay [-s 배속] [-o 결과 파일] [-C 비교할 결과 파일] -g <연결 수>,<라운드> <IP> <port>
+//
+// 배속 1은 캡처한 속도 그대로, 0은 기다리지 않고 최대 속도로 보낸다.
+// -g 는 캡처 파일 대신 합성 부하를 만든다: 모든 연결이 로그인한 뒤 라운드마다 한 번씩 채팅하고,
+// 라운드마다 한 연결은 로그아웃했다가 다시 접속한다 (서버 비교용, Makefile의 compare 참고).
+
+// server.c와 같아야 한다
+typedef enum {
+    MSG_NICKNAME,
+    MSG_CHAT,
+    MSG_LOGOUT,
+    MSG_JOIN,
+    MSG_THROTTLE,
+    MSG_PING,
+    MSG_PONG,
+    MSG_CAPS,
+    MSG_SEARCH,
+    MSG_PRESENCE,
+    MSG_DIRECT,
+    MSG_SPOOL,
+    MSG_FILE,
+    MSG_WATCH,
+    MSG_RETRY,
+    MSG_EPHEMERAL
+} MessageType;
+
+typedef struct {
+    MessageType type;
+    char nickname[NICKNAME_SIZE];
+    char content[BUF_SIZE];
+} ChatMessage;
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    int64_t start_time;
+} CaptureHeader;
+
+typedef enum {
+    CAPTURE_OPEN,
+    CAPTURE_FRAME,
+    CAPTURE_CLOSE
+} CaptureKind;
+
+typedef struct {
+    uint32_t usec_delta;
+    uint32_t conn;
+    uint16_t kind;
+    uint16_t len;
+} CaptureRecord;
+
+// 재생 중인 연결
+typedef struct {
+    int fd;
+    size_t rx_len;
+    unsigned char rx[sizeof(ChatMessage)];
+} ReplayConn;
+
+// 보낸 채팅 (닉네임과 내용의 해시로 찾는다)
+typedef struct {
+    uint64_t hash;
+    long long sent_usec;
+    uint32_t nth;      // 같은 닉네임과 내용으로 몇 번째 보낸 채팅인지 (0부터)
+    int matched;
+} PendingChat;
+
+// 연결마다 같은 해시의 채팅을 몇 번 받았는지. 한 연결에는 보낸 순서대로 도착하므로
+// k번째로 받은 것은 k번째로 보낸 채팅이다 (같은 내용을 여러 번 보내도 섞이지 않는다).
+typedef struct {
+    uint64_t hash;
+    uint32_t conn;
+    uint32_t count;
+} RecvCount;
+
+// 결과 요약 (결과 파일에 "이름=값" 으로 저장)
+typedef struct {
+    const char *name;
+    double value;
+} SummaryItem;
+
+static ReplayConn *conns;
+static uint32_t max_conn;
+static PendingChat *pending;
+static size_t pending_mask;
+static RecvCount *recv_counts;
+static size_t recv_mask, recv_used;
+static uint32_t *latencies;
+static size_t latency_count;
+static unsigned long frames_sent, frames_recv, pings;
+static long long last_recv_usec;  // 마지막으로 프레임을 받은 시각
+static struct sockaddr_in serv_adr;
+
+long long now_usec(void);
+uint64_t chat_hash(ChatMessage *message);
+int recv_count_next(uint32_t id, uint64_t hash);
+size_t recv_slot(RecvCount *table, size_t mask, uint32_t id, uint64_t hash);
+void open_conn(uint32_t id);
+void close_conn(uint32_t id);
+void send_frame(uint32_t id, ChatMessage *message);
+void pump(int timeout_ms);
+void handle_frame(uint32_t id, ChatMessage *message);
+int compare_u32(const void *a, const void *b);
+unsigned char *synth_capture(uint32_t nconns, uint32_t rounds, size_t *size);
+unsigned char *synth_put(unsigned char *p, CaptureKind kind, uint32_t conn, MessageType type, const char *text);
+void print_summary(SummaryItem *items, int count, const char *out_path, const char *baseline_path);
+
+int main(int argc, char **argv) {
+    char *out_path = NULL, *baseline_path = NULL, *synth = NULL;
+    double speed = 1.0;
+    unsigned char *data;
+    size_t size, off;
+    struct stat st;
+    CaptureHeader head;
+    unsigned long chats = 0;
+    long long capture_usec = 0, sched = 0, lag_total = 0, lag_max = 0;
+    long long start, send_end;
+    int fd, opt;
+
+    while ((opt = getopt(argc, argv, "s:o:C:g:")) != -1) {
+        switch (opt) {
+        case 's':
+            speed = atof(optarg);
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'C':
+            baseline_path = optarg;
+            break;
+        case 'g':
+            synth = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-s speed] [-o result] [-C baseline_result] <capture>|-g conns,rounds <IP> <port>\n", argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != (synth != NULL ? 2 : 3)) {
+        fprintf(stderr, "Usage: %s [-s speed] [-o result] [-C baseline_result] <capture>|-g conns,rounds <IP> <port>\n", argv[0]);
+        return 1;
+    }
+
+    if (synth != NULL) {
+        unsigned nconns = 0, rounds = 0;
+        if (sscanf(synth, "%u,%u", &nconns, &rounds) != 2 || nconns == 0 || rounds == 0
+            || (data = synth_capture(nconns, rounds, &size)) == NULL) {
+            fprintf(stderr, "잘못된 합성 부하: %s (예: 40,500)\n", synth);
+            return 1;
+        }
+        optind--;  // 주소와 포트 위치를 캡처 파일이 있을 때와 맞춘다
+    } else {
+        // 캡처 파일을 통째로 읽는다
+        if ((fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+            perror("open()");
+            return 1;
+        }
+        size = st.st_size;
+        if (size < sizeof(head) || (data = malloc(size)) == NULL || read(fd, data, size) != (ssize_t)size) {
+            fprintf(stderr, "캡처 파일을 읽을 수 없습니다.\n");
+            return 1;
+        }
+        close(fd);
+    }
+    memcpy(&head, data, sizeof(head));
+    if (memcmp(head.magic, CAPTURE_MAGIC, 4) != 0 || head.version != CAPTURE_VERSION) {
+        fprintf(stderr, "캡처 파일 형식이 아닙니다.\n");
+        return 1;
+    }
+
+    // 연결 수와 채팅 수를 먼저 센다
+    for (off = sizeof(head); off + sizeof(CaptureRecord) <= size;) {
+        CaptureRecord rec;
+        memcpy(&rec, data + off, sizeof(rec));
+        if (rec.len > sizeof(ChatMessage) || off + sizeof(rec) + rec.len > size) {
+            break;  // 쓰다 만 마지막 레코드
+        }
+        if (rec.conn > max_conn) {
+            max_conn = rec.conn;
+        }
+        if (rec.kind == CAPTURE_FRAME && rec.len >= sizeof(MessageType)) {
+            MessageType type;
+            memcpy(&type, data + off + sizeof(rec), sizeof(type));
+            chats += type == MSG_CHAT;
+        }
+        capture_usec += rec.usec_delta;
+        off += sizeof(rec) + rec.len;
+    }
+    size = off;
+
+    conns = calloc(max_conn + 1, sizeof(ReplayConn));
+    for (pending_mask = 1; pending_mask < chats * 2; pending_mask <<= 1) {
+    }
+    pending = calloc(pending_mask, sizeof(PendingChat));
+    recv_mask = pending_mask * 2;
+    recv_counts = calloc(recv_mask, sizeof(RecvCount));
+    pending_mask--;
+    recv_mask--;
+    latencies = malloc(sizeof(uint32_t) * (chats + 1));
+    if (conns == NULL || pending == NULL || recv_counts == NULL || latencies == NULL) {
+        fprintf(stderr, "메모리가 부족합니다.\n");
+        return 1;
+    }
+    for (uint32_t i = 0; i <= max_conn; i++) {
+        conns[i].fd = -1;
+    }
+
+    memset(&serv_adr, 0, sizeof(serv_adr));
+    serv_adr.sin_family = AF_INET;
+    serv_adr.sin_addr.s_addr = inet_addr(argv[optind + 1]);
+    serv_adr.sin_port = htons(atoi(argv[optind + 2]));
+
+    if (speed > 0) {
+        printf("연결 %u개, 채팅 %lu개, 캡처 길이 %.1f초를 %g배속으로 재생합니다.\n", max_conn, chats,
+               capture_usec / 1e6, speed);
+    } else {
+        printf("연결 %u개, 채팅 %lu개, 캡처 길이 %.1f초를 최대 속도로 재생합니다.\n", max_conn, chats,
+               capture_usec / 1e6);
+    }
+    fflush(stdout);
+
+    start = now_usec();
+    for (off = sizeof(head); off < size;) {
+        CaptureRecord rec;
+        ChatMessage message;
+        memcpy(&rec, data + off, sizeof(rec));
+
+        // 예정 시각까지 받은 프레임을 처리하며 기다린다
+        sched += rec.usec_delta;
+        if (speed > 0) {
+            long long target = start + (long long)(sched / speed);
+            long long now;
+            while ((now = now_usec()) < target) {
+                pump((int)((target - now + 999) / 1000));
+            }
+            lag_total += now - target;
+            if (now - target > lag_max) {
+                lag_max = now - target;
+            }
+        }
+
+        if (rec.kind == CAPTURE_OPEN) {
+            open_conn(rec.conn);
+        } else if (rec.kind == CAPTURE_CLOSE && speed > 0) {
+            // 최대 속도일 때는 브로드캐스트를 다 받기 전에 끊기지 않도록 종료를 끝으로 미룬다
+            close_conn(rec.conn);
+        } else if (rec.kind == CAPTURE_FRAME && conns[rec.conn].fd != -1) {
+            memset(&message, 0, sizeof(message));
+            memcpy(&message, data + off + sizeof(rec), rec.len);
+            send_frame(rec.conn, &message);
+        }
+        off += sizeof(rec) + rec.len;
+        pump(0);
+    }
+    send_end = now_usec();
+
+    // 늦게 도착하는 프레임을 기다린다
+    while (now_usec() - send_end < DRAIN_USEC) {
+        pump(100);
+    }
+    for (uint32_t i = 0; i <= max_conn; i++) {
+        close_conn(i);
+    }
+
+    qsort(latencies, latency_count, sizeof(uint32_t), compare_u32);
+    double send_sec = (send_end - start) / 1e6;
+    SummaryItem items[] = {
+        {"frames_sent", frames_sent},
+        {"frames_recv", frames_recv},
+        {"send_rate", send_sec > 0 ? frames_sent / send_sec : 0},
+        {"recv_rate", last_recv_usec > start ? frames_recv / ((last_recv_usec - start) / 1e6) : 0},
+        {"latency_p50_us", latency_count ? latencies[latency_count / 2] : 0},
+        {"latency_p99_us", latency_count ? latencies[latency_count * 99 / 100] : 0},
+        {"latency_max_us", latency_count ? latencies[latency_count - 1] : 0},
+        {"delivered_ratio", chats ? (double)latency_count / chats : 0},
+        {"schedule_lag_avg_us", frames_sent ? (double)lag_total / frames_sent : 0},
+        {"schedule_lag_max_us", lag_max},
+    };
+    printf("재생 완료: %.2f초 동안 보냄 (캡처 %.2f초), PING 응답 %lu번\n", send_sec, capture_usec / 1e6, pings);
+    print_summary(items, sizeof(items) / sizeof(items[0]), out_path, baseline_path);
+    free(data);
+    return 0;
+}
+
+long long now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 닉네임과 내용으로 보낸 채팅을 찾는다 (FNV-1a)
+uint64_t chat_hash(ChatMessage *message) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < NICKNAME_SIZE && message->nickname[i]; i++) {
+        h = (h ^ (unsigned char)message->nickname[i]) * 1099511628211ULL;
+    }
+    h = (h ^ 0xff) * 1099511628211ULL;
+    for (size_t i = 0; i < BUF_SIZE && message->content[i]; i++) {
+        h = (h ^ (unsigned char)message->content[i]) * 1099511628211ULL;
+    }
+    return h | 1;  // 0은 빈 칸
+}
+
+// 연결 id가 hash 채팅을 받은 횟수를 돌려주고 하나 늘린다.
+// 표는 팬아웃만큼 커지므로 3/4가 차면 두 배로 늘린다. 늘리지 못하면 -1 (지연을 재지 않는다).
+int recv_count_next(uint32_t id, uint64_t hash) {
+    size_t i = recv_slot(recv_counts, recv_mask, id, hash);
+
+    if (recv_counts[i].hash != 0) {
+        return recv_counts[i].count++;
+    }
+    if (recv_used >= recv_mask / 4 * 3) {
+        size_t mask = recv_mask * 2 + 1;
+        RecvCount *grown = calloc(mask + 1, sizeof(RecvCount));
+        if (grown == NULL) {
+            return -1;
+        }
+        for (size_t k = 0; k <= recv_mask; k++) {
+            if (recv_counts[k].hash != 0) {
+                grown[recv_slot(grown, mask, recv_counts[k].conn, recv_counts[k].hash)] = recv_counts[k];
+            }
+        }
+        free(recv_counts);
+        recv_counts = grown;
+        recv_mask = mask;
+        i = recv_slot(recv_counts, recv_mask, id, hash);
+    }
+    recv_used++;
+    recv_counts[i].hash = hash;
+    recv_counts[i].conn = id;
+    recv_counts[i].count = 1;
+    return 0;
+}
+
+// (연결, 해시)의 칸이나, 없으면 넣을 빈 칸
+size_t recv_slot(RecvCount *table, size_t mask, uint32_t id, uint64_t hash) {
+    size_t i = (hash ^ (uint64_t)id * 0x9e3779b97f4a7c15ULL) & mask;
+
+    while (table[i].hash != 0 && (table[i].hash != hash || table[i].conn != id)) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+void open_conn(uint32_t id) {
+    int sock, on = 1;
+
+    // 최대 속도에서는 종료를 미루므로 같은 번호가 다시 열리면 앞의 연결을 여기서 끊는다
+    close_conn(id);
+    sock = socket(PF_INET, SOCK_STREAM, 0);
+
+    if (sock < 0 || connect(sock, (struct sockaddr *)&serv_adr, sizeof(serv_adr)) < 0) {
+        perror("connect()");
+        if (sock >= 0) {
+            close(sock);
+        }
+        return;
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    conns[id].fd = sock;
+    conns[id].rx_len = 0;
+}
+
+void close_conn(uint32_t id) {
+    if (conns[id].fd != -1) {
+        close(conns[id].fd);
+        conns[id].fd = -1;
+    }
+}
+
+// 한 프레임을 다 보낼 때까지 받는 쪽도 처리한다 (서버가 우리에게 못 보내 막히지 않도록)
+void send_frame(uint32_t id, ChatMessage *message) {
+    size_t sent = 0;
+
+    while (sent < sizeof(ChatMessage) && conns[id].fd != -1) {
+        ssize_t n = send(conns[id].fd, (char *)message + sent, sizeof(ChatMessage) - sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            sent += n;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            pump(1);
+        } else {
+            close_conn(id);
+            return;
+        }
+    }
+    frames_sent++;
+
+    if (message->type == MSG_CHAT) {
+        uint64_t h = chat_hash(message);
+        size_t i = h & pending_mask;
+        uint32_t nth = 0;
+        while (pending[i].hash != 0) {
+            nth += pending[i].hash == h;
+            i = (i + 1) & pending_mask;
+        }
+        pending[i].hash = h;
+        pending[i].nth = nth;
+        pending[i].sent_usec = now_usec();
+    }
+}
+
+// 열린 연결에서 받은 프레임을 처리한다
+void pump(int timeout_ms) {
+    static struct pollfd *fds;
+    static uint32_t *ids;
+    int nfds = 0;
+
+    if (fds == NULL) {
+        fds = malloc(sizeof(struct pollfd) * (max_conn + 1));
+        ids = malloc(sizeof(uint32_t) * (max_conn + 1));
+    }
+    for (uint32_t i = 0; i <= max_conn; i++) {
+        if (conns[i].fd != -1) {
+            fds[nfds].fd = conns[i].fd;
+            fds[nfds].events = POLLIN;
+            ids[nfds++] = i;
+        }
+    }
+    if (poll(fds, nfds, timeout_ms) <= 0) {
+        return;
+    }
+
+    for (int k = 0; k < nfds; k++) {
+        ReplayConn *c = &conns[ids[k]];
+        if (!(fds[k].revents & (POLLIN | POLLHUP | POLLERR))) {
+            continue;
+        }
+        while (c->fd != -1) {
+            ssize_t n = read(c->fd, c->rx + c->rx_len, sizeof(ChatMessage) - c->rx_len);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                close_conn(ids[k]);
+            } else if (n < 0) {
+                break;
+            } else if ((c->rx_len += n) == sizeof(ChatMessage)) {
+                c->rx_len = 0;
+                handle_frame(ids[k], (ChatMessage *)c->rx);
+            }
+        }
+    }
+}
+
+void handle_frame(uint32_t id, ChatMessage *message) {
+    frames_recv++;
+    last_recv_usec = now_usec();
+    if (message->type == MSG_PING) {
+        ChatMessage pong = {MSG_PONG, "", ""};
+        send(conns[id].fd, &pong, sizeof(pong), MSG_NOSIGNAL);
+        pings++;
+    } else if (message->type == MSG_CHAT) {
+        // 같은 채팅이 처음 도착한 때를 지연으로 잡는다 (팬아웃의 나머지 수신자는 세지 않는다)
+        uint64_t h = chat_hash(message);
+        int nth = recv_count_next(id, h);
+        for (size_t i = h & pending_mask; nth >= 0 && pending[i].hash != 0; i = (i + 1) & pending_mask) {
+            if (pending[i].hash == h && pending[i].nth == (uint32_t)nth) {
+                if (!pending[i].matched) {
+                    pending[i].matched = 1;
+                    latencies[latency_count++] = now_usec() - pending[i].sent_usec;
+                }
+                break;
+            }
+        }
+    }
+}
+
+int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// 결과를 출력하고, 이전 결과가 있으면 차이를 함께 보여준다
+void print_summary(SummaryItem *items, int count, const char *out_path, const char *baseline_path) {
+    char names[MAX_SUMMARY][64];
+    double values[MAX_SUMMARY];
+    int base_count = 0;
+
+    if (baseline_path != NULL) {
+        FILE *fp = fopen(baseline_path, "r");
+        if (fp == NULL) {
+            perror("fopen()");
+        } else {
+            while (base_count < MAX_SUMMARY && fscanf(fp, " %63[^=]=%lf", names[base_count], &values[base_count]) == 2) {
+                base_count++;
+            }
+            fclose(fp);
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        int b;
+        for (b = 0; b < base_count && strcmp(names[b], items[i].name) != 0; b++) {
+        }
+        if (b < base_count) {
+            double diff = values[b] != 0 ? (items[i].value - values[b]) * 100.0 / values[b] : 0;
+            printf("  %-22s %14.1f   (이전 %.1f, %+.1f%%)\n", items[i].name, items[i].value, values[b], diff);
+        } else {
+            printf("  %-22s %14.1f\n", items[i].name, items[i].value);
+        }
+    }
+
+    if (out_path != NULL) {
+        FILE *fp = fopen(out_path, "w");
+        if (fp == NULL) {
+            perror("fopen()");
+            return;
+        }
+        for (int i = 0; i < count; i++) {
+            fprintf(fp, "%s=%.3f\n", items[i].name, items[i].value);
+        }
+        fclose(fp);
+    }
+}
+
+// 합성 부하를 캡처 파일 형식으로 만든다. 라운드마다 모든 연결이 한 번씩 채팅하고,
+// 한 연결은 로그아웃했다가 같은 닉네임으로 다시 접속한다 (로그인/로그아웃 알림 비용도 재도록).
+unsigned char *synth_capture(uint32_t nconns, uint32_t rounds, size_t *size) {
+    size_t frame = sizeof(CaptureRecord) + sizeof(ChatMessage);
+    size_t cap = sizeof(CaptureHeader) + frame * ((size_t)nconns * 2 + (size_t)rounds * (nconns + 4));
+    unsigned char *data = malloc(cap), *p;
+    CaptureHeader head = {CAPTURE_MAGIC, CAPTURE_VERSION, time(NULL)};
+    char text[BUF_SIZE];
+
+    if (data == NULL) {
+        return NULL;
+    }
+    memcpy(data, &head, sizeof(head));
+    p = data + sizeof(head);
+
+    for (uint32_t c = 0; c < nconns; c++) {
+        p = synth_put(p, CAPTURE_OPEN, c, 0, NULL);
+        p = synth_put(p, CAPTURE_FRAME, c, MSG_NICKNAME, "");
+    }
+    for (uint32_t r = 0; r < rounds; r++) {
+        for (uint32_t c = 0; c < nconns; c++) {
+            snprintf(text, sizeof(text), "round %u from %u: the quick brown fox jumps over the lazy dog", r, c);
+            p = synth_put(p, CAPTURE_FRAME, c, MSG_CHAT, text);
+        }
+        uint32_t c = r % nconns;
+        snprintf(text, sizeof(text), "bench%u 님께서 퇴장했습니다.", c);
+        p = synth_put(p, CAPTURE_FRAME, c, MSG_LOGOUT, text);
+        p = synth_put(p, CAPTURE_CLOSE, c, 0, NULL);
+        p = synth_put(p, CAPTURE_OPEN, c, 0, NULL);
+        p = synth_put(p, CAPTURE_FRAME, c, MSG_NICKNAME, "");
+    }
+    *size = p - data;
+    return data;
+}
+
+// 레코드 하나를 덧붙이고 다음 위치를 돌려준다 (프레임이면 메시지 전체를 싣는다)
+unsigned char *synth_put(unsigned char *p, CaptureKind kind, uint32_t conn, MessageType type, const char *text) {
+    CaptureRecord rec = {SYNTH_GAP_USEC, conn, kind, kind == CAPTURE_FRAME ? sizeof(ChatMessage) : 0};
+    ChatMessage message;
+
+    memcpy(p, &rec, sizeof(rec));
+    p += sizeof(rec);
+    if (kind == CAPTURE_FRAME) {
+        memset(&message, 0, sizeof(message));
+        message.type = type;
+        snprintf(message.nickname, NICKNAME_SIZE, "bench%u", conn);
+        snprintf(message.content, BUF_SIZE, "%s", text);
+        memcpy(p, &message, sizeof(message));
+        p += sizeof(message);
+    }
+    return p;
+}
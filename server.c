@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -8,20 +9,175 @@
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/stat.h>
 #include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <sys/prctl.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <linux/sockios.h>
+#include <linux/filter.h>
+#include <sys/ioctl.h>
 #include <syslog.h>
+#include <time.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <malloc.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <zlib.h>
+
+// 빌드할 때 정하는 기본값 (Makefile의 server_usesignal, server_nosignal 참고). 실행할 때 -D, -n 으로 바꿀 수 있다.
+#ifndef SERVER_DAEMON
+#define SERVER_DAEMON 1               // 0이면 데몬으로 만들지 않고 포그라운드에서 실행
+#endif
+#ifndef SERVER_NOTIFY
+#define SERVER_NOTIFY NOTIFY_SIGNAL   // 자식 -> 부모 알림 방식
+#endif
 
 #define TCP_PORT 5100
 #define MAX_CLIENTS 50
 #define BUF_SIZE 100
 #define NICKNAME_SIZE 20
+#define OUTQ_SIZE 64              // 연결별 송신 대기열 크기 (프레임 수)
+#define MAX_COALESCE_USEC 50000   // 병합 대기 시간 상한 (꼬리 지연 제한)
+#define STATS_INTERVAL 60         // 통계 기록 주기 (초)
+#define MAX_ROOMS 16
+#define ROOM_NAME_SIZE 20
+#define DEFAULT_ROOM "lobby"
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)  // 타이머 휠 단계별 슬롯 수
+#define WHEEL_LEVELS 2
+#define TICK_USEC 100000              // 타이머 휠 한 칸 (100ms)
+#define IDLE_TIMEOUT 30               // 기본 무응답 허용 시간 (초)
+#define PING_TIMEOUT 10               // PING 후 응답 대기 시간 (초)
+#define MAX_IDLE_TIMEOUT ((WHEEL_SIZE * WHEEL_SIZE - 1) / (1000000 / TICK_USEC)) // 타이머 휠에 들어가는 최대 -k (초)
+#define HANDOFF_DRAIN_USEC 20000      // 인계 전 자식 파이프를 비우는 시간
+#define HANDOFF_MAGIC 0x43484f46u     // 인계 레코드 식별값 ("CHOF")
+#define HANDOFF_VERSION 2             // HandoffRecord 구조가 바뀌면 올린다
+#define LISTEN_BACKLOG SOMAXCONN      // 기본 listen() 대기열 길이
+#define LISTEN_FDS_START 3            // 소켓 활성화로 넘겨받는 첫 fd (LISTEN_FDS 규약)
+#define MAX_PEERS 8                   // 연결할 수 있는 다른 서버 수
+#define PEER_RING 1024                // 재연결 시 다시 보낼 수 있는 프레임 수
+#define PEER_BATCH 64                 // 링크에 한 번에 쓰는 프레임 수
+#define PEER_RETRY_USEC 1000000       // 끊긴 링크 재연결 간격
+#define MAX_REMOTE_USERS 256          // 다른 서버에 접속한 사용자 디렉터리 크기
+#define PEER_HEARTBEAT_USEC 1000000   // 링크 생존 확인 프레임 간격
+#define PEER_HELLO_USEC (3 * PEER_HEARTBEAT_USEC) // 연결 후 RESUME을 기다리는 시간
+#define PEER_ACK_USEC 100000          // 수신 측 확인 응답 간격
+#define FAILOVER_USEC 3000000         // 대기 서버가 주 서버를 죽었다고 판단하는 시간
+#define HISTORY_SIZE 4096             // 메모리에 들고 있는 최근 대화 수
+#define HISTORY_REPLAY 20             // 방에 들어올 때 보여주는 최근 대화 수
+#define TLS_HANDSHAKE_TIMEOUT 10      // TLS 핸드셰이크 제한 시간 (초)
+#define WIRE_HDR 3                    // 압축 협상 연결의 프레임 머리 (길이 2바이트 + 플래그 1바이트)
+#define WIRE_MAX 192                  // 머리를 포함한 프레임 최대 크기
+#define WIRE_DEFLATE 0x01             // 플래그: 본문이 deflate로 압축되어 있음
+#define COMPRESS_MIN 32               // 이보다 짧은 내용은 압축하지 않는다 (바이트)
+#define RX_BUF_SIZE 1024              // 압축 협상 연결의 수신 버퍼
+#define FILTER_CHECK_USEC 1000000     // 금지어 목록 파일 변경 확인 간격
+#define FILTER_MAX_SIZE (64 << 20)    // 컴파일된 금지어 오토마톤 크기 상한
+#define CAPTURE_BUF 65536             // 캡처 파일 쓰기 버퍼
+#define CAPTURE_MAGIC "VCAP"
+#define CAPTURE_VERSION 1
+#define SEARCH_SUFFIX ".idx"          // 검색 색인 파일: <기록 파일>.idx (목록), .idx.<번호> (세그먼트)
+#define SEARCH_MAGIC "VIDX"
+#define SEARCH_VERSION 1
+#define SEARCH_SEGMENT_DOCS 65536     // 메모리에 모았다가 세그먼트 하나로 쓰는 레코드 수
+#define SEARCH_FLUSH_USEC 1000000     // 모은 기록을 늦어도 이 시간 안에 세그먼트로 쓴다
+#define SEARCH_POLL_USEC 200000       // 색인 프로세스가 기록 파일을 확인하는 간격
+#define SEARCH_RESTART_USEC 10000000  // 색인 프로세스가 죽었을 때 다시 띄우는 간격
+#define SEARCH_MERGE_FANIN 4          // 같은 단계의 세그먼트가 이만큼 모이면 하나로 합친다
+#define SEARCH_MAX_SEGMENTS 64
+#define SEARCH_BLOCK 128              // 건너뛰기 표 한 칸이 가리키는 레코드 수
+#define SEARCH_MAX_TERMS 64           // 레코드 하나에서 뽑는 낱말 수 상한
+#define SEARCH_MAX_WORDS 8            // 검색어 수 상한
+#define SEARCH_RESULTS 20             // 검색 결과 수
+#define PRESENCE_MAX (MAX_CLIENTS + MAX_REMOTE_USERS) // 방 하나의 접속자 목록 크기
+#define PRESENCE_FRAMES 128           // 접속자 목록 하나를 담는 프레임 수 상한
+#define SPOOL_SUFFIX ".spool"        // 보관 파일: <보관 디렉터리>/<16진수 닉네임>.spool
+#define SPOOL_MAGIC "VSPL"
+#define SPOOL_VERSION 1
+#define SPOOL_PATH_SIZE 512
+#define SPOOL_USER_MAX 200            // 받는 사람별로 보관하는 메시지 수 상한
+#define SPOOL_BUDGET_MB 64            // 보관 파일 전체 크기 기본값 (-M)
+#define SPOOL_EXPIRE_SEC (7 * 86400)  // 보관 기간
+#define SPOOL_BATCH 32                // 로그인할 때 한 번에 보내는 보관 메시지 수
+#define SPOOL_SWEEP_USEC 60000000     // 기간이 지난 보관 파일을 지우는 간격
+#define ATTACH_MAX 64                 // 한 번에 들고 있는 첨부 파일 수
+#define ATTACH_NAME_SIZE 64           // 첨부 파일 이름 (바이트, 0 포함)
+#define ATTACH_CHUNK 65536            // 조각 하나의 원시 바이트 수 상한 (client.c와 같아야 한다)
+#define ATTACH_INFLIGHT (4 * ATTACH_CHUNK) // 소켓 버퍼에 쌓아 두는 조각 바이트 상한 (채팅이 기다리는 양)
+#define ATTACH_DOWNLOADS 4            // 클라이언트 하나가 동시에 받는 파일 수
+#define ATTACH_BUDGET_MB 1024         // 첨부 파일 전체 크기 기본값 (-A)
+#define ATTACH_EXPIRE_USEC 3600000000LL // 다 올린 뒤 이 시간이 지나면 지운다 (받는 중이면 기다린다)
+#define ADMIT_RATE 100                // 초당 새 세션 수 기본값 (-O)
+#define ADMIT_LAG_MSEC 50             // 루프 한 바퀴 평균이 이보다 길면 과부하 (-O)
+#define ADMIT_RETRY_MSEC 1000         // 거절할 때 알려 주는 재시도 간격의 최솟값
+#define ADMIT_RETRY_MAX_MSEC 30000
+#define ADMIT_FULL_RETRY_MSEC 10000   // 자리가 없을 때 알려 주는 재시도 간격
+#define WATCH_MAX 16                  // 클라이언트 하나가 구독하는 키워드 수
+#define WATCH_PATTERN_SIZE 32         // 키워드 길이 상한 (끝의 0 포함)
+#define REAP_USEC 100000              // 시그널을 쓰지 않을 때 끝난 자식 프로세스를 거두는 간격
+#define POOL_TRIM_USEC 1000000        // 한 주기 동안 꺼내 쓰지 않은 풀 블록을 돌려주는 간격
+#define MEM_SAMPLE_USEC 1000000       // 자식 프로세스의 메모리를 다시 재는 간격
+#define ROUTER_MAX MAX_PEERS          // 저지연 프로필의 라우터 프로세스 수 상한 (서로 링크로 잇는다)
+#define ROUTER_PEER_OFFSET 1000       // 라우터 i의 링크 포트: 서비스 포트 + 1000 + i
+#define BUSY_POLL_USEC 50             // -C 를 쓸 때 기본 busy-poll 시간
+#define TYPING_EXPIRE_USEC 5000000    // 갱신이 없으면 입력 중 표시를 지우는 시간 (클라이언트는 3초마다 갱신)
+#define TYPING_NAMES 3                // 입력 중 표시에 이름을 보여 주는 인원 (넘으면 수만 보여 준다)
+#define REACT_RECENT 8                // 방마다 반응을 받는 최근 메시지 수
+#define REACT_KINDS 4                 // 메시지 하나에 모으는 반응 종류 수
+#define REACT_EMOJI_SIZE 12           // 반응 하나의 길이 상한 (끝의 0 포함)
+#define REACT_EXCERPT 24              // 반응 프레임에 붙이는 메시지 앞부분 (끝의 0 포함)
+#define EPH_TYPING_BIT (1u << REACT_RECENT) // eph_pending의 입력 중 표시 비트 (그 아래 비트는 반응 칸)
+#define TYPING_UNKNOWN UINT64_MAX     // 받는 사람이 보고 있는 입력 중 목록을 모른다 (다음 틱에 보낸다)
+#define ASCII_FOLD(c) ((c) >= 'A' && (c) <= 'Z' ? (c) + ('a' - 'A') : (c))
+
+// 자식 프로세스가 부모에게 로그인/로그아웃을 알리는 방식
+typedef enum {
+    NOTIFY_SIGNAL,  // SIGUSR1/SIGUSR2를 보내고, 끝난 자식은 SIGCHLD에서 거둔다
+    NOTIFY_PIPE,    // 이미 파이프로 오는 프레임(MSG_SESSION 닉네임 알림, 로그아웃)으로 알고, 자식은 루프에서 거둔다
+    NOTIFY_NONE     // 알리지 않는다 (자식은 루프에서 거둔다)
+} NotifyMode;
 
 // 메시지 유형
 typedef enum {
     MSG_NICKNAME,  // 닉네임 설정 메시지
     MSG_CHAT,      // 일반 채팅 메시지
-    MSG_LOGOUT     // 로그아웃 메시지
+    MSG_LOGOUT,    // 로그아웃 메시지
+    MSG_JOIN,      // 방 입장 메시지 (content: 방 이름)
+    MSG_THROTTLE,  // 전송 속도 제한 알림 (서버 -> 클라이언트)
+    MSG_PING,      // 연결 확인 요청 (서버 -> 클라이언트)
+    MSG_PONG,      // 연결 확인 응답 (클라이언트 -> 서버)
+    MSG_CAPS,      // 압축 협상 응답 (서버 -> 클라이언트, content: "deflate=<수준>,min=<바이트>")
+    MSG_SEARCH,    // 대화 검색 (클라이언트 -> 서버: 검색어, 서버 -> 클라이언트: 결과 한 줄씩, 마지막은 닉네임 없이 요약)
+    MSG_PRESENCE,  // 접속자 목록 (클라이언트 -> 서버: "on"/"off" 구독, 서버 -> 클라이언트: nickname에 방 이름,
+                   // content에 줄마다 항목. 전체 목록은 "="(비움) 뒤에 "=<닉네임>", 변경은 "+<닉네임>", "-<닉네임>")
+    MSG_DIRECT,    // 귓속말 (클라이언트 -> 서버: "<받는 사람> <내용>", 서버 -> 클라이언트: nickname에 보낸 사람,
+                   // 닉네임이 비어 있으면 보낸 사람에게 주는 알림)
+    MSG_SPOOL,     // 접속하지 않은 동안 보관된 귓속말 (서버 -> 클라이언트: 한 통씩, 마지막은 닉네임 없이
+                   // "<마지막 순번> <보낸 수> <남은 수>", 클라이언트 -> 서버: 받은 마지막 순번)
+    MSG_FILE,      // 첨부 파일 (클라이언트 -> 서버: "put <번호> <크기> <이름>", "data <번호> <길이>", "get <id>",
+                   // 서버 -> 클라이언트: "new <id> <크기> <이름>", "begin <id> <크기> <이름>", "data <id> <위치> <길이>",
+                   // "error <알림>"). data 프레임 바로 뒤에는 <길이> 바이트의 원시 데이터가 이어진다.
+    MSG_WATCH,     // 언급/키워드 알림 (클라이언트 -> 서버: "on", "off", "+<키워드> [room:<방 패턴>]", "-<키워드>", "list",
+                   // 서버 -> 클라이언트: nickname에 보낸 사람, content에 "<방>\n<내용>". 닉네임이 비어 있으면 알림)
+    MSG_RETRY,     // 과부하로 접속 거절 (서버 -> 클라이언트, content: "<재시도까지 ms> <이유>", 보낸 뒤 끊는다)
+    MSG_EPHEMERAL, // 입력 중 표시와 반응 (클라이언트 -> 서버: "on", "off", "typing", "idle", "react <이모지> [<n번째 전>]",
+                   // 서버 -> 클라이언트: nickname에 방 이름, content에 "typing <수>" 뒤로 줄마다 이름,
+                   // 또는 "react <id> <이모지>:<수> ..." 뒤 줄에 "<보낸 사람>: <메시지 앞부분>". 닉네임이 비어 있으면 알림)
+    MSG_SESSION    // 세션 자식 -> 부모 전용 알림 (content: "nickname", "tls_ready", "tls_failed"). 클라이언트가 보낸 것은 버린다
 } MessageType;
 
 // 채팅 메시지 구조체
@@ -31,339 +187,6926 @@ typedef struct {
     char content[BUF_SIZE];           // 메시지 내용
 } ChatMessage;
 
-static int g_noc = 0; // 자식 프로세스 수 (클라이언트)
-static int client_sockets[MAX_CLIENTS]; // 클라이언트 소켓
-static int pipes_to_child[MAX_CLIENTS][2]; // 부모에서 자식 프로세스로의 파이프
-static int pipes_to_parent[MAX_CLIENTS][2]; // 자식 프로세스에서 부모로의 파이프
-static char nicknames[MAX_CLIENTS][NICKNAME_SIZE]; // 클라이언트 닉네임
-static pid_t child_pids[MAX_CLIENTS]; // 자식 프로세스 pid
+static int g_noc = 0; // 자식 프로세스 수 (클라이언트)
+static int client_sockets[MAX_CLIENTS]; // 클라이언트 소켓
+static int pipes_to_child[MAX_CLIENTS][2]; // 부모에서 자식 프로세스로의 파이프
+static int pipes_to_parent[MAX_CLIENTS][2]; // 자식 프로세스에서 부모로의 파이프 (-L이면 도우미 자식의 결과)
+static char nicknames[MAX_CLIENTS][NICKNAME_SIZE]; // 클라이언트 닉네임
+static pid_t child_pids[MAX_CLIENTS]; // 자식 프로세스 pid (-L이면 TLS/검색 도우미, 없으면 -1)
+static int handed_off[MAX_CLIENTS];   // 새 프로세스로 넘긴 연결 (종료할 때 fd만 닫는다)
+
+// 연결로 나가는 프레임. 압축을 협상하지 않은 연결은 ChatMessage 그대로,
+// 협상한 연결은 [길이 2바이트][플래그 1바이트][본문] 형식이다.
+typedef struct {
+    uint16_t len;
+    unsigned char data[WIRE_MAX];
+} WireFrame;
+
+// 연결별 송신 대기열 (브로드캐스트 병합용).
+// 제어 프레임은 앞쪽(frames[..urgent_end))에 끼워 넣어 밀린 채팅보다 먼저 나간다.
+// 칸은 쌓일 때 풀에서 빌리고 (4, 16, OUTQ_SIZE칸), 다 보내면 돌려준다.
+typedef struct {
+    WireFrame *frames;     // 빌린 칸 (비어 있으면 NULL)
+    int cap;               // frames 칸 수
+    int count;             // 쌓인 프레임 수
+    int urgent_end;        // 앞쪽 제어 프레임 구간의 끝
+    size_t sent_bytes;     // 부분 전송된 바이트 수
+    long long first_usec;  // 첫 프레임이 쌓인 시각
+} OutQueue;
+
+// 토큰 버킷 (메시지 수, 바이트 수를 함께 제한)
+typedef struct {
+    double msg_tokens;
+    double byte_tokens;
+    long long last_usec;   // 마지막으로 토큰을 채운 시각
+} TokenBucket;
+
+// 초당 허용량 (0이면 제한 없음)
+typedef struct {
+    double msgs_per_sec;
+    double bytes_per_sec;
+} RateLimit;
+
+// 채팅방
+typedef struct {
+    char name[ROOM_NAME_SIZE];
+    int in_use;
+    TokenBucket bucket;    // 방 전체 전송량 제한
+} ChatRoom;
+
+// 타이머 휠 노드 (클라이언트마다 하나)
+typedef struct {
+    int prev, next;         // 같은 슬롯의 이중 연결 리스트 (-1: 끝)
+    int level, slot;        // 걸려 있는 위치 (level -1: 미등록)
+    unsigned long expire;   // 만료 틱
+} TimerNode;
+
+// 무중단 재시작 시 새 프로세스로 넘기는 레코드 (SCM_RIGHTS로 fd와 함께 전송)
+// 레코드 크기나 배치가 다른 바이너리끼리는 인계하지 않는다 (magic/version/size로 확인)
+typedef enum {
+    HANDOFF_HELLO,     // 새 프로세스가 먼저 보내는 자기 레코드 형식
+    HANDOFF_LISTENER,  // 리스닝 소켓
+    HANDOFF_CLIENT,    // 클라이언트 연결과 상태
+    HANDOFF_END        // 인계 완료
+} HandoffKind;
+
+typedef struct {
+    uint32_t magic;     // HANDOFF_MAGIC
+    uint32_t version;   // HANDOFF_VERSION
+    uint32_t size;      // sizeof(HandoffRecord)
+    HandoffKind kind;
+    int client_index;
+    char nickname[NICKNAME_SIZE];
+    char room[ROOM_NAME_SIZE];
+    WireFrame pending[OUTQ_SIZE]; // 아직 보내지 못한 프레임
+    int pending_count;
+    int pending_urgent;
+    size_t pending_sent;  // 맨 앞 프레임의 부분 전송 바이트 수
+    int zlevel;         // 협상한 압축 수준
+    int presence;       // 접속자 목록을 구독했는지
+    int watch;          // 언급 알림을 켰는지
+    int watch_count;
+    char watch_keywords[WATCH_MAX][WATCH_PATTERN_SIZE];
+    char watch_rooms[WATCH_MAX][ROOM_NAME_SIZE];
+    size_t rx_len;      // 아직 처리하지 못한 수신 바이트
+    unsigned char rx[RX_BUF_SIZE];
+} HandoffRecord;
+
+// 알림 구독자: 같은 키워드를 구독한 사람은 패턴 하나에 모인다
+typedef struct {
+    int16_t client;
+    int16_t slot;       // watch_keywords 칸 (-1: 자기 닉네임 언급)
+} WatchSub;
+
+typedef struct {
+    const char *pattern;
+    WatchSub sub;
+} WatchEntry;
+
+// 크기별 메모리 풀 (송신 대기열 칸, 압축 연결의 수신 버퍼)
+typedef enum {
+    POOL_OUTQ_S,    // 프레임 4칸
+    POOL_OUTQ_M,    // 프레임 16칸
+    POOL_OUTQ_L,    // 프레임 OUTQ_SIZE칸
+    POOL_RX,        // RX_BUF_SIZE
+    POOL_CLASSES
+} PoolClass;
+
+typedef struct PoolBlock {
+    struct PoolBlock *next;
+} PoolBlock;
+
+// 돌려받은 블록은 목록에 두었다가 다시 빌려 준다. 정리 주기 동안 목록이 가장 짧았을 때의
+// 길이(low)만큼은 한 번도 필요 없었던 것이므로 free()로 돌려준다.
+typedef struct {
+    size_t size;            // 블록 크기
+    PoolBlock *free_list;
+    unsigned long used;     // 빌려 준 블록 수
+    unsigned long nfree;    // 목록에 있는 블록 수
+    unsigned long low;      // 지난 정리 뒤 nfree의 최솟값
+    unsigned long allocs;   // malloc() 호출 수
+    unsigned long trimmed;  // free()로 돌려준 블록 수
+} MemPool;
+
+// 반응을 받을 수 있는 최근 메시지 (방마다 id % REACT_RECENT 칸에 돌려 쓴다).
+// 누가 눌렀는지는 클라이언트 번호 비트로 두고, 수는 보낼 때 센다.
+typedef struct {
+    uint32_t id;                            // 방 안의 메시지 순번 (0: 빈 칸)
+    char sender[NICKNAME_SIZE];
+    char excerpt[REACT_EXCERPT];
+    char emoji[REACT_KINDS][REACT_EMOJI_SIZE];
+    uint64_t reactors[REACT_KINDS];         // 비트 i: 클라이언트 i가 눌렀다
+    int dirty;                              // 이번 틱에 바뀌었다
+} ReactTarget;
+
+typedef struct {
+    ReactTarget targets[REACT_RECENT];
+    uint32_t next_id;                       // 마지막으로 받은 메시지 순번
+    int typing_dirty;                       // 이번 틱에 입력 중인 사람이 바뀌었다
+} EphemeralRoom;
+
+#if MAX_CLIENTS > 64
+#error "ReactTarget.reactors는 클라이언트 번호 비트 64개까지만 담는다"
+#endif
+
+// 새 연결을 어떻게 할지
+typedef enum {
+    ADMIT_ACCEPT,   // 세션을 만든다
+    ADMIT_DEFER,    // 커널 대기열에 남겨 두고 다음 루프에 다시 본다
+    ADMIT_REJECT    // 받아서 재시도 시각만 알려 주고 끊는다
+} AdmitDecision;
+
+// 서버 간 링크 프레임
+typedef enum {
+    PEER_HELLO,         // 링크 시작: 보내는 노드 id와 epoch, 지금까지 만든 마지막 순번
+    PEER_RESUME,        // HELLO 응답: 마지막으로 받은 순번 (epoch 0: 이번 실행의 프레임은 처음 받는다)
+    PEER_RELAY,         // 방 브로드캐스트 중계
+    PEER_USER_ONLINE,   // 디렉터리: 사용자 접속/방 이동
+    PEER_USER_OFFLINE,  // 디렉터리: 사용자 종료
+    PEER_HEARTBEAT,     // 링크 생존 확인 (순번 있음)
+    PEER_ACK,           // 수신 측이 적용한 마지막 순번 (비동기 확인 응답)
+    PEER_DIRECT         // 귓속말 (room에 받는 사람 닉네임)
+} PeerFrameKind;
+
+typedef struct {
+    uint32_t kind;
+    uint32_t origin;          // 프레임을 만든 노드 id
+    uint64_t epoch;           // 노드 시작 시각 (재시작 구분용)
+    uint64_t seq;             // 노드별 순번
+    char room[ROOM_NAME_SIZE];
+    ChatMessage msg;
+} PeerFrame;
+
+typedef enum {
+    LINK_DOWN,
+    LINK_CONNECTING,
+    LINK_HELLO_SENT,   // RESUME 대기
+    LINK_UP
+} PeerLinkState;
+
+// 이 서버가 다른 서버로 연결하는 송신 링크 (로컬 프레임은 이 링크로만 나간다)
+typedef struct {
+    struct sockaddr_in addr;
+    int fd;
+    PeerLinkState state;
+    long long retry_usec;     // 다음 재연결 시각
+    long long connect_usec;   // 연결을 시작한 시각 (RESUME까지 PEER_HELLO_USEC 안에 와야 한다)
+    uint64_t sent_seq;        // 끝까지 보낸 마지막 순번
+    size_t sent_bytes;        // 다음 프레임을 부분 전송한 바이트 수
+    uint64_t acked_seq;       // 상대가 적용했다고 알려온 순번
+    uint64_t hello_seq;       // HELLO에 실어 보낸 마지막 순번 (처음 받는 상대는 그 다음부터 받는다)
+    PeerFrame rx;             // RESUME/ACK 수신 버퍼
+    size_t rx_len;
+} PeerLink;
+
+// 다른 서버가 이 서버로 연결해 온 수신 링크
+typedef struct {
+    int fd;
+    uint32_t origin;          // HELLO로 알게 된 상대 노드 (0: 아직 모름)
+    uint64_t acked;           // 마지막으로 확인 응답을 보낸 순번
+    long long ack_usec;       // 마지막으로 확인 응답을 보낸 시각
+    PeerFrame rx;
+    size_t rx_len;
+    PeerFrame tx;             // 보내는 중인 RESUME/ACK (논블로킹이라 나눠 나갈 수 있다)
+    size_t tx_len;            // 보낼 바이트 수 (0: 비어 있음)
+    size_t tx_sent;
+} PeerInbound;
+
+// 노드별 수신 위치 (중복 제거, 재개 지점)
+typedef struct {
+    uint32_t origin;
+    uint64_t epoch;
+    uint64_t last_seq;
+    int in_use;
+} PeerOrigin;
+
+// 다른 서버에 접속한 사용자
+typedef struct {
+    uint32_t origin;
+    char nickname[NICKNAME_SIZE];
+    char room[ROOM_NAME_SIZE];
+    int in_use;
+} RemoteUser;
+
+// 대화 기록 (파일과 메모리 링에 같은 형식으로 저장)
+typedef struct {
+    int64_t time;             // 기록 시각 (유닉스 시간, 초)
+    char room[ROOM_NAME_SIZE];
+    ChatMessage msg;
+} HistoryRecord;
+
+// 귓속말 보관 파일: 헤더 뒤에 순번이 1씩 늘어나는 레코드가 이어진다 (덧붙이기만 한다).
+// 확인받은 레코드는 acked까지이고, 다 확인받으면 파일을 지우고 절반이 넘으면 남은 것만 옮겨 쓴다.
+typedef struct {
+    char magic[4];            // "VSPL"
+    uint32_t version;
+    uint64_t acked;           // 받는 사람이 확인한 마지막 순번
+} SpoolHeader;
+
+typedef struct {
+    int64_t time;             // 보관한 시각 (유닉스 시간, 초)
+    uint64_t seq;
+    ChatMessage msg;          // nickname: 보낸 사람, content: 내용
+} SpoolRecord;
+
+typedef enum {
+    SPOOL_STORED,
+    SPOOL_QUOTA,              // 받는 사람의 보관 수 상한
+    SPOOL_FULL,               // 전체 크기 상한
+    SPOOL_ERROR
+} SpoolResult;
+
+// 첨부 파일: 올리는 내용은 지운 임시 파일에 받아 두고 fd로만 들고 있는다
+typedef struct {
+    int fd;                   // -1: 빈 칸
+    uint32_t id;
+    char name[ATTACH_NAME_SIZE];
+    char owner[NICKNAME_SIZE];
+    off_t size;
+    off_t received;
+    int uploading;            // 아직 다 받지 못했다
+    int readers;              // 보내는 중인 다운로드 수 (0이 될 때까지 지우지 않는다)
+    long long usec;           // 올리기를 마친 시각
+} Attachment;
+
+// 클라이언트가 올리는 중인 파일
+typedef struct {
+    int token;                // 클라이언트가 붙인 번호 (0: 없음)
+    int slot;                 // attachments 위치 (-1: 거절했으므로 받아서 버린다)
+    size_t left;              // 지금 조각에서 남은 원시 바이트
+    int discard;              // 지금 조각을 버린다
+} AttachUpload;
+
+// 클라이언트에게 보내는 중인 파일
+typedef struct {
+    int slot;
+    off_t off;                // 다음 조각 위치
+} AttachDownload;
+
+// 소켓에 쓰는 중인 조각. 머리 프레임 뒤에 원시 바이트를 sendfile()로 이어 보내는 동안에는
+// 다른 프레임을 끼워 넣을 수 없으므로 송신 대기열을 멈춘다 (조각 크기가 채팅 지연의 상한이다).
+typedef struct {
+    WireFrame hdr;            // len 0: 보내는 조각 없음
+    size_t hdr_sent;
+    int slot;
+    off_t off;
+    size_t left;
+    int last;                 // 다운로드의 마지막 조각
+} AttachChunk;
+
+// 금지어 규칙의 조치 (강한 순서)
+typedef enum {
+    FILTER_PASS,   // 통과
+    FILTER_FLAG,   // 그대로 전달하고 기록만 남긴다
+    FILTER_MASK,   // 걸린 부분을 *로 가린다
+    FILTER_DROP    // 전달하지 않는다
+} FilterAction;
+
+typedef struct {
+    uint16_t action;
+    uint16_t len;     // 패턴 길이 (바이트)
+    uint32_t line;    // 규칙 파일의 줄 번호
+} FilterRule;
+
+// 컴파일된 금지어 오토마톤 (Aho-Corasick). 포인터 없는 한 덩어리라 파이프로 그대로 넘긴다.
+// 헤더 뒤에 delta[nstates * nclasses], match[nstates], link[nstates], rules[nrules]가 이어진다.
+// delta에는 다음 상태의 행 시작 위치(상태 * nclasses)를 넣고, 그 상태에서 끝나는 규칙이
+// 있으면 FILTER_HIT 비트를 켠다. 검사 루프는 바이트마다 곱셈 없이 표를 한 번만 읽는다.
+typedef struct {
+    uint32_t size;         // 헤더를 포함한 전체 바이트 수
+    uint32_t nstates;
+    uint32_t nclasses;
+    uint32_t nrules;
+    uint8_t classes[256];  // 바이트 -> 문자 클래스 (ASCII 대소문자는 같은 클래스)
+} FilterTable;
+
+#define FILTER_HIT 0x80000000u
+#define FILTER_DELTA(t) ((uint32_t *)((t) + 1))
+#define FILTER_MATCH(t) ((int32_t *)FILTER_DELTA(t) + (size_t)(t)->nstates * (t)->nclasses)
+#define FILTER_LINK(t) (FILTER_MATCH(t) + (t)->nstates)
+#define FILTER_RULES(t) ((FilterRule *)(FILTER_LINK(t) + (t)->nstates))
+
+// 우선순위 레인: 제어 프레임(로그인, 로그아웃, 방 이동, PING/PONG, 알림)은
+// 채팅이 밀려 있어도 먼저 처리하고 먼저 보낸다 (엄격한 우선순위)
+typedef enum {
+    LANE_CONTROL,
+    LANE_CHAT
+} Lane;
+
+// 트래픽 캡처 파일 (-c): 파일 헤더 뒤에 레코드 헤더와 프레임 바이트가 이어진다.
+// 프레임은 content 뒤의 0을 빼고 저장한다 (replay.c와 같아야 한다).
+typedef struct {
+    char magic[4];          // "VCAP"
+    uint32_t version;
+    int64_t start_time;     // 캡처 시작 시각 (유닉스 시간, 초)
+} CaptureHeader;
+
+typedef enum {
+    CAPTURE_OPEN,           // 연결 시작
+    CAPTURE_FRAME,          // 클라이언트가 보낸 프레임
+    CAPTURE_CLOSE           // 연결 종료
+} CaptureKind;
+
+typedef struct {
+    uint32_t usec_delta;    // 앞 레코드와의 간격 (마이크로초, 약 71분에서 잘림)
+    uint32_t conn;          // 연결 번호 (캡처 안에서 유일)
+    uint16_t kind;
+    uint16_t len;           // 뒤따르는 프레임 바이트 수
+} CaptureRecord;
+
+// 검색 색인 세그먼트 파일. 포인터 없이 mmap해서 그대로 쓴다.
+// 헤더 뒤에 낱말별 목록이 이어지고, terms_off에 해시 순으로 정렬한 SearchTerm 표가 있다.
+// 목록 하나는 건너뛰기 표 SearchSkip[nblocks + 1] (마지막 칸은 데이터 끝) 뒤에 블록들이 온다.
+// 블록은 첫 레코드 번호(세그먼트 안 번호)와 그다음부터의 차이를 varint로 담아 혼자서 풀 수 있다.
+typedef struct {
+    char magic[4];          // "VIDX"
+    uint32_t version;
+    uint64_t first_doc;     // 첫 레코드의 기록 파일 안 순번
+    uint32_t ndocs;
+    uint32_t nterms;
+    uint64_t terms_off;
+    uint64_t size;          // 파일 전체 크기
+} SearchSegment;
+
+typedef struct {
+    uint64_t hash;          // 낱말 해시
+    uint64_t off;           // 건너뛰기 표 위치 (파일 안 오프셋)
+    uint32_t df;            // 들어 있는 레코드 수
+    uint32_t nblocks;
+} SearchTerm;
+
+typedef struct {
+    uint32_t last;          // 블록의 마지막 레코드 번호
+    uint32_t off;           // 블록 시작 (건너뛰기 표 뒤에서부터의 오프셋)
+} SearchSkip;
+
+// 세그먼트 목록 (<기록 파일>.idx). 임시 파일에 쓰고 rename()으로 바꿔 읽는 쪽이 반쯤 쓴 것을 보지 않는다.
+typedef struct {
+    uint32_t seq;           // 파일 이름 번호
+    uint32_t level;         // 병합 단계 (새로 쓴 세그먼트는 0)
+    uint64_t first_doc;
+    uint32_t ndocs;
+    uint32_t reserved;
+} SearchManifestEntry;
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t nsegs;         // first_doc 순서
+    uint32_t next_seq;
+    SearchManifestEntry segs[SEARCH_MAX_SEGMENTS];
+} SearchManifest;
+
+// 낱말 해시의 종류 (같은 글자라도 본문, 방 이름, 닉네임은 다른 낱말이다)
+typedef enum {
+    SEARCH_WORD,
+    SEARCH_ROOM,
+    SEARCH_NICK
+} SearchKind;
+
+// 색인 프로세스가 메모리에 모으는 낱말별 레코드 번호 목록
+typedef struct {
+    uint64_t hash;
+    uint32_t *docs;
+    uint32_t n, cap;
+} SearchPosting;
+
+// 세그먼트 파일을 쓰는 중인 상태 (목록은 바로 파일에 쓰고 SearchTerm 표만 메모리에 둔다)
+typedef struct {
+    FILE *fp;
+    uint64_t off;
+    SearchTerm *terms;
+    uint32_t nterms, cap;
+} SearchWriter;
+
+// 목록 하나를 읽는 커서 (블록 하나를 풀어 둔다)
+typedef struct {
+    const SearchSkip *skips;
+    const unsigned char *data;
+    uint32_t nblocks;
+    int block;                    // 풀어 둔 블록 (-1: 없음)
+    int ndocs;
+    uint32_t docs[SEARCH_BLOCK];
+} SearchCursor;
+
+// 검색 요청 하나
+typedef struct {
+    uint64_t terms[SEARCH_MAX_TERMS];  // 모두 들어 있어야 하는 낱말 해시
+    int nterms;
+    char words[SEARCH_MAX_WORDS][BUF_SIZE]; // 본문에 그대로 있어야 하는 검색어 (영문은 소문자)
+    int nwords;
+    char room[ROOM_NAME_SIZE];         // room: (비어 있으면 모든 방)
+    char nick[NICKNAME_SIZE];          // from:
+    int64_t since, until;              // since:, until: (유닉스 시간)
+    uint64_t hits[SEARCH_RESULTS];     // 찾은 레코드 순번 (최신 것부터)
+    int nhits;
+    unsigned long scanned;             // 확인한 후보 수
+} SearchQuery;
+
+// 서버 통계
+typedef struct {
+    unsigned long frames_out;   // 소켓에 끝까지 쓴 프레임 수
+    unsigned long dropped;      // 송신 대기열이 가득 차 버린 채팅 프레임 수
+    unsigned long send_calls;   // send()/writev() 호출 수
+    unsigned long throttled;    // 속도 제한으로 버린 메시지 수
+    unsigned long reaped;       // 응답이 없어 정리한 연결 수
+    unsigned long peer_out;     // 링크로 보낸 프레임 수
+    unsigned long peer_in;      // 링크에서 받은 프레임 수
+    unsigned long peer_dup;     // 중복/루프로 버린 프레임 수
+    unsigned long peer_gap;     // 재개할 때 놓친 프레임 수
+    unsigned long z_frames;     // 압축한 프레임 수
+    unsigned long z_shared;     // 이미 압축해 둔 바이트를 재사용한 수신자 수
+    unsigned long z_skipped;    // 짧아서 압축하지 않은 프레임 수
+    unsigned long z_in;         // 압축 전 바이트 (보내기 + 받기)
+    unsigned long z_out;        // 압축 후 바이트
+    unsigned long z_nsec;       // 압축/해제에 쓴 CPU 시간 (ns)
+    unsigned long filter_bytes;   // 금지어 검사한 바이트 수
+    unsigned long filter_nsec;    // 금지어 검사에 쓴 CPU 시간 (ns)
+    unsigned long filter_dropped;
+    unsigned long filter_masked;
+    unsigned long filter_flagged;
+    unsigned long filter_reloads;
+    unsigned long lane_bypass;    // 밀린 채팅을 앞질러 나간 제어 프레임 수
+    unsigned long lane_evicted;   // 제어 프레임 자리를 위해 버린 채팅 프레임 수
+    unsigned long captured;       // 캡처 파일에 기록한 프레임 수
+    unsigned long presence_diffs; // 보낸 접속자 변경 프레임 수
+    unsigned long presence_full;  // 보낸 전체 접속자 목록 수
+    unsigned long dm_local;       // 이 서버의 클라이언트에게 전달한 귓속말 수
+    unsigned long dm_remote;      // 다른 서버로 넘긴 귓속말 수
+    unsigned long spool_stored;   // 보관한 귓속말 수
+    unsigned long spool_rejected; // 보관 상한에 걸려 거절한 수
+    unsigned long spool_delivered;
+    unsigned long spool_expired;  // 기간이 지나 지운 파일 수
+    unsigned long attach_uploads;   // 다 받은 첨부 파일 수
+    unsigned long attach_rejected;  // 공간이 없어 거절한 올리기 수
+    unsigned long attach_evicted;   // 공간을 만들려고 먼저 지운 첨부 파일 수
+    unsigned long attach_downloads; // 다 보낸 다운로드 수
+    unsigned long attach_chunks;    // 보낸 조각 수
+    unsigned long attach_in;        // splice()로 받은 바이트
+    unsigned long attach_out;       // sendfile()로 보낸 바이트
+    unsigned long watch_scans;      // 알림 구독을 검사한 메시지 수
+    unsigned long watch_bytes;
+    unsigned long watch_nsec;       // 알림 검사에 쓴 CPU 시간 (ns)
+    unsigned long watch_notified;   // 보낸 알림 수
+    unsigned long watch_rebuilds;   // 오토마톤을 다시 만든 수
+    unsigned long admit_accepted;   // 만든 세션 수
+    unsigned long admit_rejected;   // 재시도 시각을 알려 주고 끊은 연결 수
+    unsigned long admit_queue_max;  // 미루는 동안 본 listen 대기열 최대 길이
+    unsigned long mem_rejected;     // 메모리 상한 때문에 거절한 연결 수
+    unsigned long mem_shed;         // 메모리 상한 때문에 대기열을 늘리지 못하고 버린 채팅 프레임 수
+    unsigned long helpers;          // -L: 핸드셰이크와 검색에 잠깐 띄운 자식 프로세스 수
+    unsigned long steer_local;      // 이 라우터의 코어로 들어온 연결 수 (SO_INCOMING_CPU)
+    unsigned long steer_remote;     // 다른 코어로 들어온 연결 수
+    unsigned long ephemeral_in;     // 받은 입력 중 표시/반응 프레임 수
+    unsigned long ephemeral_out;    // 보낸 입력 중 표시/반응 프레임 수
+    unsigned long ephemeral_superseded; // 보내기 전에 새 상태로 덮여 버린 수 (송신 대기열이 밀린 받는 사람)
+    long long loop_lag_max;         // 루프 한 바퀴 평균 시간의 최댓값 (us)
+} ServerStats;
+
+static OutQueue out_queues[MAX_CLIENTS]; // 클라이언트별 송신 대기열
+static long coalesce_usec = 0; // 병합 대기 시간 (0이면 즉시 전송)
+static ServerStats g_stats;
+
+static ChatRoom rooms[MAX_ROOMS]; // 0번은 기본 방
+static int client_rooms[MAX_CLIENTS]; // 클라이언트가 있는 방 번호
+static TokenBucket client_buckets[MAX_CLIENTS]; // 클라이언트별 전송량 제한
+static RateLimit client_limit; // 연결별 제한 (-r)
+static RateLimit room_limit;   // 방별 제한 (-R)
+static int throttle_notified[MAX_CLIENTS]; // 제한 알림을 이미 보냈는지
+static unsigned long throttle_counts[MAX_CLIENTS]; // 클라이언트별 제한 횟수
+
+// 하트비트: 계층형 타이머 휠로 연결별 타임아웃을 관리한다
+static int wheel[WHEEL_LEVELS][WHEEL_SIZE]; // 슬롯별 리스트 head
+static TimerNode timers[MAX_CLIENTS];
+static unsigned long wheel_tick; // 현재 틱
+static long long wheel_usec;     // 현재 틱이 시작된 시각
+static int idle_timeout = IDLE_TIMEOUT; // 무응답 시 PING 보내기까지 (-k, 0이면 끔)
+static int ping_pending[MAX_CLIENTS];   // PING을 보내고 응답 대기 중인지
+
+static int upgrade_sock = -1; // 무중단 재시작 요청을 받는 유닉스 소켓 (-u)
+
+// 트래픽 캡처 (-c): 루프마다 한 번에 파일에 쓴다
+static int capture_fd = -1;
+static unsigned char capture_buf[CAPTURE_BUF];
+static size_t capture_len;
+static long long capture_last_usec;       // 마지막 레코드 시각
+static uint32_t capture_ids[MAX_CLIENTS]; // 클라이언트별 연결 번호 (0: 기록 안 함)
+static uint32_t capture_next_id = 1;
+
+static ChatMessage inbox[MAX_CLIENTS];  // 이번 루프에 자식에게서 받은 채팅 프레임
+static int inbox_ready[MAX_CLIENTS];
+
+// 서버 간 연동 (full mesh: 모든 노드가 서로를 -p 로 지정)
+static uint32_t node_id;               // 이 서버의 노드 id (-N, 기본값은 호스트 이름, 주소, 포트로 만든다)
+static uint64_t node_epoch;            // 이 프로세스 시작 시각
+static int peer_listen_sock = -1;      // 수신 링크용 리스닝 소켓 (-P)
+static PeerLink peer_links[MAX_PEERS];
+static int peer_count = 0;
+static PeerInbound peer_inbound[MAX_PEERS];
+static PeerOrigin peer_origins[MAX_PEERS * 2];
+static RemoteUser remote_users[MAX_REMOTE_USERS];
+static PeerFrame peer_ring[PEER_RING]; // 로컬에서 만든 프레임 (순번 % PEER_RING)
+static uint64_t peer_next_seq = 1;     // 다음에 붙일 순번
+static long long peer_heartbeat_usec;  // 마지막 생존 확인 프레임 시각
+
+// 대기 서버 (-S): 주 서버의 링크가 끊기면 그때부터 클라이언트를 받는다
+static int standby = 0;
+static int standby_seen_primary = 0;   // 주 서버 링크를 한 번이라도 받았는지
+static long long standby_last_rx;      // 주 서버로부터 마지막으로 프레임을 받은 시각
+
+// 대화 기록 (-H)
+static int history_fd = -1;
+static HistoryRecord history[HISTORY_SIZE]; // 최근 대화 (순번 % HISTORY_SIZE)
+static uint64_t history_count = 0;          // 지금까지 기록한 수
+static uint64_t history_flushed = 0;        // 파일에 쓴 수
+
+// TLS (-T): 핸드셰이크는 자식 프로세스가 OpenSSL로 하고, 레코드 암복호화는 커널(kTLS)에 맡긴다.
+// 그래서 부모의 send()/writev()/recv() 경로는 평문 소켓과 똑같이 동작한다.
+static SSL_CTX *tls_ctx = NULL;
+static int tls_pending[MAX_CLIENTS]; // 핸드셰이크가 끝나기 전이면 읽지도 보내지도 않는다
+
+// 압축: 닉네임 메시지로 협상한다. 프레임마다 독립적으로 압축하고 공용 사전을 미리 넣어
+// 같은 수준을 쓰는 수신자끼리 압축한 바이트를 그대로 나눠 쓴다.
+static int client_zlevel[MAX_CLIENTS];  // 협상한 압축 수준 (0: 고정 크기 프레임)
+static unsigned char *rx_bufs[MAX_CLIENTS]; // 다음 프레임의 앞부분이 남아 있을 때만 풀에서 빌린다
+static size_t rx_lens[MAX_CLIENTS];
+static int compress_min = COMPRESS_MIN; // -z
+static z_stream deflaters[10];          // 수준별 압축기 (처음 쓸 때 초기화)
+static z_stream inflater;
+static int inflater_ready = 0;
+static WireFrame wire_cache[10];        // 수준별 마지막으로 인코딩한 프레임
+static ChatMessage wire_cache_key[10];
+static int wire_cache_valid[10];        // 0번은 압축하지 않은 짧은 프레임
+static int deflater_ready[10];
+
+// 금지어 필터 (-f): 목록이 바뀌면 자식 프로세스가 다시 컴파일해서 파이프로 돌려준다.
+// 그동안 메시지는 이전 오토마톤으로 검사하고, 다 받으면 포인터만 바꾼다.
+static char *filter_path = NULL;
+static FilterTable *filter_table = NULL;
+static struct timespec filter_mtime;      // 마지막으로 컴파일한 파일의 수정 시각
+static long long filter_check_usec;
+static int filter_pipe = -1;              // 컴파일 중인 자식의 출력
+static volatile pid_t filter_pid = -1;    // 컴파일 중인 자식 (SIGCHLD에서 클라이언트와 구분)
+static FilterTable filter_head;           // 받고 있는 오토마톤의 헤더
+static unsigned char *filter_rx = NULL;
+static size_t filter_rx_len;
+
+// 대화 검색: 색인은 따로 띄운 프로세스가 기록 파일 뒤를 따라가며 세그먼트로 쓰고 병합한다.
+// 검색은 요청한 클라이언트의 자식 프로세스가 세그먼트를 mmap해서 하므로 부모의 팬아웃과 겹치지 않는다.
+static char *search_base = NULL;          // 기록 파일 경로 (-H)
+static volatile pid_t search_pid = -1;    // 색인 프로세스 (SIGCHLD에서 클라이언트와 구분)
+static int search_fd = -1;                // 검색하는 자식이 레코드를 읽는 기록 파일
+static long long search_start_usec;       // 색인 프로세스를 마지막으로 띄운 시각
+static SearchPosting *search_postings;    // 색인 프로세스: 아직 쓰지 않은 낱말별 목록
+static uint32_t search_npostings, search_cap;
+static uint32_t *search_slots;            // 낱말 해시 -> search_postings 위치 + 1 (열린 주소법)
+static uint32_t search_nslots;
+static uint64_t search_first, search_docs; // 모으고 있는 레코드 범위
+
+// 접속자 목록: 방에 들어오면 전체 목록을, 그 뒤로는 틱마다 바뀐 것만 모아서 보낸다.
+// 틱 안에서 나갔다 다시 들어온 사용자는 목록이 그대로라 아무것도 보내지 않는다.
+static int presence_on[MAX_CLIENTS];     // 구독한 클라이언트
+static int presence_room[MAX_CLIENTS];   // 목록을 맞춰 둔 방 (-1: 전체 목록을 보내야 함)
+static char presence_names[MAX_ROOMS][PRESENCE_MAX][NICKNAME_SIZE]; // 방별로 마지막에 알린 목록 (정렬)
+static int presence_counts[MAX_ROOMS];
+static int presence_dirty[MAX_ROOMS];    // 이번 틱에 들고 난 사람이 있다
+static int presence_pending = 0;         // 알릴 것이 있다
+static long long presence_usec;          // 모으기 시작한 시각
+
+// 귓속말 보관 (-M): 받는 사람이 접속하지 않았으면 파일에 보관했다가 로그인할 때 묶어서 보낸다
+static char *spool_dir = NULL;
+static long long spool_budget = (long long)SPOOL_BUDGET_MB << 20; // 보관 파일 전체 크기 상한 (바이트)
+static long long spool_bytes;              // 지금 보관 파일 전체 크기
+static long long spool_sweep_usec;         // 마지막으로 기간 지난 파일을 지운 시각
+
+// 첨부 파일 (-A): 소켓 -> 파이프 -> 파일은 splice(), 파일 -> 소켓은 sendfile()로 옮겨
+// 내용이 사용자 공간을 거치지 않는다. 받는 사람이 여럿이어도 같은 파일에서 각자 보낸다.
+static char *attach_dir = NULL;
+static long long attach_budget = (long long)ATTACH_BUDGET_MB << 20;
+static long long attach_bytes;             // 지금 들고 있는 첨부 파일 전체 크기
+static Attachment attachments[ATTACH_MAX];
+static uint32_t attach_next_id = 1;
+static AttachUpload attach_up[MAX_CLIENTS];
+static AttachDownload attach_down[MAX_CLIENTS][ATTACH_DOWNLOADS];
+static int attach_ndown[MAX_CLIENTS];
+static unsigned attach_rr[MAX_CLIENTS];    // 다음에 조각을 보낼 다운로드 (돌아가며)
+static AttachChunk attach_tx[MAX_CLIENTS];
+static int attach_pipe[2] = {-1, -1};      // splice() 중간 파이프 (매번 다 비운다)
+
+// 언급/키워드 알림: 모든 클라이언트의 구독을 금지어 필터와 같은 오토마톤 하나로 묶어
+// 메시지를 한 번만 훑는다. 검사 비용은 구독 수가 아니라 메시지 길이에 비례한다.
+// 구독이 바뀌면 표시만 해 두고 다음 메시지를 검사할 때 다시 만든다.
+static int watch_on[MAX_CLIENTS];          // 알림을 켠 클라이언트 (자기 닉네임 "@닉네임" 언급은 저절로 구독)
+static char watch_keywords[MAX_CLIENTS][WATCH_MAX][WATCH_PATTERN_SIZE];
+static char watch_rooms[MAX_CLIENTS][WATCH_MAX][ROOM_NAME_SIZE]; // 키워드별 방 이름 패턴 (비어 있으면 모든 방)
+static int watch_counts[MAX_CLIENTS];
+static int watch_dirty = 0;                // 구독이 바뀌었다
+static FilterTable *watch_table = NULL;    // 규칙 i = 패턴 i
+static uint32_t *watch_starts = NULL;      // 패턴 i의 구독자는 watch_subs[watch_starts[i] .. watch_starts[i + 1])
+static WatchSub *watch_subs = NULL;
+static unsigned watch_serial;              // 검사한 메시지 번호 (한 메시지에 클라이언트당 알림 한 번)
+static unsigned watch_stamp[MAX_CLIENTS];
+
+// 과부하 제어: 재시작 직후처럼 연결이 한꺼번에 몰리면 세션(fork + pipe 2개)을 초당 수로 제한한다.
+// 루프가 밀리거나 토큰이 없으면 accept를 미루고, listen 대기열이 넘칠 지경이면 받아서
+// 재시도 시각을 알려 주고 끊는다. 클라이언트는 그 시각에 지터를 더해 다시 접속한다.
+static RateLimit admit_limit = {ADMIT_RATE, 0};
+static TokenBucket admit_bucket;
+static long long admit_lag_usec = ADMIT_LAG_MSEC * 1000LL; // 0이면 루프 지연을 보지 않는다
+static long long loop_usec;                // 지난 루프 시각
+static long long loop_lag_usec;            // 루프 한 바퀴 시간 (지수 이동 평균)
+
+// 세션 메모리 (-L, -m). 연결마다 고정으로 드는 것은 클라이언트 번호로 찾는 배열의 한 칸씩이고,
+// 송신 대기열과 수신 버퍼는 쓸 때만 풀에서 빌린다. -L이면 연결마다 프로세스와 파이프도 만들지 않는다.
+static int lean_sessions = 0;
+static MemPool pools[POOL_CLASSES] = {
+    {4 * sizeof(WireFrame), NULL, 0, 0, 0, 0, 0},
+    {16 * sizeof(WireFrame), NULL, 0, 0, 0, 0, 0},
+    {OUTQ_SIZE * sizeof(WireFrame), NULL, 0, 0, 0, 0, 0},
+    {RX_BUF_SIZE, NULL, 0, 0, 0, 0, 0}
+};
+static const int outq_caps[] = {4, 16, OUTQ_SIZE}; // POOL_OUTQ_* 블록의 칸 수
+static long long mem_budget = 0;           // 전체 메모리 상한 (바이트, 0이면 없음)
+static long long child_mem[MAX_CLIENTS];   // 자식 프로세스의 사적 메모리 (마지막으로 잰 값)
+static long long child_mem_total;
+static long long mem_sample_usec;          // 마지막으로 자식 메모리를 잰 시각
+static long long pool_trim_usec;           // 마지막으로 풀을 정리한 시각
+
+// 저지연 프로필 (-C, -B). 지정한 코어마다 라우터 프로세스를 하나씩 고정하고 각자 SO_REUSEPORT
+// 리스닝 소켓을 연다. 커널은 CBPF 프로그램으로 SYN을 처리한 코어의 소켓을 고르므로 연결은
+// 패킷이 도착하는 코어의 라우터가 맡는다. 다른 라우터의 사용자와는 서버 간 링크로 주고받는다.
+static int router_cpus[ROUTER_MAX];
+static int router_count = 0;
+static int router_index = 0;               // 이 프로세스가 맡은 코어 (router_cpus 위치)
+static int busy_poll_usec = 0;             // 클라이언트 소켓의 SO_BUSY_POLL (-B)
+// 라우터 0만 쓴다: 다른 라우터가 끝나면 커널은 그룹의 마지막 소켓을 빈 칸으로 옮기므로
+// 칸 -> 라우터 표를 같은 규칙으로 고치고 CBPF 프로그램을 다시 붙인다.
+static pid_t router_pids[ROUTER_MAX];      // 다른 라우터의 pid (-1: 끝났다)
+static int router_slots[ROUTER_MAX];       // reuseport 그룹의 칸 -> 라우터 번호
+static int router_live;                    // 그룹에 남은 소켓 수
+static volatile sig_atomic_t router_exited = 0;
+
+// 입력 중 표시와 반응: 대화 기록, 서버 간 링크, 보관을 거치지 않고 이 서버에서만 방마다 모은다.
+// 바뀐 것은 틱마다 받는 사람별 비트로만 표시해 두고, 송신 대기열이 비어 있을 때 그때의 상태를 보낸다.
+// 대기열이 밀린 받는 사람은 중간 상태를 건너뛰고 마지막 상태만 받으며, 채팅 프레임보다 앞서지 않는다.
+static EphemeralRoom eph_rooms[MAX_ROOMS];
+static int eph_on[MAX_CLIENTS];            // 구독한 클라이언트
+static long long typing_until[MAX_CLIENTS]; // 입력 중 표시가 사라지는 시각 (0: 입력 중 아님)
+static int typing_count;                   // 입력 중인 클라이언트 수 (있으면 틱마다 만료를 본다)
+static uint64_t typing_shown[MAX_CLIENTS]; // 받는 사람에게 마지막으로 보낸 입력 중 목록 (클라이언트 번호 비트)
+static unsigned eph_pending[MAX_CLIENTS];  // 보낼 상태: 비트 k = 반응 칸 k, EPH_TYPING_BIT = 입력 중 표시
+static int eph_dirty = 0;                  // 이번 틱에 바뀐 것이 있다
+static int eph_waiting = 0;                // 보낼 상태가 남은 클라이언트가 있다
+static long long eph_usec;                 // 마지막 틱 (조용하다가 처음 바뀐 시각)
+
+// 압축 사전: 양쪽이 미리 알고 있는 자주 나오는 바이트열 (client.c와 같아야 한다).
+// 자주 나오는 것일수록 뒤에 둔다. 마지막은 MSG_CHAT 프레임 머리와 닉네임 뒤의 0이다.
+static const char compress_dict[] =
+    "http://https://www..com 사진 파일 링크 회의 점심 내일 오늘 지금 잠깐 혹시 그럼 근데 진짜 "
+    "맞아요 알겠습니다 네 아니요 좋아요 감사합니다 고맙습니다 수고하셨습니다 안녕하세요 "
+    "ㅎㅎㅎㅎ ㅠㅠㅠㅠ ㅋㅋㅋㅋㅋㅋㅋㅋ 님께서 퇴장했습니다.\n"
+    "\x01\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0";
+
+// 자식 -> 부모 알림 (-n): 시그널 핸들러나 파이프로 온 프레임이 표시하고 루프에서 출력한다
+static NotifyMode notify_mode = SERVER_NOTIFY;
+static const char *const notify_names[] = {"signal", "pipe", "none"};
+volatile sig_atomic_t client_joined = 0; // 새 클라이언트 연결
+volatile sig_atomic_t client_left = 0;   // 클라이언트 연결 종료
+volatile sig_atomic_t stop_requested = 0; // SIGTERM/SIGINT를 받았다 (루프를 나와 정리하고 끝낸다)
+static long long reap_usec;              // 마지막으로 자식을 거둔 시각 (시그널을 쓰지 않을 때)
+
+void sigchld_handler(int s);
+void sigusr1_handler(int signo);
+void sigusr2_handler(int signo);
+void sigterm_handler(int signo);
+void child_default_signals(void);
+void reap_children(void);
+void set_nonblocking(int sock);
+long long now_usec(void);
+void route_child_message(int client_index, ChatMessage *mesg);
+void send_message(ChatMessage *message, int sender_index);
+void send_to_room(ChatMessage *message, int room, int except_index);
+void send_to_client(int client_index, ChatMessage *message);
+void queue_frame(int client_index, ChatMessage *message);
+int frame_lane(ChatMessage *message);
+void flush_client(int client_index);
+void flush_due_queues(long long now);
+long long cpu_nsec(void);
+const WireFrame *encode_frame(int level, ChatMessage *message);
+int decode_frame(const unsigned char *payload, size_t len, int flags, ChatMessage *message);
+size_t frame_used(ChatMessage *message);
+void receive_frame(int client_index, ChatMessage *mesg);
+void receive_compressed(int client_index);
+void log_stats(void);
+int parse_rate_limit(const char *arg, RateLimit *limit);
+void bucket_init(TokenBucket *bucket, RateLimit *limit);
+int bucket_take(TokenBucket *bucket, RateLimit *limit, size_t bytes);
+int bucket_ready(TokenBucket *bucket, RateLimit *limit, size_t bytes);
+void bucket_debit(TokenBucket *bucket, size_t bytes);
+double bucket_msg_cap(RateLimit *limit);
+double bucket_byte_cap(RateLimit *limit);
+int allow_message(int client_index, ChatMessage *message);
+int find_room(const char *name);
+void join_room(int client_index, const char *name);
+void release_room(int room);
+void timer_init(long long now);
+void timer_add(int client_index, unsigned long ticks);
+void timer_cancel(int client_index);
+void timer_advance(long long now);
+void timer_link(int client_index, int level, int slot);
+void heartbeat_touch(int client_index);
+void heartbeat_expired(int client_index);
+void handle_client(int client_index);
+void close_client_connection(int client_index);
+void close_handed_off(int client_index);
+void close_other_clients(int client_index);
+int start_session(int client_index, int csock, int ssock, int handshake);
+void session_init(int client_index, int csock);
+int upgrade_listen(const char *path);
+int handoff_to(int usock, int ssock);
+void handoff_header(HandoffRecord *rec, HandoffKind kind);
+int handoff_valid(const HandoffRecord *rec, ssize_t n);
+int take_over(const char *path);
+int activated_listen_fds(void);
+void close_inherited_fds(int keep_from, int keep_count, rlim_t max_fd);
+int send_with_fd(int sock, void *buf, size_t len, int fd);
+ssize_t recv_with_fd(int sock, void *buf, size_t len, int *fd);
+int add_peer(const char *spec);
+int peer_listen(int port);
+void peer_publish(PeerFrameKind kind, const char *room, ChatMessage *message);
+void peer_publish_user(int client_index, PeerFrameKind kind);
+void peer_poll(long long now);
+void peer_link_connect(PeerLink *link, long long now);
+void peer_link_down(PeerLink *link, long long now);
+void peer_link_flush(PeerLink *link);
+void peer_link_read(PeerLink *link, long long now);
+void peer_link_resume(PeerLink *link);
+void peer_inbound_read(PeerInbound *in);
+void peer_inbound_ack(PeerInbound *in, long long now);
+int peer_inbound_send(PeerInbound *in, PeerFrame *frame);
+void peer_inbound_flush(PeerInbound *in);
+void peer_inbound_close(PeerInbound *in);
+uint32_t node_id_derive(int port);
+void peer_receive(PeerInbound *in, PeerFrame *frame);
+PeerOrigin *peer_origin(uint32_t origin);
+void remote_directory_update(PeerFrame *frame);
+int history_open(const char *path);
+void history_append(const char *room, ChatMessage *message);
+void history_flush(void);
+void history_replay(int client_index);
+void standby_check(long long now, int ssock, int backlog);
+char *path_resolve(const char *path);
+int tls_init(const char *spec);
+int tls_accept(int client_index);
+void tls_handshake(int client_index);
+int parse_cpu_list(const char *arg);
+int router_listen(int port, int backlog);
+void router_pin(void);
+void router_attach(int sock);
+void router_rebalance(int sock);
+void session_tune(int csock);
+int filter_parse_line(char *line, int *action, char **pattern, size_t *len);
+FilterTable *filter_compile(const char *path);
+FilterTable *filter_build(const char *const *patterns, const FilterRule *rules, uint32_t nrules);
+size_t filter_table_size(const FilterTable *t);
+int filter_message(int client_index, ChatMessage *message);
+int filter_scan(const FilterTable *t, const char *text, size_t len, unsigned char *masked, uint32_t *line);
+void filter_poll(long long now);
+void filter_receive(void);
+int capture_open(const char *path);
+void capture_event(int client_index, CaptureKind kind, ChatMessage *message);
+void capture_flush(void);
+void presence_touch(int room);
+int presence_collect(int room, char names[][NICKNAME_SIZE]);
+int presence_compare(const void *a, const void *b);
+int presence_add(ChatMessage *frames, int n, int room, char op, const char *name);
+void presence_flush(long long now);
+uint64_t search_hash(SearchKind kind, const char *s, size_t len);
+int search_tokens(const char *text, uint64_t *out, int max);
+int search_load_manifest(const char *base, SearchManifest *m);
+int search_save_manifest(const char *base, SearchManifest *m);
+void search_poll(long long now);
+void search_indexer(const char *base);
+int search_index_records(HistoryRecord *recs, int n, uint64_t first);
+void search_reset_postings(void);
+int search_flush_segment(const char *base, SearchManifest *m);
+int search_merge(const char *base, SearchManifest *m);
+int search_writer_open(SearchWriter *w, const char *path);
+int search_writer_add(SearchWriter *w, uint64_t hash, const uint32_t *docs, uint32_t n);
+int search_writer_close(SearchWriter *w, uint64_t first_doc, uint32_t ndocs);
+int search_compare_postings(const void *a, const void *b);
+SearchSegment *search_map(const char *base, uint32_t seq);
+const SearchTerm *search_find_term(const SearchSegment *seg, uint64_t hash);
+void search_cursor_init(SearchCursor *c, const SearchSegment *seg, const SearchTerm *t);
+int search_cursor_load(SearchCursor *c, int block);
+int search_cursor_has(SearchCursor *c, uint32_t doc);
+int search_parse(const char *text, SearchQuery *q);
+uint64_t search_time_to_doc(int64_t t, uint64_t count);
+int search_match(SearchQuery *q, uint64_t doc);
+void search_segment(SearchQuery *q, const SearchSegment *seg, uint64_t lo, uint64_t hi);
+void search_run(int client_index, const char *text);
+void dm_send(int client_index, ChatMessage *mesg);
+int dm_deliver_local(const char *nickname, ChatMessage *message);
+void spool_path(const char *nickname, char *path, size_t size);
+int spool_open(const char *path, int create, SpoolHeader *h, uint64_t *first, uint64_t *count);
+SpoolResult spool_append(const char *nickname, ChatMessage *message);
+void spool_deliver(int client_index);
+void spool_ack(int client_index, uint64_t seq);
+void spool_compact(int fd, const char *path, SpoolHeader *h, uint64_t first, uint64_t count);
+void spool_sweep(void);
+void attach_request(int client_index, ChatMessage *mesg);
+void attach_put(int client_index, int token, long long size, const char *name);
+void attach_get(int client_index, uint32_t id);
+void attach_notify(int client_index, const char *text);
+int attach_alloc(long long size);
+void attach_free(int slot);
+size_t attach_take(int client_index, const unsigned char *buf, size_t len);
+void attach_receive(int client_index);
+void attach_chunk_done(int client_index);
+int attach_busy(int client_index);
+void attach_send(int client_index);
+void attach_poll(long long now);
+void attach_reset(int client_index);
+void watch_request(int client_index, ChatMessage *mesg);
+void watch_reply(int client_index, const char *text);
+int watch_compare(const void *a, const void *b);
+void watch_rebuild(void);
+void watch_scan(int sender_index, const char *room, ChatMessage *message);
+void watch_notify(const WatchSub *sub, int sender_index, const char *room, ChatMessage *message);
+AdmitDecision admit_check(int ssock, int *retry_msec, const char **reason);
+void admit_reject(int csock, int retry_msec, const char *reason);
+void *pool_alloc(PoolClass c);
+void pool_free(PoolClass c, void *block);
+void pool_trim(void);
+int outq_reserve(int client_index, int need);
+void outq_release(int client_index);
+size_t session_record_bytes(void);
+long long session_estimate(void);
+long long mem_pooled(void);
+long long mem_total(void);
+long long mem_client(int client_index);
+int mem_over(long long extra);
+long long child_private_bytes(pid_t pid);
+void mem_sample(void);
+void session_frame(int client_index, ChatMessage *mesg);
+void send_direct(int client_index, ChatMessage *message);
+void utf8_trim(char *s);
+void ephemeral_request(int client_index, ChatMessage *mesg);
+void ephemeral_touch(void);
+void ephemeral_reset(int client_index, int closing);
+void ephemeral_flush(long long now);
+void ephemeral_send(void);
+void typing_set(int client_index, long long until);
+int typing_frame(int client_index, ChatMessage *frame);
+void react_track(int room, ChatMessage *message);
+void react_toggle(int client_index, const char *emoji, int back);
+int react_frame(int room, int slot, ChatMessage *frame);
+int session_helper(int client_index, int ssock);
+void close_server_sockets(int ssock);
+
+int main(int argc, char **argv) {
+    int ssock, portno;
+    socklen_t clen;
+    struct sockaddr_in servaddr, cliaddr;
+    struct sigaction sa_chld, sa_usr1, sa_usr2, sa;
+    struct rlimit rl;
+    int fd0, fd1, fd2, i, opt;
+    pid_t pid;
+    long long last_stats;
+    char *upgrade_path = NULL, *takeover_path = NULL;
+    char *ident;
+    int backlog = LISTEN_BACKLOG;
+    int listen_fds = 0;
+    int foreground = !SERVER_DAEMON;
+    int peer_port = 0;
+    char *history_path = NULL;
+    char *tls_spec = NULL;
+    char *capture_path = NULL;
+
+    // 옵션 처리
+    //   -w <usec>        브로드캐스트 병합 대기 시간
+    //   -r <msgs>,<bytes> 연결별 초당 전송 제한
+    //   -R <msgs>,<bytes> 방별 초당 전송 제한
+    //   -k <sec>          무응답 연결 확인(PING) 시간, 0이면 끔 (최대 409초)
+    //   -u <path>         무중단 재시작 요청을 받을 유닉스 소켓 경로
+    //   -U <path>         실행 중인 서버로부터 소켓과 연결을 넘겨받음
+    //   -b <backlog>      listen() 대기열 길이
+    //   -D                데몬으로 만들지 않고 포그라운드에서 실행 (런처, 서비스 관리자용)
+    //   -N <id>           서버 간 연동에서 쓸 노드 id
+    //   -P <port>         다른 서버의 링크를 받을 포트
+    //   -p <ip>:<port>    연결할 다른 서버의 링크 포트 (여러 번 지정 가능)
+    //   -H <file>         대화 기록 파일
+    //   -S                대기 서버로 시작 (-P 로 주 서버의 복제 링크를 받음)
+    //   -T <cert>[,<key>] TLS 사용 (인증서와 개인 키 PEM 파일)
+    //   -z <bytes>        이보다 짧은 메시지는 압축하지 않음 (음수면 압축 협상을 거절)
+    //   -f <file>         금지어 규칙 파일 (바뀌면 자동으로 다시 읽음)
+    //   -c <file>         클라이언트가 보낸 프레임을 시각, 연결 번호와 함께 기록 (replay로 재생)
+    //   -M <dir>[,<MB>]   접속하지 않은 사용자에게 온 귓속말을 보관할 디렉터리와 전체 크기 상한
+    //   -A <dir>[,<MB>]   첨부 파일 임시 디렉터리와 전체 크기 상한
+    //   -O <n>[,<ms>]     초당 새 세션 수와 과부하로 보는 루프 지연 (0이면 그 기준을 끔)
+    //   -n <mode>         자식 -> 부모 알림 방식: signal, pipe, none
+    //   -L                연결마다 프로세스를 만들지 않고 부모가 직접 처리 (핸드셰이크와 검색만 자식에게 맡김)
+    //   -m <MB>           전체 메모리 상한 (넘으면 새 연결을 거절하고 송신 대기열을 늘리지 않음)
+    //   -C <cpu>[,<cpu>...] 저지연 프로필: 코어마다 라우터 프로세스를 고정하고 연결을 도착한 코어로 보냄
+    //   -B <usec>         클라이언트 소켓의 busy-poll 시간 (-C 를 쓰면 기본 50)
+    while ((opt = getopt(argc, argv, "w:r:R:k:u:U:b:DN:P:p:H:ST:z:f:c:M:A:O:n:Lm:C:B:")) != -1) {
+        switch (opt) {
+        case 'w':
+            coalesce_usec = atol(optarg);
+            if (coalesce_usec < 0) {
+                coalesce_usec = 0;
+            } else if (coalesce_usec > MAX_COALESCE_USEC) {
+                coalesce_usec = MAX_COALESCE_USEC;
+            }
+            break;
+        case 'r':
+        case 'R':
+            if (parse_rate_limit(optarg, opt == 'r' ? &client_limit : &room_limit) < 0) {
+                fprintf(stderr, "잘못된 전송 제한: %s (예: 5,2000)\n", optarg);
+                return -1;
+            }
+            break;
+        case 'k':
+            idle_timeout = atoi(optarg);
+            if (idle_timeout < 0) {
+                idle_timeout = 0;
+            } else if (idle_timeout > MAX_IDLE_TIMEOUT) {
+                // 타이머 휠은 이보다 먼 만료를 담지 못해 일찍 울린다
+                fprintf(stderr, "무응답 시간이 너무 깁니다: %s (최대 %d초)\n", optarg, MAX_IDLE_TIMEOUT);
+                return -1;
+            }
+            break;
+        case 'u':
+            upgrade_path = optarg;
+            break;
+        case 'U':
+            takeover_path = optarg;
+            break;
+        case 'b':
+            backlog = atoi(optarg);
+            if (backlog <= 0) {
+                backlog = LISTEN_BACKLOG;
+            }
+            break;
+        case 'D':
+            foreground = 1;
+            break;
+        case 'N':
+            node_id = strtoul(optarg, NULL, 10);
+            break;
+        case 'P':
+            peer_port = atoi(optarg);
+            break;
+        case 'H':
+            // 데몬이 되면 chdir("/") 하므로 상대 경로는 여기서 절대 경로로 바꾼다
+            if ((history_path = path_resolve(optarg)) == NULL) {
+                fprintf(stderr, "기록 파일 경로를 찾을 수 없습니다: %s\n", optarg);
+                return -1;
+            }
+            search_base = history_path;
+            break;
+        case 'S':
+            standby = 1;
+            break;
+        case 'T':
+            tls_spec = optarg;
+            break;
+        case 'z':
+            compress_min = atoi(optarg);
+            break;
+        case 'c':
+            // 캡처 파일은 아직 없으므로 디렉터리만 풀어 둔다 (데몬은 chdir("/") 한다)
+            if ((capture_path = path_resolve(optarg)) == NULL) {
+                fprintf(stderr, "캡처 파일 경로를 찾을 수 없습니다: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'M': {
+            char *comma = strchr(optarg, ',');
+            if (comma != NULL) {
+                *comma = '\0';
+                spool_budget = atoll(comma + 1) << 20;
+            }
+            // 데몬은 /로 이동하므로 절대 경로로 바꿔 둔다
+            if ((mkdir(optarg, 0700) < 0 && errno != EEXIST) || (spool_dir = realpath(optarg, NULL)) == NULL
+                || spool_budget <= 0) {
+                fprintf(stderr, "귓속말 보관 디렉터리를 쓸 수 없습니다: %s\n", optarg);
+                return -1;
+            }
+            break;
+        }
+        case 'A': {
+            char *comma = strchr(optarg, ',');
+            if (comma != NULL) {
+                *comma = '\0';
+                attach_budget = atoll(comma + 1) << 20;
+            }
+            if ((attach_dir = realpath(optarg, NULL)) == NULL || attach_budget <= 0) {
+                fprintf(stderr, "첨부 파일 디렉터리를 찾을 수 없습니다: %s\n", optarg);
+                return -1;
+            }
+            break;
+        }
+        case 'O': {
+            char *comma = strchr(optarg, ',');
+            admit_limit.msgs_per_sec = atof(optarg);
+            if (comma != NULL) {
+                admit_lag_usec = atoll(comma + 1) * 1000;
+            }
+            if (admit_limit.msgs_per_sec < 0 || admit_lag_usec < 0) {
+                fprintf(stderr, "잘못된 과부하 기준: %s (예: 100,50)\n", optarg);
+                return -1;
+            }
+            break;
+        }
+        case 'n':
+            for (i = 0; i < 3 && strcmp(optarg, notify_names[i]) != 0; i++) {
+            }
+            if (i == 3) {
+                fprintf(stderr, "알림 방식은 signal, pipe, none 중 하나입니다: %s\n", optarg);
+                return -1;
+            }
+            notify_mode = i;
+            break;
+        case 'L':
+            lean_sessions = 1;
+            break;
+        case 'C':
+            if (parse_cpu_list(optarg) < 0) {
+                fprintf(stderr, "잘못된 코어 목록: %s (예: 2,3, 최대 %d개)\n", optarg, ROUTER_MAX);
+                return -1;
+            }
+            break;
+        case 'B':
+            busy_poll_usec = atoi(optarg);
+            if (busy_poll_usec < 0) {
+                busy_poll_usec = 0;
+            }
+            break;
+        case 'm':
+            mem_budget = atoll(optarg) << 20;
+            if (mem_budget <= 0) {
+                fprintf(stderr, "잘못된 메모리 상한: %s (MB)\n", optarg);
+                return -1;
+            }
+            break;
+        case 'f':
+            // 데몬은 /로 이동하므로 절대 경로로 바꿔 둔다
+            if ((filter_path = realpath(optarg, NULL)) == NULL) {
+                fprintf(stderr, "금지어 규칙 파일을 찾을 수 없습니다: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'p':
+            if (add_peer(optarg) < 0) {
+                fprintf(stderr, "잘못된 피어 주소: %s (예: 127.0.0.1:6101)\n", optarg);
+                return -1;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-w coalesce_usec] [-r msgs,bytes] [-R msgs,bytes] [-k idle_sec] [-u upgrade_sock] [-U old_upgrade_sock] [-b backlog] [-D] [-N node_id] [-P peer_port] [-p peer_ip:port]... [-H history_file] [-S] [-T cert[,key]] [-z min_bytes] [-f filter_rules] [-c capture_file] [-M spool_dir[,MB]] [-A attach_dir[,MB]] [-O sessions_per_sec[,lag_ms]] [-n signal|pipe|none] [-L] [-m memory_MB] [-C cpu[,cpu]...] [-B busy_poll_usec] [port]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    // 라우터마다 따로 쓰는 파일과 포트가 겹치므로 저지연 프로필에서는 쓰지 않는다
+    if (router_count > 0 && (takeover_path != NULL || upgrade_path != NULL || standby || peer_port > 0
+                             || peer_count > 0 || history_path != NULL || spool_dir != NULL
+                             || attach_dir != NULL || capture_path != NULL)) {
+        fprintf(stderr, "-C 는 -u, -U, -S, -P, -p, -H, -M, -A, -c 와 함께 쓸 수 없습니다\n");
+        return -1;
+    }
+    if (router_count > 0 && busy_poll_usec == 0) {
+        busy_poll_usec = BUSY_POLL_USEC;
+    }
+
+    // -L이면 시그널을 보낼 세션 자식이 없으므로 접속/종료는 프레임을 보고 안다
+    if (lean_sessions && notify_mode == NOTIFY_SIGNAL) {
+        notify_mode = NOTIFY_PIPE;
+    }
+
+    // 소켓 활성화: 런처가 미리 열어 둔 리스닝 소켓이 있는지 확인 (fork 전에 pid 확인)
+    listen_fds = activated_listen_fds();
+
+    // syslog 식별자는 실행 파일 이름
+    ident = strrchr(argv[0], '/');
+    ident = (ident != NULL) ? ident + 1 : argv[0];
+
+    if (!foreground) {
+        // 데몬 서버 설정
+        umask(0);
+
+        if(getrlimit(RLIMIT_NOFILE, &rl) < 0){
+            perror("getlimit()");
+        }
+
+        if((pid = fork()) < 0){
+            perror("error()");
+        } else if(pid != 0){
+            return 0;
+        }
+
+        setsid();
+
+        sa.sa_handler = SIG_IGN;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = 0;
+        if(sigaction(SIGHUP, &sa, NULL) < 0){
+            perror("sigaction() : Can't ignore SIGHUP");
+        }
+
+        if(chdir("/") < 0){
+            perror("cd()");
+        }
+
+        if(rl.rlim_max == RLIM_INFINITY){
+            rl.rlim_max = 1024;
+        }
+
+        // 표준 입출력과 넘겨받은 리스닝 소켓을 제외한 fd를 한 번에 닫는다
+        for(i = 0; i < 3; i++){
+            close(i);
+        }
+        close_inherited_fds(LISTEN_FDS_START, listen_fds, rl.rlim_max);
+
+        fd0 = open("/dev/null", O_RDWR);
+        fd1 = dup(0);
+        fd2 = dup(0);
+
+        openlog(ident, LOG_CONS | LOG_PID, LOG_DAEMON);
+        if(fd0 != 0 || fd1 != 1 || fd2 != 2){
+            syslog(LOG_ERR, "unexpected file descriptors %d %d %d", fd0, fd1, fd2);
+            return -1;
+        }
+    } else {
+        openlog(ident, LOG_CONS | LOG_PID | LOG_PERROR, LOG_DAEMON);
+    }
+
+    syslog(LOG_INFO, foreground ? "Foreground Process (notify=%s)" : "Daemon Process (notify=%s)",
+           notify_names[notify_mode]);
+    syslog(LOG_INFO, "sessions: %s, %zu bytes per connection record, memory budget %lld MB",
+           lean_sessions ? "in-process" : "process per client", session_record_bytes(), mem_budget >> 20);
+
+    // 시그널로 알릴 때만 핸들러를 건다. 나머지 방식에서 자식은 시그널을 보내지 않고,
+    // 끝난 자식은 루프에서 REAP_USEC마다 거둔다.
+    if (notify_mode == NOTIFY_SIGNAL) {
+        sa_chld.sa_handler = sigchld_handler;
+        sigemptyset(&sa_chld.sa_mask);
+        sa_chld.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+        if (sigaction(SIGCHLD, &sa_chld, NULL) == -1) {
+            perror("sigaction (SIGCHLD)");
+            exit(1);
+        }
+
+        sa_usr1.sa_handler = sigusr1_handler;
+        sigemptyset(&sa_usr1.sa_mask);
+        sa_usr1.sa_flags = 0;
+        if (sigaction(SIGUSR1, &sa_usr1, NULL) == -1) {
+            perror("sigaction (SIGUSR1)");
+            exit(1);
+        }
+
+        sa_usr2.sa_handler = sigusr2_handler;
+        sigemptyset(&sa_usr2.sa_mask);
+        sa_usr2.sa_flags = 0;
+        if (sigaction(SIGUSR2, &sa_usr2, NULL) == -1) {
+            perror("sigaction (SIGUSR2)");
+            exit(1);
+        }
+    }
+
+    // 끊긴 클라이언트에게 보내다 SIGPIPE로 죽지 않도록 한다 (send()/writev()가 EPIPE를 돌려준다)
+    signal(SIGPIPE, SIG_IGN);
+
+    // 종료 시그널은 루프를 나와 아래의 정리 작업(연결, 자식, 캡처)을 거친 뒤 끝나게 한다
+    sa.sa_handler = sigterm_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    if (sigaction(SIGTERM, &sa, NULL) == -1 || sigaction(SIGINT, &sa, NULL) == -1) {
+        perror("sigaction (SIGTERM)");
+        exit(1);
+    }
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        client_sockets[i] = -1;
+        pipes_to_child[i][0] = -1;
+        pipes_to_child[i][1] = -1;
+        pipes_to_parent[i][0] = -1;
+        pipes_to_parent[i][1] = -1;
+        nicknames[i][0] = '\0';
+        child_pids[i] = -1;
+        out_queues[i].frames = NULL;
+        out_queues[i].cap = 0;
+        out_queues[i].count = 0;
+        out_queues[i].sent_bytes = 0;
+        out_queues[i].urgent_end = 0;
+        client_rooms[i] = 0;
+    }
+    for (int i = 0; i < MAX_ROOMS; i++) {
+        rooms[i].in_use = 0;
+    }
+    for (int i = 0; i < MAX_PEERS; i++) {
+        peer_inbound[i].fd = -1;
+    }
+    for (int i = 0; i < ATTACH_MAX; i++) {
+        attachments[i].fd = -1;
+    }
+    strcpy(rooms[0].name, DEFAULT_ROOM);
+    rooms[0].in_use = 1;
+    bucket_init(&rooms[0].bucket, &room_limit);
+
+    last_stats = now_usec();
+    timer_init(last_stats);
+
+    portno = (optind < argc) ? atoi(argv[optind]) : TCP_PORT;
+    if (takeover_path != NULL) {
+        // 이전 프로세스의 리스닝 소켓과 클라이언트 연결을 그대로 이어받는다
+        if ((ssock = take_over(takeover_path)) < 0) {
+            syslog(LOG_ERR, "takeover from %s failed", takeover_path);
+            return -1;
+        }
+    } else if (router_count > 0) {
+        // 코어마다 라우터 프로세스와 리스닝 소켓을 만든다 (이 뒤로는 라우터마다 따로 실행된다)
+        if ((ssock = router_listen(portno, backlog)) < 0) {
+            syslog(LOG_ERR, "cannot set up routers on port %d", portno);
+            return -1;
+        }
+    } else if (listen_fds > 0) {
+        // 이미 bind/listen 된 소켓이므로 대기 중인 연결도 그대로 남아 있다
+        ssock = LISTEN_FDS_START;
+        if (listen(ssock, backlog) < 0) {
+            perror("listen()");
+            return -1;
+        }
+        syslog(LOG_INFO, "using activated listening socket (fd %d)", ssock);
+    } else {
+        if ((ssock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+            perror("socket()");
+            return -1;
+        }
+
+        // 재시작 직후 이전 연결이 TIME_WAIT로 남아 있어도 바로 다시 연다
+        int reuse = 1;
+        setsockopt(ssock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        memset(&servaddr, 0, sizeof(servaddr));
+        servaddr.sin_family = AF_INET;
+        servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+        servaddr.sin_port = htons(portno);
+
+        if (bind(ssock, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
+            perror("bind()");
+            return -1;
+        }
+
+        // 대기 서버는 승격할 때 listen() 한다. 미리 열어 두면 승격 전까지 연결이 대기열에 쌓인 채 기다린다.
+        if (!standby && listen(ssock, backlog) < 0) {
+            perror("listen()");
+            return -1;
+        }
+    }
+
+    if (node_id == 0) {
+        // 다른 호스트가 같은 포트를 써도 겹치지 않도록 호스트 이름과 주소를 섞는다.
+        // 겹치면 서로의 프레임을 자기 것으로 보고 버리므로 연동할 때는 -N 을 주는 것이 좋다.
+        node_id = node_id_derive(portno);
+        if (peer_count > 0 || peer_port > 0) {
+            syslog(LOG_INFO, "node id %u derived from host and port (use -N to set it)", node_id);
+        }
+    }
+    if (router_count > 1) {
+        // 라우터끼리 서로의 링크 포트로 full mesh를 만든다
+        char spec[32];
+        node_id = node_id * ROUTER_MAX + router_index;
+        peer_port = portno + ROUTER_PEER_OFFSET + router_index;
+        for (i = 0; i < router_count; i++) {
+            if (i != router_index) {
+                snprintf(spec, sizeof(spec), "127.0.0.1:%d", portno + ROUTER_PEER_OFFSET + i);
+                add_peer(spec);
+            }
+        }
+    }
+    node_epoch = (uint64_t)time(NULL) * 1000000 + now_usec() % 1000000;
+    if (peer_port > 0 && (peer_listen_sock = peer_listen(peer_port)) < 0) {
+        syslog(LOG_ERR, "cannot listen for peer links on port %d", peer_port);
+        return -1;
+    }
+    if (standby && peer_listen_sock == -1) {
+        syslog(LOG_ERR, "standby mode needs -P to receive the replication stream");
+        return -1;
+    }
+    if (tls_spec != NULL && tls_init(tls_spec) < 0) {
+        syslog(LOG_ERR, "cannot load TLS certificate/key %s", tls_spec);
+        return -1;
+    }
+    if (history_path != NULL && history_open(history_path) < 0) {
+        syslog(LOG_ERR, "cannot open history file %s", history_path);
+        return -1;
+    }
+    if (capture_path != NULL && capture_open(capture_path) < 0) {
+        syslog(LOG_ERR, "cannot open capture file %s", capture_path);
+        return -1;
+    }
+    if (spool_dir != NULL) {
+        spool_sweep();
+        syslog(LOG_INFO, "spool: %s, %lld bytes in use", spool_dir, spool_bytes);
+    }
+    if (filter_path != NULL) {
+        struct stat st;
+        if (stat(filter_path, &st) < 0 || (filter_table = filter_compile(filter_path)) == NULL) {
+            syslog(LOG_ERR, "cannot load filter rules %s", filter_path);
+            return -1;
+        }
+        filter_mtime = st.st_mtim;
+        syslog(LOG_INFO, "filter: %u rules, %u states", filter_table->nrules, filter_table->nstates);
+    }
+
+    if (upgrade_path != NULL && (upgrade_sock = upgrade_listen(upgrade_path)) < 0) {
+        syslog(LOG_ERR, "cannot listen on upgrade socket %s", upgrade_path);
+        return -1;
+    }
+
+    printf("채팅 서버가 시작되었습니다. 포트 %d에서 대기 중...\n", portno);
+    fflush(stdout);
+
+    clen = sizeof(cliaddr);
+    set_nonblocking(ssock);
+
+    bucket_init(&admit_bucket, &admit_limit);
+    loop_usec = now_usec();
+    // 마지막 클라이언트가 나가도 끝나지 않는다 (무중단 재시작으로 넘겨주거나 SIGTERM/SIGINT를 받을 때만 루프를 나간다)
+    while (1) {
+        if (stop_requested) {
+            syslog(LOG_INFO, "termination signal received, shutting down");
+            break;
+        }
+
+        // 대기 서버는 승격 전까지 연결을 받지 않는다 (들어온 연결은 대기열에 남는다).
+        // 과부하면 미루거나 재시도 시각을 알려 주고 끊는다.
+        int retry_msec = 0;
+        const char *reason = "busy";
+        AdmitDecision admit = standby ? ADMIT_DEFER : admit_check(ssock, &retry_msec, &reason);
+        int csock = admit == ADMIT_DEFER ? -1 : accept(ssock, (struct sockaddr *)&cliaddr, &clen);
+        if (csock >= 0 && admit == ADMIT_REJECT) {
+            admit_reject(csock, retry_msec, reason);
+        } else if (csock > 0) {
+            char ip[BUF_SIZE];
+            inet_ntop(AF_INET, &cliaddr.sin_addr, ip, BUF_SIZE);
+            int client_index;
+            for (client_index = 0; client_index < MAX_CLIENTS; client_index++) {
+                if (client_sockets[client_index] == -1) {
+                    break;
+                }
+            }
+            printf("새 클라이언트 연결: ID %d, IP %s\n", client_index, ip);
+            fflush(stdout);
+
+            if (start_session(client_index, csock, ssock, tls_ctx != NULL) == 0) {
+                g_stats.admit_accepted++;
+            }
+        } else if (csock < 0 && admit == ADMIT_ACCEPT) {
+            // 기다리는 연결이 없었으면 꺼낸 토큰을 돌려준다
+            admit_bucket.msg_tokens += 1;
+            if (errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept()");
+            }
+        }
+
+        // 모든 클라이언트로부터 메시지 읽기
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (client_sockets[i] != -1 && !tls_pending[i] && attach_up[i].left > 0) {
+                // 첨부 파일 조각의 원시 바이트를 받는 중이다
+                attach_receive(i);
+            } else if (client_sockets[i] != -1 && !tls_pending[i] && client_zlevel[i] > 0) {
+                receive_compressed(i);
+            } else if (client_sockets[i] != -1 && !tls_pending[i]) {
+                ChatMessage mesg;
+                ssize_t str_len = recv(client_sockets[i], &mesg, sizeof(ChatMessage), MSG_DONTWAIT);
+                if (str_len > 0) {
+                    receive_frame(i, &mesg);
+                } else if (str_len == 0 || (str_len == -1 && errno != EWOULDBLOCK)) {
+                    // 클라이언트 연결 종료 처리
+                    close_client_connection(i);
+                }
+            }
+        }
+
+        // 자식 프로세스로부터 메시지 읽기 및 메시지 보내기.
+        // 클라이언트마다 한 프레임씩 읽고, 제어 프레임을 먼저 처리한 뒤 채팅을 팬아웃한다.
+        // (한 클라이언트 안에서는 순서가 바뀌지 않는다)
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            inbox_ready[i] = 0;
+            if (pipes_to_parent[i][0] != -1) {
+                ssize_t str_len = read(pipes_to_parent[i][0], &inbox[i], sizeof(ChatMessage));
+                if (str_len > 0 && frame_lane(&inbox[i]) == LANE_CONTROL) {
+                    route_child_message(i, &inbox[i]);
+                } else if (str_len > 0) {
+                    inbox_ready[i] = 1;
+                } else if (str_len == 0 && lean_sessions) {
+                    // -L: 잠깐 띄운 자식이 결과를 다 보내고 끝났다 (거두기는 reap_children)
+                    close(pipes_to_parent[i][0]);
+                    pipes_to_parent[i][0] = -1;
+                    child_pids[i] = -1;
+                }
+            }
+        }
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (inbox_ready[i] && pipes_to_parent[i][0] != -1) {
+                route_child_message(i, &inbox[i]);
+            }
+        }
+
+        // 다른 서버와의 링크 처리 (이번 루프에서 쌓인 프레임을 한 번에 보낸다)
+        long long now = now_usec();
+        // 루프 한 바퀴 시간 (1/8 지수 이동 평균). 할 일이 밀리면 길어진다.
+        loop_lag_usec += (now - loop_usec - loop_lag_usec) / 8;
+        loop_usec = now;
+        if (loop_lag_usec > g_stats.loop_lag_max) {
+            g_stats.loop_lag_max = loop_lag_usec;
+        }
+        if (peer_count > 0 || peer_listen_sock != -1) {
+            peer_poll(now);
+        }
+        if (standby) {
+            standby_check(now, ssock, backlog);
+        }
+
+        if (filter_path != NULL) {
+            filter_poll(now);
+        }
+        if (search_base != NULL) {
+            search_poll(now);
+        }
+        if (spool_dir != NULL && now - spool_sweep_usec >= SPOOL_SWEEP_USEC) {
+            spool_sweep();
+            spool_sweep_usec = now;
+        }
+
+        // 이번 틱에 들고 난 사람을 방마다 한 번에 알린다
+        if (presence_pending) {
+            presence_flush(now);
+        }
+        // 입력 중 표시와 반응도 틱마다 모으고, 만료는 입력 중인 사람이 있을 때만 본다
+        if (eph_dirty || typing_count > 0) {
+            ephemeral_flush(now);
+        }
+
+        // 이번 루프의 대화 기록을 한 번에 파일에 쓴다 (팬아웃이 끝난 뒤)
+        if (history_count != history_flushed) {
+            history_flush();
+        }
+        if (capture_len > 0) {
+            capture_flush();
+        }
+
+        // 병합 대기 시간이 지난 송신 대기열 전송 (병합하지 않을 때는 소켓 버퍼가 차서 남은 프레임)
+        flush_due_queues(now);
+
+        // 모아 둔 입력 중 표시와 반응은 대기열이 빈 연결에만 보낸다 (채팅을 다 보낸 뒤)
+        if (eph_waiting) {
+            ephemeral_send();
+        }
+
+        // 첨부 파일 조각은 밀린 채팅 프레임을 다 보낸 연결에만, 루프마다 한 조각씩 보낸다
+        if (attach_dir != NULL) {
+            attach_poll(now);
+        }
+
+        // 새 바이너리의 인계 요청 처리
+        if (upgrade_sock != -1) {
+            int usock = accept(upgrade_sock, NULL, NULL);
+            if (usock >= 0) {
+                // 레코드 형식이 맞지 않는 바이너리면 인계하지 않고 계속 서비스한다
+                if (handoff_to(usock, ssock) < 0) {
+                    close(usock);
+                    syslog(LOG_ERR, "handoff refused, still serving");
+                    continue;
+                }
+                close(usock);
+                syslog(LOG_INFO, "handed off to new process, exiting");
+                break;
+            }
+        }
+
+        // 만료된 하트비트 타이머 처리
+        timer_advance(now);
+
+        // 다른 라우터가 끝났으면 남은 라우터로 연결을 다시 나눈다 (라우터 0)
+        if (router_exited) {
+            router_rebalance(ssock);
+        }
+
+        if (now - last_stats >= (long long)STATS_INTERVAL * 1000000) {
+            log_stats();
+            last_stats = now;
+        }
+
+        // 자식 프로세스의 메모리를 다시 재고, 한동안 쓰지 않은 풀 블록을 돌려준다
+        if (now - mem_sample_usec >= MEM_SAMPLE_USEC) {
+            mem_sample();
+            mem_sample_usec = now;
+        }
+        if (now - pool_trim_usec >= POOL_TRIM_USEC) {
+            pool_trim();
+            pool_trim_usec = now;
+        }
+
+        // 시그널을 쓰지 않으면 끝난 자식 프로세스를 여기서 거둔다
+        if (notify_mode != NOTIFY_SIGNAL && now - reap_usec >= REAP_USEC) {
+            reap_children();
+            reap_usec = now;
+        }
+
+        // 새 클라이언트 연결 알림 (SIGUSR1 또는 파이프로 온 닉네임 알림)
+        if (client_joined) {
+            printf("새 클라이언트가 연결되었습니다. 현재 연결 수: %d\n", g_noc);
+            client_joined = 0;
+        }
+
+        // 클라이언트 연결 종료 알림 (SIGUSR2 또는 파이프로 온 로그아웃)
+        if (client_left) {
+            printf("클라이언트 연결이 종료되었습니다. 현재 연결 수: %d\n", g_noc);
+            client_left = 0;
+        }
+    }
+
+    // 서버 종료 전 정리 작업. 새 프로세스로 넘긴 연결은 아직 살아 있으므로
+    // 퇴장 알림(피어, 캡처, 접속자 목록)을 내지 않고 이 프로세스의 fd와 자식만 정리한다.
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (client_sockets[i] != -1 && handed_off[i]) {
+            close_handed_off(i);
+        } else if (client_sockets[i] != -1) {
+            close_client_connection(i);
+        }
+    }
+    if (capture_fd != -1) {
+        capture_flush();
+    }
+    if (search_pid > 0) {
+        kill(search_pid, SIGTERM);
+    }
+    close(ssock);
+    printf("서버가 정상적으로 종료되었습니다.\n");
+
+    closelog();
+    return 0;
+}
+
+void sigchld_handler(int s) {
+    (void)s;
+    int saved_errno = errno;
+    reap_children();
+    errno = saved_errno;
+}
+
+void sigusr1_handler(int signo) {
+    (void)signo;
+    client_joined = 1;
+}
+
+void sigusr2_handler(int signo) {
+    (void)signo;
+    client_left = 1;
+}
+
+void sigterm_handler(int signo) {
+    (void)signo;
+    stop_requested = 1;
+}
+
+// 세션과 도우미 자식은 부모가 SIGTERM으로 끝내므로 종료 시그널을 기본 동작으로 되돌린다
+void child_default_signals(void) {
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+}
+
+// 끝난 자식 프로세스를 거둔다. 연결 수(g_noc)는 세션을 만들고 정리할 때만 바꾼다.
+void reap_children(void) {
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        // 금지어 컴파일과 색인 프로세스는 끝나면 다시 띄울 수 있게 표시한다
+        if (pid == filter_pid) {
+            filter_pid = -1;
+        } else if (pid == search_pid) {
+            search_pid = -1;
+        }
+        // -L의 도우미 자식은 연결보다 먼저 끝난다. pid를 지워 두어야 연결을 닫을 때
+        // 다른 프로세스가 다시 쓰는 pid에 SIGTERM을 보내지 않는다 (파이프는 EOF를 읽고 닫는다).
+        if (lean_sessions) {
+            for (int k = 0; k < MAX_CLIENTS; k++) {
+                if (pid == child_pids[k]) {
+                    child_pids[k] = -1;
+                }
+            }
+        }
+        for (int k = 1; k < router_count; k++) {
+            if (pid == router_pids[k]) {
+                router_pids[k] = -1;
+                router_exited = 1;
+            }
+        }
+    }
+}
+
+void set_nonblocking(int sock) {
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+}
+
+long long now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 이 스레드가 쓴 CPU 시간 (압축 비용 측정용)
+long long cpu_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 자식 프로세스가 돌려준 프레임을 처리한다
+void route_child_message(int client_index, ChatMessage *mesg) {
+    if (mesg->type == MSG_SESSION && strcmp(mesg->content, "tls_ready") == 0) {
+        // 자식이 핸드셰이크 중에 블로킹으로 바꿔 둔 소켓을 되돌린다
+        tls_pending[client_index] = 0;
+        set_nonblocking(client_sockets[client_index]);
+        return;
+    } else if (mesg->type == MSG_SESSION && strcmp(mesg->content, "tls_failed") == 0) {
+        close_client_connection(client_index);
+        return;
+    }
+
+    if (mesg->type == MSG_SESSION && strcmp(mesg->content, "nickname") == 0) {
+        // 슬롯은 프레임이 온 파이프로 정한다. 내용에서 번호를 읽지 않는다
+        // 무중단 재시작으로 넘겨받은 클라이언트는 닉네임을 이미 알고 있다
+        int resumed = strncmp(nicknames[client_index], mesg->nickname, NICKNAME_SIZE - 1) == 0;
+        snprintf(nicknames[client_index], NICKNAME_SIZE, "%.*s", NICKNAME_SIZE - 1, mesg->nickname);
+        printf("클라이언트 %d의 닉네임이 설정되었습니다: %s\n", client_index, nicknames[client_index]);
+        peer_publish_user(client_index, PEER_USER_ONLINE);
+        presence_touch(client_rooms[client_index]);
+        watch_dirty = 1;
+        if (notify_mode == NOTIFY_PIPE) {
+            client_joined = 1;
+        }
+        if (!resumed) {
+            history_replay(client_index);
+            spool_deliver(client_index);
+        }
+    } else if (mesg->type == MSG_SEARCH) {
+        // 자식이 찾은 검색 결과는 요청한 클라이언트에게만 보낸다
+        send_to_client(client_index, mesg);
+    } else if (mesg->type == MSG_PRESENCE) {
+        // 구독하면 다음 틱에 지금 방의 전체 목록부터 보낸다
+        presence_on[client_index] = strcmp(mesg->content, "off") != 0;
+        presence_room[client_index] = -1;
+        presence_touch(-1);
+    } else if (mesg->type == MSG_DIRECT) {
+        dm_send(client_index, mesg);
+    } else if (mesg->type == MSG_SPOOL) {
+        // 보관 메시지 확인 응답: 받은 데까지 지우고 다음 묶음을 보낸다
+        spool_ack(client_index, strtoull(mesg->content, NULL, 10));
+    } else if (mesg->type == MSG_WATCH) {
+        watch_request(client_index, mesg);
+    } else if (mesg->type == MSG_JOIN) {
+        join_room(client_index, mesg->content);
+        peer_publish_user(client_index, PEER_USER_ONLINE);
+        history_replay(client_index);
+    } else if (mesg->type != MSG_CHAT
+               || (allow_message(client_index, mesg) && filter_message(client_index, mesg))) {
+        // 속도 제한과 금지어 검사는 팬아웃 전에 적용한다
+        send_message(mesg, client_index);
+        peer_publish(PEER_RELAY, rooms[client_rooms[client_index]].name, mesg);
+        if (mesg->type == MSG_LOGOUT && notify_mode == NOTIFY_PIPE) {
+            client_left = 1;
+        }
+        if (mesg->type == MSG_CHAT) {
+            history_append(rooms[client_rooms[client_index]].name, mesg);
+            watch_scan(client_index, rooms[client_rooms[client_index]].name, mesg);
+            // 보냈으니 입력 중 표시를 지우고, 이 메시지는 반응을 받을 수 있다
+            typing_set(client_index, 0);
+            react_track(client_rooms[client_index], mesg);
+        }
+    }
+}
+
+void send_message(ChatMessage *message, int sender_index) {
+    send_to_room(message, client_rooms[sender_index], sender_index);
+    printf("[%s] %s", message->nickname, message->content);
+    fflush(stdout);
+}
+
+// 방에 있는 클라이언트에게 전송한다 (except_index 제외, -1이면 모두)
+void send_to_room(ChatMessage *message, int room, int except_index) {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (client_sockets[i] != -1 && i != except_index && client_rooms[i] == room
+            && !(message->type == MSG_LOGOUT && presence_on[i])) {
+            // 접속자 목록을 구독한 클라이언트는 퇴장 문구 대신 목록 변경으로 알 수 있다
+            send_to_client(i, message);
+        }
+    }
+}
+
+void send_to_client(int client_index, ChatMessage *message) {
+    if (tls_pending[client_index]) {
+        return;
+    }
+    // 앞서 다 못 보낸 프레임이 있거나 첨부 파일 조각을 보내는 중이면 순서를 지키도록 대기열을 거친다
+    if (coalesce_usec > 0 || out_queues[client_index].count > 0 || attach_busy(client_index)) {
+        queue_frame(client_index, message);
+        return;
+    }
+    send_direct(client_index, message);
+}
+
+// 대기열을 거치지 않고 바로 보낸다. 소켓 버퍼가 차서 다 못 보낸 나머지만 대기열에 둔다.
+void send_direct(int client_index, ChatMessage *message) {
+    const WireFrame *wire = encode_frame(client_zlevel[client_index], message);
+    ssize_t n = send(client_sockets[client_index], wire->data, wire->len, 0);
+    g_stats.send_calls++;
+    if (n == (ssize_t)wire->len) {
+        g_stats.frames_out++;  // 나머지를 대기열에 둔 프레임은 flush_client가 다 보낸 뒤 센다
+    }
+    if (n < (ssize_t)wire->len && (n >= 0 || errno == EWOULDBLOCK || errno == EAGAIN)) {
+        // 소켓 버퍼가 가득 찼다: 나머지는 대기열에 두고 다음 루프에서 이어서 보낸다
+        OutQueue *q = &out_queues[client_index];
+        if (outq_reserve(client_index, 1) < 0) {
+            // 프레임 중간에서 멈춘 연결은 이어 쓸 수 없으므로 끊는다 (다음 recv()가 정리한다)
+            shutdown(client_sockets[client_index], SHUT_RDWR);
+            return;
+        }
+        q->frames[0] = *wire;
+        q->count = 1;
+        q->sent_bytes = n > 0 ? n : 0;
+        q->urgent_end = frame_lane(message) == LANE_CONTROL;
+        q->first_usec = now_usec();
+    }
+}
+
+// 레인은 프레임 유형으로만 정한다. 채팅 메시지만 채팅 레인이고 나머지(자식이 돌려주는 MSG_SESSION 포함)는
+// 제어 레인이다. 내용은 보지 않으므로 클라이언트가 채팅 내용으로 제어 레인에 끼어들 수 없다
+int frame_lane(ChatMessage *message) {
+    // 검색 결과와 보관 메시지는 여러 프레임이 한꺼번에 나가므로 채팅과 같은 레인으로 보낸다
+    switch (message->type) {
+    case MSG_CHAT:
+    case MSG_SEARCH:
+    case MSG_DIRECT:
+    case MSG_SPOOL:
+    case MSG_FILE:
+    case MSG_WATCH:
+    case MSG_EPHEMERAL:
+        return LANE_CHAT;
+    default:
+        return LANE_CONTROL;
+    }
+}
+
+// 프레임을 송신 대기열에 쌓는다. 대기열이 가득 차면 바로 내보낸다.
+// 제어 프레임은 밀린 채팅 앞에 끼워 넣고 병합 대기 없이 바로 내보낸다.
+void queue_frame(int client_index, ChatMessage *message) {
+    OutQueue *q = &out_queues[client_index];
+    int control = frame_lane(message) == LANE_CONTROL;
+
+    if (q->count == OUTQ_SIZE) {
+        flush_client(client_index);
+    }
+    if (q->count == q->cap && outq_reserve(client_index, q->count + 1) < 0) {
+        // 소켓 버퍼가 가득 찬 느린 클라이언트 (또는 메모리 상한에 걸려 대기열을 늘릴 수 없다):
+        // 가장 최근 채팅 프레임을 버린다. 제어 프레임은 버리지 않고 마지막 채팅 프레임의 자리를 빼앗는다.
+        if (!control || q->count == 0 || q->count - 1 < q->urgent_end || (q->count == 1 && q->sent_bytes > 0)) {
+            g_stats.dropped++;
+            return;
+        }
+        q->count--;
+        g_stats.lane_evicted++;
+    }
+    if (q->count == 0) {
+        q->first_usec = now_usec();
+    }
+
+    if (control) {
+        // 부분 전송 중인 맨 앞 프레임은 건드리지 않는다
+        int pos = q->urgent_end > 0 ? q->urgent_end : (q->sent_bytes > 0 ? 1 : 0);
+        if (pos < q->count) {
+            memmove(q->frames + pos + 1, q->frames + pos, (q->count - pos) * sizeof(WireFrame));
+            g_stats.lane_bypass++;
+        }
+        q->frames[pos] = *encode_frame(client_zlevel[client_index], message);
+        q->urgent_end = pos + 1;
+        q->count++;
+    } else {
+        q->frames[q->count++] = *encode_frame(client_zlevel[client_index], message);
+    }
+
+    if (control || q->count == OUTQ_SIZE) {
+        flush_client(client_index);
+    }
+}
+
+// 쌓인 프레임을 writev() 한 번으로 전송한다
+void flush_client(int client_index) {
+    OutQueue *q = &out_queues[client_index];
+    struct iovec iov[OUTQ_SIZE];
+    size_t skip = q->sent_bytes;
+    int iovcnt = 0;
+
+    if (q->count == 0 || client_sockets[client_index] == -1 || attach_busy(client_index)) {
+        return;
+    }
+
+    for (int i = 0; i < q->count; i++) {
+        char *base = (char *)q->frames[i].data;
+        size_t len = q->frames[i].len;
+        if (skip >= len) {
+            skip -= len;
+            continue;
+        }
+        iov[iovcnt].iov_base = base + skip;
+        iov[iovcnt].iov_len = len - skip;
+        skip = 0;
+        iovcnt++;
+    }
+
+    ssize_t n = writev(client_sockets[client_index], iov, iovcnt);
+    g_stats.send_calls++;
+    if (n < 0) {
+        if (errno != EWOULDBLOCK && errno != EAGAIN) {
+            outq_release(client_index);
+        }
+        return;
+    }
+
+    // 다 보내지 못한 프레임은 앞으로 당겨 다음 루프에서 이어서 보낸다
+    size_t total = q->sent_bytes + n;
+    int done = 0;
+    while (done < q->count && total >= q->frames[done].len) {
+        total -= q->frames[done].len;
+        done++;
+    }
+    q->sent_bytes = total;
+    g_stats.frames_out += done;
+    q->urgent_end = q->urgent_end > done ? q->urgent_end - done : 0;
+    if (done > 0) {
+        memmove(q->frames, q->frames + done, (q->count - done) * sizeof(WireFrame));
+        q->count -= done;
+    }
+    if (q->count > 0) {
+        q->first_usec = now_usec();
+    } else {
+        // 다 보냈으면 칸을 풀에 돌려준다 (쉬는 연결은 대기열 메모리를 들고 있지 않는다)
+        outq_release(client_index);
+    }
+}
+
+void flush_due_queues(long long now) {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (out_queues[i].count > 0 && now - out_queues[i].first_usec >= coalesce_usec) {
+            flush_client(i);
+        }
+    }
+}
+
+// 프레임에서 실제로 쓰는 바이트 수 (content 뒤의 0은 보내지 않는다)
+size_t frame_used(ChatMessage *message) {
+    return offsetof(ChatMessage, content) + strnlen(message->content, BUF_SIZE);
+}
+
+// 연결의 협상 결과에 맞게 프레임을 인코딩한다. 직전과 같은 메시지를 같은 수준으로
+// 다시 인코딩하면 만들어 둔 바이트를 돌려준다 (방 팬아웃에서 수신자마다 압축하지 않는다).
+const WireFrame *encode_frame(int level, ChatMessage *message) {
+    static WireFrame plain;
+    size_t used, zlen;
+    int slot;
+
+    if (level <= 0) {
+        plain.len = sizeof(ChatMessage);
+        memcpy(plain.data, message, sizeof(ChatMessage));
+        return &plain;
+    }
+
+    used = frame_used(message);
+    slot = used - offsetof(ChatMessage, content) < (size_t)compress_min ? 0 : level;
+    if (wire_cache_valid[slot] && memcmp(&wire_cache_key[slot], message, sizeof(ChatMessage)) == 0) {
+        if (slot > 0) {
+            g_stats.z_shared++;
+        }
+        return &wire_cache[slot];
+    }
+
+    WireFrame *wire = &wire_cache[slot];
+    wire_cache_key[slot] = *message;
+    wire_cache_valid[slot] = 1;
+    zlen = used;
+    wire->data[2] = 0;
+    if (slot == 0) {
+        g_stats.z_skipped++;
+    } else {
+        z_stream *zs = &deflaters[level];
+        long long start = cpu_nsec();
+        int ok = deflater_ready[level]
+            ? deflateReset(zs) == Z_OK
+            : deflateInit2(zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        deflater_ready[level] = deflater_ready[level] || ok;
+        if (ok && deflateSetDictionary(zs, (const Bytef *)compress_dict, sizeof(compress_dict) - 1) == Z_OK) {
+            zs->next_in = (Bytef *)message;
+            zs->avail_in = used;
+            zs->next_out = wire->data + WIRE_HDR;
+            zs->avail_out = WIRE_MAX - WIRE_HDR;
+            // 압축해도 줄지 않으면 그대로 보낸다
+            if (deflate(zs, Z_FINISH) == Z_STREAM_END && WIRE_MAX - WIRE_HDR - zs->avail_out < used) {
+                zlen = WIRE_MAX - WIRE_HDR - zs->avail_out;
+                wire->data[2] = WIRE_DEFLATE;
+            }
+        }
+        g_stats.z_frames++;
+        g_stats.z_in += used;
+        g_stats.z_out += zlen;
+        g_stats.z_nsec += cpu_nsec() - start;
+    }
+    if (!(wire->data[2] & WIRE_DEFLATE)) {
+        memcpy(wire->data + WIRE_HDR, message, used);
+    }
+    wire->data[0] = zlen >> 8;
+    wire->data[1] = zlen & 0xff;
+    wire->len = WIRE_HDR + zlen;
+    return wire;
+}
+
+// 압축 협상 연결의 프레임 본문을 ChatMessage로 되돌린다 (보내지 않은 뒷부분은 0)
+int decode_frame(const unsigned char *payload, size_t len, int flags, ChatMessage *message) {
+    memset(message, 0, sizeof(*message));
+    if (!(flags & WIRE_DEFLATE)) {
+        if (len < offsetof(ChatMessage, content) || len > sizeof(ChatMessage)) {
+            return -1;
+        }
+        memcpy(message, payload, len);
+        return 0;
+    }
+
+    long long start = cpu_nsec();
+    int ok = inflater_ready ? inflateReset(&inflater) == Z_OK : inflateInit2(&inflater, -15) == Z_OK;
+    inflater_ready = inflater_ready || ok;
+    if (!ok || inflateSetDictionary(&inflater, (const Bytef *)compress_dict, sizeof(compress_dict) - 1) != Z_OK) {
+        return -1;
+    }
+    inflater.next_in = (Bytef *)payload;
+    inflater.avail_in = len;
+    inflater.next_out = (Bytef *)message;
+    inflater.avail_out = sizeof(ChatMessage);
+    ok = inflate(&inflater, Z_FINISH) == Z_STREAM_END;
+    size_t used = sizeof(ChatMessage) - inflater.avail_out;
+    g_stats.z_frames++;
+    g_stats.z_in += used;
+    g_stats.z_out += len;
+    g_stats.z_nsec += cpu_nsec() - start;
+    return ok && used >= offsetof(ChatMessage, content) ? 0 : -1;
+}
+
+// 클라이언트에게서 받은 프레임 하나를 처리한다
+void receive_frame(int client_index, ChatMessage *mesg) {
+    // 어떤 프레임이든 받으면 살아 있는 연결이다
+    heartbeat_touch(client_index);
+
+    // 압축 협상: 닉네임 메시지의 content에 "[CAPS]deflate=<수준>"을 실어 보낸다
+    if (mesg->type == MSG_NICKNAME && strncmp(mesg->content, "[CAPS]", 6) == 0) {
+        int level = 0;
+        if (client_zlevel[client_index] == 0 && compress_min >= 0) {
+            sscanf(mesg->content + 6, "deflate=%d", &level);
+        }
+        ChatMessage caps = {MSG_CAPS, "", "none"};
+        if (level >= 1 && level <= 9) {
+            snprintf(caps.content, BUF_SIZE, "deflate=%d,min=%d", level, compress_min);
+        }
+        // 응답은 아직 고정 크기 프레임으로 나가고, 그 뒤부터 압축 형식을 쓴다
+        send_to_client(client_index, &caps);
+        if (level >= 1 && level <= 9) {
+            client_zlevel[client_index] = level;
+        }
+        mesg->content[0] = '\0';
+    }
+
+    // 첨부 파일은 부모가 바로 처리한다. data 프레임 뒤에 원시 바이트가 이어지므로
+    // 자식을 거치면 다음 recv()가 그 바이트를 프레임으로 읽어 버린다. (캡처에도 남기지 않는다)
+    if (mesg->type == MSG_FILE) {
+        attach_request(client_index, mesg);
+        return;
+    }
+
+    // 입력 중 표시와 반응도 부모가 바로 모은다. 자식, 대화 기록, 서버 간 링크를 거치지 않는다.
+    // 캡처(-c)에는 남긴다: 캡처는 대화 보관이 아니라 재생 도구가 같은 부하를 다시 만들기 위한 것이다.
+    if (mesg->type == MSG_EPHEMERAL) {
+        capture_event(client_index, CAPTURE_FRAME, mesg);
+        ephemeral_request(client_index, mesg);
+        return;
+    }
+
+    // 세션 알림은 세션 자식만 부모에게 보낸다. 클라이언트가 보낸 것은 버린다
+    if (mesg->type == MSG_SESSION) {
+        return;
+    }
+
+    // PONG은 서버의 PING에 대한 응답이라 기록하지 않는다 (재생 도구가 직접 응답한다)
+    if (mesg->type != MSG_PONG) {
+        capture_event(client_index, CAPTURE_FRAME, mesg);
+        session_frame(client_index, mesg);
+    }
+}
+
+// 압축을 협상한 연결에서 읽는다. 프레임 길이가 제각각이라 받은 바이트를 모아 두고 잘라 쓴다.
+// 대부분은 프레임이 통째로 들어오므로 스택에서 처리하고, 잘린 프레임이 남을 때만 풀에서 버퍼를 빌린다.
+void receive_compressed(int client_index) {
+    unsigned char stack_buf[RX_BUF_SIZE];
+    unsigned char *buf = rx_bufs[client_index] != NULL ? rx_bufs[client_index] : stack_buf;
+    size_t off = 0;
+    ssize_t n = recv(client_sockets[client_index], buf + rx_lens[client_index],
+                     RX_BUF_SIZE - rx_lens[client_index], MSG_DONTWAIT);
+
+    if (n == 0 || (n < 0 && errno != EWOULDBLOCK)) {
+        close_client_connection(client_index);
+        return;
+    } else if (n < 0) {
+        return;
+    }
+    rx_lens[client_index] += n;
+
+    while (rx_lens[client_index] - off >= WIRE_HDR) {
+        size_t len = (buf[off] << 8) | buf[off + 1];
+        ChatMessage mesg;
+        if (len > WIRE_MAX - WIRE_HDR) {
+            syslog(LOG_WARNING, "client %d: bad frame length %zu", client_index, len);
+            close_client_connection(client_index);
+            return;
+        }
+        if (rx_lens[client_index] - off < WIRE_HDR + len) {
+            break;
+        }
+        if (decode_frame(buf + off + WIRE_HDR, len, buf[off + 2], &mesg) < 0) {
+            syslog(LOG_WARNING, "client %d: cannot decode frame", client_index);
+            close_client_connection(client_index);
+            return;
+        }
+        off += WIRE_HDR + len;
+        receive_frame(client_index, &mesg);
+        if (client_sockets[client_index] == -1) {
+            return;
+        }
+        // 첨부 파일 조각: 이미 버퍼에 들어온 원시 바이트부터 쓰고 나머지는 splice()로 받는다
+        if (attach_up[client_index].left > 0) {
+            off += attach_take(client_index, buf + off, rx_lens[client_index] - off);
+            if (attach_up[client_index].left > 0) {
+                break;
+            }
+        }
+    }
+    rx_lens[client_index] -= off;
+    if (rx_lens[client_index] == 0 && rx_bufs[client_index] != NULL) {
+        pool_free(POOL_RX, rx_bufs[client_index]);
+        rx_bufs[client_index] = NULL;
+    } else if (rx_lens[client_index] > 0 && buf == stack_buf) {
+        if ((rx_bufs[client_index] = pool_alloc(POOL_RX)) == NULL) {
+            syslog(LOG_ERR, "client %d: out of memory for receive buffer", client_index);
+            close_client_connection(client_index);
+            return;
+        }
+        memcpy(rx_bufs[client_index], buf + off, rx_lens[client_index]);
+    } else if (rx_lens[client_index] > 0) {
+        memmove(buf, buf + off, rx_lens[client_index]);
+    }
+}
+
+void log_stats(void) {
+    syslog(LOG_INFO, "stats: clients=%d frames_out=%lu dropped=%lu send_calls=%lu throttled=%lu reaped=%lu",
+           g_noc, g_stats.frames_out, g_stats.dropped, g_stats.send_calls, g_stats.throttled, g_stats.reaped);
+    long long conn_max = 0;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (client_sockets[i] != -1 && mem_client(i) > conn_max) {
+            conn_max = mem_client(i);
+        }
+    }
+    syslog(LOG_INFO, "stats: memory sessions=%s record=%zu pooled=%lld children=%lld total=%lld budget=%lld per_conn avg=%lld max=%lld rejected=%lu shed=%lu helpers=%lu",
+           lean_sessions ? "in-process" : "process", session_record_bytes(), mem_pooled(), child_mem_total,
+           mem_total(), mem_budget, g_noc > 0 ? mem_total() / g_noc : 0, conn_max, g_stats.mem_rejected,
+           g_stats.mem_shed, g_stats.helpers);
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        if (pools[c].allocs > 0) {
+            syslog(LOG_INFO, "stats: pool %zu bytes used=%lu free=%lu mallocs=%lu trimmed=%lu", pools[c].size,
+                   pools[c].used, pools[c].nfree, pools[c].allocs, pools[c].trimmed);
+        }
+    }
+    if (filter_table != NULL) {
+        syslog(LOG_INFO, "stats: filter rules=%u scanned=%lu bytes %.1f MB/s dropped=%lu masked=%lu flagged=%lu reloads=%lu",
+               filter_table->nrules, g_stats.filter_bytes,
+               g_stats.filter_nsec > 0 ? g_stats.filter_bytes * 1000.0 / g_stats.filter_nsec : 0.0,
+               g_stats.filter_dropped, g_stats.filter_masked, g_stats.filter_flagged, g_stats.filter_reloads);
+    }
+    if (capture_fd != -1) {
+        syslog(LOG_INFO, "stats: captured=%lu", g_stats.captured);
+    }
+    if (g_stats.presence_diffs > 0 || g_stats.presence_full > 0) {
+        syslog(LOG_INFO, "stats: presence diff_frames=%lu full_lists=%lu", g_stats.presence_diffs,
+               g_stats.presence_full);
+    }
+    if (g_stats.ephemeral_in > 0) {
+        syslog(LOG_INFO, "stats: ephemeral in=%lu out=%lu superseded=%lu typing=%d",
+               g_stats.ephemeral_in, g_stats.ephemeral_out, g_stats.ephemeral_superseded, typing_count);
+    }
+    if (spool_dir != NULL || g_stats.dm_local > 0 || g_stats.dm_remote > 0) {
+        syslog(LOG_INFO, "stats: dm local=%lu remote=%lu spool stored=%lu rejected=%lu delivered=%lu expired_files=%lu bytes=%lld",
+               g_stats.dm_local, g_stats.dm_remote, g_stats.spool_stored, g_stats.spool_rejected,
+               g_stats.spool_delivered, g_stats.spool_expired, spool_bytes);
+    }
+    if (attach_dir != NULL) {
+        syslog(LOG_INFO, "stats: attach uploads=%lu rejected=%lu evicted=%lu downloads=%lu chunks=%lu in=%lu out=%lu bytes=%lld",
+               g_stats.attach_uploads, g_stats.attach_rejected, g_stats.attach_evicted, g_stats.attach_downloads,
+               g_stats.attach_chunks, g_stats.attach_in, g_stats.attach_out, attach_bytes);
+    }
+    if (g_stats.admit_rejected > 0 || g_stats.admit_queue_max > 0) {
+        syslog(LOG_INFO, "stats: admit accepted=%lu rejected=%lu queue_max=%lu loop_lag=%lldus max=%lldus",
+               g_stats.admit_accepted, g_stats.admit_rejected, g_stats.admit_queue_max, loop_lag_usec,
+               g_stats.loop_lag_max);
+    }
+    if (router_count > 0) {
+        syslog(LOG_INFO, "stats: router %d/%d cpu=%d steer local=%lu remote=%lu busy_poll=%dus",
+               router_index, router_count, router_cpus[router_index], g_stats.steer_local, g_stats.steer_remote,
+               busy_poll_usec);
+    }
+    if (g_stats.watch_scans > 0) {
+        syslog(LOG_INFO, "stats: watch patterns=%u scanned=%lu msgs %lu bytes %.1f MB/s notified=%lu rebuilds=%lu",
+               watch_table != NULL ? watch_table->nrules : 0, g_stats.watch_scans, g_stats.watch_bytes,
+               g_stats.watch_nsec > 0 ? g_stats.watch_bytes * 1000.0 / g_stats.watch_nsec : 0.0,
+               g_stats.watch_notified, g_stats.watch_rebuilds);
+    }
+    if (g_stats.lane_bypass > 0 || g_stats.lane_evicted > 0) {
+        syslog(LOG_INFO, "stats: control_bypass=%lu chat_evicted=%lu", g_stats.lane_bypass, g_stats.lane_evicted);
+    }
+    if (g_stats.z_frames > 0 || g_stats.z_skipped > 0) {
+        syslog(LOG_INFO, "stats: compress frames=%lu shared=%lu skipped=%lu bytes=%lu->%lu ratio=%.2f cpu=%luus (%luns/frame)",
+               g_stats.z_frames, g_stats.z_shared, g_stats.z_skipped, g_stats.z_in, g_stats.z_out,
+               g_stats.z_out > 0 ? (double)g_stats.z_in / g_stats.z_out : 0.0,
+               g_stats.z_nsec / 1000, g_stats.z_frames > 0 ? g_stats.z_nsec / g_stats.z_frames : 0);
+    }
+    if (peer_count > 0 || peer_listen_sock != -1) {
+        int remote = 0;
+        for (int i = 0; i < MAX_REMOTE_USERS; i++) {
+            remote += remote_users[i].in_use;
+        }
+        syslog(LOG_INFO, "stats: peer_out=%lu peer_in=%lu peer_dup=%lu peer_gap=%lu remote_users=%d",
+               g_stats.peer_out, g_stats.peer_in, g_stats.peer_dup, g_stats.peer_gap, remote);
+        for (int i = 0; i < peer_count; i++) {
+            syslog(LOG_INFO, "stats: peer %s:%d %s unacked=%llu",
+                   inet_ntoa(peer_links[i].addr.sin_addr), ntohs(peer_links[i].addr.sin_port),
+                   peer_links[i].state == LINK_UP ? "up" : "down",
+                   (unsigned long long)(peer_next_seq - 1 - peer_links[i].acked_seq));
+        }
+    }
+    if (history_fd != -1) {
+        syslog(LOG_INFO, "stats: history=%llu", (unsigned long long)history_count);
+    }
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (client_sockets[i] != -1 && throttle_counts[i] > 0) {
+            syslog(LOG_INFO, "stats: client %d room=%s throttled=%lu",
+                   i, rooms[client_rooms[i]].name, throttle_counts[i]);
+        }
+    }
+}
+
+// "<msgs>,<bytes>" 형식의 초당 제한을 읽는다
+int parse_rate_limit(const char *arg, RateLimit *limit) {
+    char *end;
+
+    limit->msgs_per_sec = strtod(arg, &end);
+    if (end == arg || *end != ',' || limit->msgs_per_sec < 0) {
+        return -1;
+    }
+    arg = end + 1;
+    limit->bytes_per_sec = strtod(arg, &end);
+    if (end == arg || *end != '\0' || limit->bytes_per_sec < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// 버킷을 버스트 허용량(1초 분량, 적어도 메시지 1개와 프레임 1개)으로 채운다
+void bucket_init(TokenBucket *bucket, RateLimit *limit) {
+    bucket->msg_tokens = bucket_msg_cap(limit);
+    bucket->byte_tokens = bucket_byte_cap(limit);
+    bucket->last_usec = now_usec();
+}
+
+// 초당 1개보다 느린 제한도 언젠가 통과하도록 버킷은 적어도 메시지 1개를 담는다
+double bucket_msg_cap(RateLimit *limit) {
+    return limit->msgs_per_sec > 1 ? limit->msgs_per_sec : 1;
+}
+
+// 초당 한 프레임보다 적은 바이트 제한도 가장 긴 본문(BUF_SIZE)은 담을 수 있어야 한다
+double bucket_byte_cap(RateLimit *limit) {
+    return limit->bytes_per_sec > BUF_SIZE ? limit->bytes_per_sec : BUF_SIZE;
+}
+
+// 지난 시간만큼 토큰을 채운 뒤 메시지 1개와 bytes 만큼 꺼낼 수 있으면 1을 반환 (꺼내지는 않는다)
+int bucket_ready(TokenBucket *bucket, RateLimit *limit, size_t bytes) {
+    long long now = now_usec();
+    double elapsed = (now - bucket->last_usec) / 1000000.0;
+    int ready = 1;
+    bucket->last_usec = now;
+
+    if (limit->msgs_per_sec > 0) {
+        bucket->msg_tokens += elapsed * limit->msgs_per_sec;
+        if (bucket->msg_tokens > bucket_msg_cap(limit)) {
+            bucket->msg_tokens = bucket_msg_cap(limit);
+        }
+        ready = ready && bucket->msg_tokens >= 1;
+    }
+    if (limit->bytes_per_sec > 0) {
+        bucket->byte_tokens += elapsed * limit->bytes_per_sec;
+        if (bucket->byte_tokens > bucket_byte_cap(limit)) {
+            bucket->byte_tokens = bucket_byte_cap(limit);
+        }
+        ready = ready && bucket->byte_tokens >= bytes;
+    }
+    return ready;
+}
+
+void bucket_debit(TokenBucket *bucket, size_t bytes) {
+    bucket->msg_tokens -= 1;
+    bucket->byte_tokens -= bytes;
+}
+
+// 토큰을 채운 뒤 메시지 1개와 bytes 만큼 꺼낼 수 있으면 꺼내고 1을 반환
+int bucket_take(TokenBucket *bucket, RateLimit *limit, size_t bytes) {
+    if (!bucket_ready(bucket, limit, bytes)) {
+        return 0;
+    }
+    bucket_debit(bucket, bytes);
+    return 1;
+}
+
+// 연결별, 방별 버킷을 모두 통과해야 팬아웃한다. 막히면 보낸 클라이언트에게 알린다.
+int allow_message(int client_index, ChatMessage *message) {
+    size_t bytes = strnlen(message->content, BUF_SIZE);
+    ChatRoom *room = &rooms[client_rooms[client_index]];
+
+    // 한쪽에서 막히면 다른 쪽 토큰도 쓰지 않도록 둘 다 확인한 뒤에 꺼낸다
+    int client_ok = bucket_ready(&client_buckets[client_index], &client_limit, bytes);
+    int room_ok = bucket_ready(&room->bucket, &room_limit, bytes);
+    if (client_ok && room_ok) {
+        bucket_debit(&client_buckets[client_index], bytes);
+        bucket_debit(&room->bucket, bytes);
+        throttle_notified[client_index] = 0;
+        return 1;
+    }
+
+    throttle_counts[client_index]++;
+    g_stats.throttled++;
+
+    // 제한 구간마다 한 번만 알린다 (알림 자체가 폭주하지 않도록)
+    if (!throttle_notified[client_index]) {
+        ChatMessage notice = {MSG_THROTTLE, "", ""};
+        snprintf(notice.content, BUF_SIZE, "전송 속도 제한 중입니다. 잠시 후 다시 보내주세요.");
+        send_to_client(client_index, &notice);
+        throttle_notified[client_index] = 1;
+    }
+    return 0;
+}
+
+int find_room(const char *name) {
+    for (int i = 0; i < MAX_ROOMS; i++) {
+        if (rooms[i].in_use && strcmp(rooms[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// 방에 입장한다. 없는 방이면 새로 만든다.
+void join_room(int client_index, const char *name) {
+    char room_name[ROOM_NAME_SIZE];
+    int room;
+
+    strncpy(room_name, name, ROOM_NAME_SIZE - 1);
+    room_name[ROOM_NAME_SIZE - 1] = '\0';
+    room_name[strcspn(room_name, "\r\n")] = '\0';
+    if (room_name[0] == '\0') {
+        strcpy(room_name, DEFAULT_ROOM);
+    }
+
+    room = find_room(room_name);
+    if (room < 0) {
+        for (room = 1; room < MAX_ROOMS; room++) {
+            if (!rooms[room].in_use) {
+                break;
+            }
+        }
+        if (room == MAX_ROOMS) {
+            printf("방을 더 만들 수 없습니다: %s\n", room_name);
+            return;
+        }
+        strcpy(rooms[room].name, room_name);
+        rooms[room].in_use = 1;
+        bucket_init(&rooms[room].bucket, &room_limit);
+        presence_counts[room] = 0;
+        memset(&eph_rooms[room], 0, sizeof(EphemeralRoom));
+    }
+
+    int old_room = client_rooms[client_index];
+    if (old_room != room) {
+        // 입력 중 표시는 옮기기 전의 방에서 지운다
+        ephemeral_reset(client_index, 0);
+    }
+    client_rooms[client_index] = room;
+    printf("클라이언트 %d 방 이동: %s -> %s\n", client_index, rooms[old_room].name, room_name);
+
+    if (old_room != room) {
+        presence_touch(old_room);
+        presence_touch(room);
+        release_room(old_room);
+    }
+}
+
+// 비어 있는 방은 정리한다 (기본 방 제외)
+void release_room(int room) {
+    if (room == 0) {
+        return;
+    }
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (client_sockets[i] != -1 && client_rooms[i] == room) {
+            return;
+        }
+    }
+    rooms[room].in_use = 0;
+}
+
+void handle_client(int client_index) {
+    ChatMessage message;
+    ssize_t str_len;
+
+    if (tls_pending[client_index]) {
+        tls_handshake(client_index);
+    }
+
+    while (1) {
+        str_len = read(pipes_to_child[client_index][0], &message, sizeof(ChatMessage));
+        if (str_len > 0) {
+            if (message.type == MSG_NICKNAME) {
+                snprintf(nicknames[client_index], NICKNAME_SIZE, "%.*s", NICKNAME_SIZE - 1, message.nickname);
+                printf("클라이언트 %d의 닉네임: %s\n", client_index, nicknames[client_index]);
+                
+                // 닉네임 설정 메시지 
+                ChatMessage complete_msg = {MSG_SESSION, "", "nickname"};
+                strcpy(complete_msg.nickname, nicknames[client_index]);
+                write(pipes_to_parent[client_index][1], &complete_msg, sizeof(ChatMessage));
+                
+                // 새 클라이언트 연결을 알림
+                if (notify_mode == NOTIFY_SIGNAL) {
+                    kill(getppid(), SIGUSR1);
+                }
+            } else if (message.type == MSG_LOGOUT) {
+                printf("클라이언트 %s(ID: %d) 연결 종료\n", nicknames[client_index], client_index);
+                ChatMessage logout_msg = {MSG_LOGOUT, "", ""};
+                snprintf(logout_msg.content, BUF_SIZE, "[%s] 님께서 퇴장했습니다.\n", nicknames[client_index]);
+                write(pipes_to_parent[client_index][1], &logout_msg, sizeof(ChatMessage));
+                
+                // 클라이언트 연결 종료를 알림
+                if (notify_mode == NOTIFY_SIGNAL) {
+                    kill(getppid(), SIGUSR2);
+                }
+                break;
+            } else if (message.type == MSG_SEARCH) {
+                // 검색은 이 자식 프로세스에서 하므로 부모의 팬아웃을 막지 않는다
+                message.content[BUF_SIZE - 1] = '\0';
+                search_run(client_index, message.content);
+            } else if (message.type != MSG_SESSION) {
+                // 세션 알림은 이 자식만 보낼 수 있다. 클라이언트가 보낸 것은 넘기지 않는다
+                write(pipes_to_parent[client_index][1], &message, sizeof(ChatMessage));
+            }
+            fflush(stdout);
+        } else if (str_len <= 0) {
+            break;
+        }
+    }
+
+    close(client_sockets[client_index]);
+    close(pipes_to_child[client_index][0]);
+    close(pipes_to_parent[client_index][1]);
+    exit(0);
+}
+
+// 연결을 닫고 세션 상태를 모두 지운다. -L이면 pipes_to_child는 늘 -1이고,
+// pipes_to_parent/child_pids는 아직 도는 도우미 자식(TLS 핸드셰이크, 검색)의 것이다.
+void close_client_connection(int client_index) {
+    if (client_sockets[client_index] != -1) {
+        close(client_sockets[client_index]);
+        client_sockets[client_index] = -1;
+    }
+    if (pipes_to_child[client_index][1] != -1) {
+        close(pipes_to_child[client_index][1]);
+        pipes_to_child[client_index][1] = -1;
+    }
+    if (pipes_to_parent[client_index][0] != -1) {
+        close(pipes_to_parent[client_index][0]);
+        pipes_to_parent[client_index][0] = -1;
+    }
+    if (child_pids[client_index] != -1) {
+        kill(child_pids[client_index], SIGTERM);
+        child_pids[client_index] = -1;
+    }
+    if (nicknames[client_index][0] != '\0') {
+        peer_publish_user(client_index, PEER_USER_OFFLINE);
+    }
+    capture_event(client_index, CAPTURE_CLOSE, NULL);
+    attach_reset(client_index);
+    outq_release(client_index);
+    tls_pending[client_index] = 0;
+    client_zlevel[client_index] = 0;
+    pool_free(POOL_RX, rx_bufs[client_index]);
+    rx_bufs[client_index] = NULL;
+    rx_lens[client_index] = 0;
+    child_mem_total -= child_mem[client_index];
+    child_mem[client_index] = 0;
+    timer_cancel(client_index);
+    if (nicknames[client_index][0] != '\0') {
+        presence_touch(client_rooms[client_index]);
+    }
+    presence_on[client_index] = 0;
+    ephemeral_reset(client_index, 1);
+    if (watch_on[client_index] || watch_counts[client_index] > 0) {
+        watch_dirty = 1;
+    }
+    watch_on[client_index] = 0;
+    watch_counts[client_index] = 0;
+    release_room(client_rooms[client_index]);
+    client_rooms[client_index] = 0;
+    nicknames[client_index][0] = '\0';
+    g_noc--;
+    printf("클라이언트 %d 연결이 종료되었습니다. 현재 연결 수: %d\n", client_index, g_noc);
+}
+
+// 자식은 다른 클라이언트의 소켓과 파이프를 물려받는다. 닫지 않으면
+// 부모가 연결을 정리해도 소켓이 살아 있어 상대가 끊김을 알 수 없다.
+void close_other_clients(int client_index) {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (i == client_index) {
+            continue;
+        }
+        if (client_sockets[i] != -1) {
+            close(client_sockets[i]);
+        }
+        if (pipes_to_child[i][1] != -1) {
+            close(pipes_to_child[i][1]);
+        }
+        if (pipes_to_parent[i][0] != -1) {
+            close(pipes_to_parent[i][0]);
+        }
+    }
+    // 지운 첨부 파일은 fd가 모두 닫혀야 공간이 돌아온다
+    for (int i = 0; i < ATTACH_MAX; i++) {
+        if (attachments[i].fd != -1) {
+            close(attachments[i].fd);
+        }
+    }
+}
+
+void timer_init(long long now) {
+    for (int l = 0; l < WHEEL_LEVELS; l++) {
+        for (int i = 0; i < WHEEL_SIZE; i++) {
+            wheel[l][i] = -1;
+        }
+    }
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        timers[i].level = -1;
+    }
+    wheel_tick = 0;
+    wheel_usec = now;
+}
+
+// ticks 후에 만료되도록 타이머를 건다. 이미 걸려 있으면 옮긴다.
+void timer_add(int client_index, unsigned long ticks) {
+    TimerNode *t = &timers[client_index];
+    int level, slot;
+
+    timer_cancel(client_index);
+
+    if (ticks < 1) {
+        ticks = 1;
+    } else if (ticks >= WHEEL_SIZE * WHEEL_SIZE) {
+        ticks = WHEEL_SIZE * WHEEL_SIZE - 1;
+    }
+    t->expire = wheel_tick + ticks;
+
+    if (t->expire - wheel_tick < WHEEL_SIZE) {
+        level = 0;
+        slot = t->expire & (WHEEL_SIZE - 1);
+    } else {
+        level = 1;
+        slot = (t->expire >> WHEEL_BITS) & (WHEEL_SIZE - 1);
+    }
+
+    timer_link(client_index, level, slot);
+}
+
+// 타이머를 슬롯 목록 맨 앞에 단다
+void timer_link(int client_index, int level, int slot) {
+    TimerNode *t = &timers[client_index];
+
+    t->level = level;
+    t->slot = slot;
+    t->prev = -1;
+    t->next = wheel[level][slot];
+    if (t->next != -1) {
+        timers[t->next].prev = client_index;
+    }
+    wheel[level][slot] = client_index;
+}
+
+void timer_cancel(int client_index) {
+    TimerNode *t = &timers[client_index];
+
+    if (t->level < 0) {
+        return;
+    }
+    if (t->prev != -1) {
+        timers[t->prev].next = t->next;
+    } else {
+        wheel[t->level][t->slot] = t->next;
+    }
+    if (t->next != -1) {
+        timers[t->next].prev = t->prev;
+    }
+    t->level = -1;
+}
+
+// 지난 틱마다 상위 단계 슬롯을 내려보내고 현재 슬롯의 타이머를 만료시킨다.
+// 연결 수와 무관하게 틱당 O(1) + 만료된 타이머 수만큼만 일한다.
+void timer_advance(long long now) {
+    while (now - wheel_usec >= TICK_USEC) {
+        wheel_usec += TICK_USEC;
+        wheel_tick++;
+
+        int slot = wheel_tick & (WHEEL_SIZE - 1);
+        if (slot == 0) {
+            int upper = (wheel_tick >> WHEEL_BITS) & (WHEEL_SIZE - 1);
+            int n = wheel[1][upper];
+            wheel[1][upper] = -1;
+            while (n != -1) {
+                int next = timers[n].next;
+                timers[n].level = -1;
+                // 이번 틱에 만료되는 타이머는 아래에서 바로 처리되도록 현재 슬롯에 단다
+                // (timer_add는 최소 1틱 뒤로 미룬다)
+                if (timers[n].expire <= wheel_tick) {
+                    timer_link(n, 0, slot);
+                } else {
+                    timer_add(n, timers[n].expire - wheel_tick);
+                }
+                n = next;
+            }
+        }
+
+        while (wheel[0][slot] != -1) {
+            int n = wheel[0][slot];
+            timer_cancel(n);
+            heartbeat_expired(n);
+        }
+    }
+}
+
+// 클라이언트로부터 프레임을 받을 때마다 무응답 타이머를 다시 건다
+void heartbeat_touch(int client_index) {
+    ping_pending[client_index] = 0;
+    if (idle_timeout > 0) {
+        timer_add(client_index, (unsigned long)idle_timeout * (1000000 / TICK_USEC));
+    }
+}
+
+// 처음 만료되면 PING을 보내고, PING에도 응답이 없으면 연결을 정리한다
+void heartbeat_expired(int client_index) {
+    if (client_sockets[client_index] == -1) {
+        return;
+    }
+    if (!ping_pending[client_index]) {
+        ChatMessage ping = {MSG_PING, "", ""};
+        send_to_client(client_index, &ping);
+        ping_pending[client_index] = 1;
+        timer_add(client_index, (unsigned long)PING_TIMEOUT * (1000000 / TICK_USEC));
+    } else {
+        syslog(LOG_INFO, "client %d did not answer ping, closing", client_index);
+        g_stats.reaped++;
+        close_client_connection(client_index);
+    }
+}
+
+// 클라이언트마다 파이프 두 개와 자식 프로세스를 만든다
+// handshake: 새 연결이면 1 (TLS 사용 시 자식이 핸드셰이크), 넘겨받은 연결이면 0
+int start_session(int client_index, int csock, int ssock, int handshake) {
+    client_sockets[client_index] = csock;
+    tls_pending[client_index] = handshake;
+    if (lean_sessions) {
+        // -L: 프로세스와 파이프 없이 부모가 직접 처리한다. TLS 핸드셰이크만 잠깐 자식에게 맡긴다.
+        g_noc++;
+        session_init(client_index, csock);
+        int helper = handshake ? session_helper(client_index, ssock) : 1;
+        if (helper == 0) {
+            tls_handshake(client_index);
+            exit(0);
+        } else if (helper < 0) {
+            close_client_connection(client_index);
+            return -1;
+        }
+        return 0;
+    }
+    if (pipe(pipes_to_child[client_index]) == -1 || pipe(pipes_to_parent[client_index]) == -1) {
+        perror("pipe");
+        close(csock);
+        client_sockets[client_index] = -1;
+        return -1;
+    }
+
+    g_noc++;
+    pid_t pid = fork(); // fork()를 사용하여 멀티 프로세스
+    if (pid == 0) {  // 자식 프로세스
+        child_default_signals();
+        close_server_sockets(ssock);
+        close(pipes_to_child[client_index][1]);
+        close(pipes_to_parent[client_index][0]);
+        close_other_clients(client_index);
+        handle_client(client_index);
+        exit(0);
+    } else if (pid > 0) {  // 부모 프로세스
+        close(pipes_to_child[client_index][0]);
+        close(pipes_to_parent[client_index][1]);
+        pipes_to_child[client_index][0] = -1;
+        pipes_to_parent[client_index][1] = -1;
+        set_nonblocking(pipes_to_parent[client_index][0]);
+        child_pids[client_index] = pid;
+        session_init(client_index, csock);
+        return 0;
+    }
+
+    perror("fork");
+    close(csock);
+    close(pipes_to_child[client_index][0]);
+    close(pipes_to_child[client_index][1]);
+    close(pipes_to_parent[client_index][0]);
+    close(pipes_to_parent[client_index][1]);
+    client_sockets[client_index] = -1;
+    pipes_to_child[client_index][0] = pipes_to_child[client_index][1] = -1;
+    pipes_to_parent[client_index][0] = pipes_to_parent[client_index][1] = -1;
+    g_noc--;
+    return -1;
+}
+
+// 세션을 만들 때 부모 쪽에서 할 일
+void session_init(int client_index, int csock) {
+    set_nonblocking(csock);
+    session_tune(csock);
+    if (coalesce_usec > 0) {
+        // 병합은 서버가 직접 하므로 Nagle 지연을 겹치지 않는다
+        int on = 1;
+        setsockopt(csock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    client_rooms[client_index] = 0;
+    bucket_init(&client_buckets[client_index], &client_limit);
+    throttle_notified[client_index] = 0;
+    throttle_counts[client_index] = 0;
+    heartbeat_touch(client_index);
+    capture_event(client_index, CAPTURE_OPEN, NULL);
+}
+
+// 자식 프로세스는 서버가 쥐고 있는 리스닝 소켓과 링크를 닫는다 (ssock -1: 리스닝 소켓은 그대로 둔다)
+void close_server_sockets(int ssock) {
+    if (ssock != -1) {
+        close(ssock);
+    }
+    if (upgrade_sock != -1) {
+        close(upgrade_sock);
+    }
+    if (peer_listen_sock != -1) {
+        close(peer_listen_sock);
+    }
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (i < peer_count && peer_links[i].fd != -1) {
+            close(peer_links[i].fd);
+        }
+        if (peer_inbound[i].fd != -1) {
+            close(peer_inbound[i].fd);
+        }
+    }
+}
+
+// 무중단 재시작 요청을 받을 유닉스 소켓. 레코드 경계가 유지되도록 SEQPACKET을 쓴다.
+int upgrade_listen(const char *path) {
+    struct sockaddr_un addr;
+    int usock;
+
+    if ((usock = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    if (bind(usock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(usock, 1) < 0) {
+        close(usock);
+        return -1;
+    }
+    set_nonblocking(usock);
+    return usock;
+}
+
+// LISTEN_PID가 이 프로세스이면 LISTEN_FDS 개수를 돌려준다 (아니면 0)
+int activated_listen_fds(void) {
+    const char *pid_env = getenv("LISTEN_PID");
+    const char *fds_env = getenv("LISTEN_FDS");
+    int n;
+
+    if (pid_env == NULL || fds_env == NULL || atol(pid_env) != (long)getpid()) {
+        return 0;
+    }
+    // 자식 프로세스가 같은 환경 변수를 보고 착각하지 않도록 지운다
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+
+    n = atoi(fds_env);
+    return (n > 0) ? n : 0;
+}
+
+// [keep_from, keep_from + keep_count) 를 제외한 3번 이상의 fd를 닫는다.
+// close_range()가 없는 커널에서는 하나씩 닫는다.
+void close_inherited_fds(int keep_from, int keep_count, rlim_t max_fd) {
+    unsigned int first = (keep_count > 0) ? keep_from + keep_count : 3;
+
+    if (keep_count > 1) {
+        // 포트 하나만 쓰므로 첫 번째 소켓 외에는 닫는다
+        for (int fd = keep_from + 1; fd < keep_from + keep_count; fd++) {
+            close(fd);
+        }
+    }
+    if (close_range(first, ~0U, 0) == 0) {
+        return;
+    }
+    for (rlim_t fd = first; fd < max_fd; fd++) {
+        close(fd);
+    }
+}
+
+int send_with_fd(int sock, void *buf, size_t len, int fd) {
+    struct msghdr msg;
+    struct iovec iov;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fd >= 0) {
+        struct cmsghdr *cmsg;
+        memset(cbuf, 0, sizeof(cbuf));
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    return sendmsg(sock, &msg, 0) == (ssize_t)len ? 0 : -1;
+}
+
+ssize_t recv_with_fd(int sock, void *buf, size_t len, int *fd) {
+    struct msghdr msg;
+    struct iovec iov;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cmsg;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    *fd = -1;
+    do {
+        // 넘겨받은 자식의 SIGUSR1 등으로 끊길 수 있다
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        return n;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+        fcntl(*fd, F_SETFD, 0);
+    }
+    // SEQPACKET은 버퍼보다 긴 레코드를 잘라서 버퍼 크기를 돌려주므로 잘림을 따로 알린다
+    if (msg.msg_flags & MSG_TRUNC) {
+        if (*fd >= 0) {
+            close(*fd);
+            *fd = -1;
+        }
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return n;
+}
+
+// 새 프로세스에게 리스닝 소켓과 모든 클라이언트 연결, 상태를 넘긴다.
+// 넘긴 뒤 이 프로세스의 사본은 닫기만 하므로 클라이언트 연결은 끊기지 않는다.
+// 새 프로세스의 레코드 형식이 다르면 아무것도 넘기지 않고 -1을 돌려준다.
+int handoff_to(int usock, int ssock) {
+    static HandoffRecord rec;
+    struct timeval tv = {1, 0};
+    long long deadline;
+    ssize_t n;
+    int fd;
+
+    // 상태를 건드리기 전에 새 프로세스가 같은 레코드 형식을 쓰는지 확인한다
+    setsockopt(usock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    n = recv_with_fd(usock, &rec, sizeof(rec), &fd);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!handoff_valid(&rec, n) || rec.kind != HANDOFF_HELLO) {
+        syslog(LOG_ERR, "handoff: new process uses a different record format");
+        return -1;
+    }
+
+    // 인계 요청 후에는 클라이언트 소켓을 더 읽지 않고, 자식이 처리 중인 프레임만 마저 받는다
+    deadline = now_usec() + HANDOFF_DRAIN_USEC;
+    while (now_usec() < deadline) {
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            ChatMessage mesg;
+            if (pipes_to_parent[i][0] == -1) {
+                continue;
+            }
+            if (read(pipes_to_parent[i][0], &mesg, sizeof(ChatMessage)) == sizeof(ChatMessage)) {
+                route_child_message(i, &mesg);
+            }
+        }
+    }
+
+    handoff_header(&rec, HANDOFF_LISTENER);
+    if (send_with_fd(usock, &rec, sizeof(rec), ssock) < 0) {
+        syslog(LOG_ERR, "handoff: cannot send listener: %m");
+        return -1;
+    }
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        // 첨부 파일을 주고받는 중인 연결은 스트림 중간이라 넘기지 않고 끊는다 (클라이언트가 다시 접속한다)
+        if (client_sockets[i] == -1 || attach_up[i].token != 0 || attach_up[i].left > 0 || attach_busy(i)
+            || attach_ndown[i] > 0) {
+            continue;
+        }
+        handoff_header(&rec, HANDOFF_CLIENT);
+        rec.client_index = i;
+        strcpy(rec.nickname, nicknames[i]);
+        strcpy(rec.room, rooms[client_rooms[i]].name);
+        rec.pending_count = out_queues[i].count;
+        rec.pending_urgent = out_queues[i].urgent_end;
+        rec.pending_sent = out_queues[i].sent_bytes;
+        if (out_queues[i].count > 0) {
+            memcpy(rec.pending, out_queues[i].frames, out_queues[i].count * sizeof(WireFrame));
+        }
+        rec.zlevel = client_zlevel[i];
+        rec.presence = presence_on[i];
+        rec.watch = watch_on[i];
+        rec.watch_count = watch_counts[i];
+        memcpy(rec.watch_keywords, watch_keywords[i], sizeof(rec.watch_keywords));
+        memcpy(rec.watch_rooms, watch_rooms[i], sizeof(rec.watch_rooms));
+        rec.rx_len = rx_lens[i];
+        if (rx_lens[i] > 0) {
+            memcpy(rec.rx, rx_bufs[i], rx_lens[i]);
+        }
+        if (send_with_fd(usock, &rec, sizeof(rec), client_sockets[i]) < 0) {
+            syslog(LOG_ERR, "handoff: cannot send client %d: %m", i);
+        } else {
+            handed_off[i] = 1;
+        }
+    }
+
+    handoff_header(&rec, HANDOFF_END);
+    send_with_fd(usock, &rec, sizeof(rec), -1);
+
+    // 남은 정리(close_client_connection)에서 보내지 않도록 대기열을 비운다
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        outq_release(i);
+    }
+    return 0;
+}
+
+// 실행 중인 서버에 인계를 요청하고 리스닝 소켓을 돌려준다.
+// 넘겨받은 클라이언트마다 새 자식 프로세스를 만들고 닉네임을 다시 알려준다.
+int take_over(const char *path) {
+    static HandoffRecord rec;
+    struct sockaddr_un addr;
+    int usock, fd, ssock = -1, count = 0;
+    ssize_t n;
+
+    if ((usock = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (connect(usock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(usock);
+        return -1;
+    }
+
+    // 자기 레코드 형식을 먼저 알려서 형식이 다른 서버가 연결을 넘기고 끝나지 않게 한다
+    handoff_header(&rec, HANDOFF_HELLO);
+    if (send_with_fd(usock, &rec, sizeof(rec), -1) < 0) {
+        close(usock);
+        return -1;
+    }
+
+    while ((n = recv_with_fd(usock, &rec, sizeof(rec), &fd)) > 0 || (n < 0 && errno == EMSGSIZE)) {
+        // 형식이 다른 레코드는 필드가 어긋나 있으므로 해석하지 않는다
+        if (!handoff_valid(&rec, n)) {
+            syslog(LOG_ERR, "handoff: record format mismatch from %s, refusing", path);
+            if (fd >= 0) {
+                close(fd);
+            }
+            close_other_clients(-1);
+            if (ssock >= 0) {
+                close(ssock);
+            }
+            close(usock);
+            return -1;
+        }
+        if (rec.kind == HANDOFF_END) {
+            break;
+        } else if (rec.kind == HANDOFF_LISTENER) {
+            ssock = fd;
+        } else if (rec.kind == HANDOFF_CLIENT && fd >= 0) {
+            int i = rec.client_index;
+            if (i < 0 || i >= MAX_CLIENTS || client_sockets[i] != -1 || ssock < 0
+                || start_session(i, fd, ssock, 0) < 0) {
+                close(fd);
+                continue;
+            }
+            if (rec.pending_count > 0 && rec.pending_count <= OUTQ_SIZE && rec.pending[0].len <= WIRE_MAX
+                && rec.pending_sent < rec.pending[0].len && outq_reserve(i, rec.pending_count) == 0) {
+                memcpy(out_queues[i].frames, rec.pending, rec.pending_count * sizeof(WireFrame));
+                out_queues[i].count = rec.pending_count;
+                out_queues[i].urgent_end = rec.pending_urgent >= 0 && rec.pending_urgent <= rec.pending_count
+                                           ? rec.pending_urgent : 0;
+                out_queues[i].sent_bytes = rec.pending_sent;
+                out_queues[i].first_usec = now_usec();
+            } else if (rec.pending_count != 0 && rec.pending_sent > 0) {
+                // 앞 프레임을 반쯤 보낸 스트림은 대기열 없이 이어 가면 프레임 경계가 어긋난다
+                syslog(LOG_WARNING, "handoff: client %d stopped mid-frame, closing", i);
+                close_client_connection(i);
+                continue;
+            }
+            client_zlevel[i] = rec.zlevel >= 0 && rec.zlevel <= 9 ? rec.zlevel : 0;
+            presence_on[i] = rec.presence;
+            presence_room[i] = -1;
+            if (rec.presence) {
+                presence_touch(-1);
+            }
+            watch_on[i] = rec.watch;
+            watch_counts[i] = rec.watch_count >= 0 && rec.watch_count <= WATCH_MAX ? rec.watch_count : 0;
+            memcpy(watch_keywords[i], rec.watch_keywords, sizeof(rec.watch_keywords));
+            memcpy(watch_rooms[i], rec.watch_rooms, sizeof(rec.watch_rooms));
+            for (int k = 0; k < WATCH_MAX; k++) {
+                watch_keywords[i][k][WATCH_PATTERN_SIZE - 1] = '\0';
+                watch_rooms[i][k][ROOM_NAME_SIZE - 1] = '\0';
+            }
+            watch_dirty = 1;
+            rx_lens[i] = rec.rx_len < RX_BUF_SIZE ? rec.rx_len : 0;
+            if (rx_lens[i] > 0 && (rx_bufs[i] = pool_alloc(POOL_RX)) == NULL) {
+                rx_lens[i] = 0;
+            } else if (rx_lens[i] > 0) {
+                memcpy(rx_bufs[i], rec.rx, rx_lens[i]);
+            }
+            if (rec.room[0] != '\0') {
+                join_room(i, rec.room);
+            }
+            if (rec.nickname[0] != '\0') {
+                // 새 자식 프로세스에도 닉네임을 알려준다
+                ChatMessage nick_msg = {MSG_NICKNAME, "", ""};
+                strcpy(nick_msg.nickname, rec.nickname);
+                strcpy(nicknames[i], rec.nickname);
+                session_frame(i, &nick_msg);
+            }
+            count++;
+        }
+    }
+    close(usock);
+
+    syslog(LOG_INFO, "took over listener and %d clients from %s", count, path);
+    return ssock;
+}
+
+// "<ip>:<port>" 형식의 피어를 추가한다
+int add_peer(const char *spec) {
+    char host[64];
+    const char *colon = strrchr(spec, ':');
+    PeerLink *link;
+
+    if (colon == NULL || peer_count >= MAX_PEERS || colon - spec >= (long)sizeof(host)) {
+        return -1;
+    }
+    link = &peer_links[peer_count];
+    memset(link, 0, sizeof(*link));
+    memcpy(host, spec, colon - spec);
+    host[colon - spec] = '\0';
+
+    link->addr.sin_family = AF_INET;
+    link->addr.sin_port = htons(atoi(colon + 1));
+    if (inet_pton(AF_INET, host, &link->addr.sin_addr) != 1) {
+        return -1;
+    }
+    link->fd = -1;
+    link->state = LINK_DOWN;
+    peer_count++;
+    return 0;
+}
+
+int peer_listen(int port) {
+    struct sockaddr_in addr;
+    int on = 1;
+    int sock;
+
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    // 라우터끼리의 링크는 같은 호스트 안에서만 쓰고 인증이 없으므로 루프백에만 연다
+    addr.sin_addr.s_addr = htonl(router_count > 0 ? INADDR_LOOPBACK : INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, MAX_PEERS) < 0) {
+        close(sock);
+        return -1;
+    }
+    set_nonblocking(sock);
+    return sock;
+}
+
+// 로컬에서 생긴 프레임을 링에 넣는다. 실제 전송은 루프마다 peer_poll()이 묶어서 한다.
+void peer_publish(PeerFrameKind kind, const char *room, ChatMessage *message) {
+    PeerFrame *frame;
+
+    if (peer_count == 0) {
+        return;
+    }
+    frame = &peer_ring[peer_next_seq % PEER_RING];
+    memset(frame, 0, sizeof(*frame));
+    frame->kind = kind;
+    frame->origin = node_id;
+    frame->epoch = node_epoch;
+    frame->seq = peer_next_seq++;
+    strncpy(frame->room, room, ROOM_NAME_SIZE - 1);
+    if (message != NULL) {
+        frame->msg = *message;
+    }
+}
+
+void peer_publish_user(int client_index, PeerFrameKind kind) {
+    ChatMessage user = {MSG_JOIN, "", ""};
+
+    strcpy(user.nickname, nicknames[client_index]);
+    peer_publish(kind, rooms[client_rooms[client_index]].name, &user);
+}
+
+void peer_poll(long long now) {
+    // 새 수신 링크
+    if (peer_listen_sock != -1) {
+        int fd = accept(peer_listen_sock, NULL, NULL);
+        if (fd >= 0) {
+            int slot;
+            for (slot = 0; slot < MAX_PEERS && peer_inbound[slot].fd != -1; slot++) {
+            }
+            if (slot == MAX_PEERS) {
+                close(fd);
+            } else {
+                int on = 1;
+                set_nonblocking(fd);
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                peer_inbound[slot].fd = fd;
+                peer_inbound[slot].origin = 0;
+                peer_inbound[slot].acked = 0;
+                peer_inbound[slot].rx_len = 0;
+                peer_inbound[slot].tx_len = 0;
+            }
+        }
+        for (int i = 0; i < MAX_PEERS; i++) {
+            if (peer_inbound[i].fd != -1) {
+                peer_inbound_read(&peer_inbound[i]);
+            }
+            if (peer_inbound[i].fd != -1 && peer_inbound[i].tx_len > 0) {
+                peer_inbound_flush(&peer_inbound[i]);
+            }
+            if (peer_inbound[i].fd != -1) {
+                peer_inbound_ack(&peer_inbound[i], now);
+            }
+        }
+    }
+
+    // 조용한 링크도 살아 있음을 알린다 (대기 서버의 장애 판단용)
+    if (peer_count > 0 && now - peer_heartbeat_usec >= PEER_HEARTBEAT_USEC) {
+        peer_publish(PEER_HEARTBEAT, "", NULL);
+        peer_heartbeat_usec = now;
+    }
+
+    // 송신 링크: 연결 유지, RESUME 수신, 쌓인 프레임 전송
+    for (int i = 0; i < peer_count; i++) {
+        PeerLink *link = &peer_links[i];
+
+        // 연결만 받고 RESUME을 보내지 않는 상대는 하트비트 몇 번 동안 기다린 뒤 다시 연결한다
+        if ((link->state == LINK_CONNECTING || link->state == LINK_HELLO_SENT)
+            && now - link->connect_usec >= PEER_HELLO_USEC) {
+            syslog(LOG_WARNING, "peer link to %s:%d: no RESUME in %d ms, reconnecting",
+                   inet_ntoa(link->addr.sin_addr), ntohs(link->addr.sin_port), PEER_HELLO_USEC / 1000);
+            peer_link_down(link, now);
+        }
+        if (link->state == LINK_DOWN || link->state == LINK_CONNECTING) {
+            peer_link_connect(link, now);
+        }
+        if (link->state == LINK_HELLO_SENT || link->state == LINK_UP) {
+            peer_link_read(link, now);
+        }
+        if (link->state == LINK_UP) {
+            peer_link_flush(link);
+        }
+    }
+}
+
+// 논블로킹 connect. 연결되면 HELLO를 보내고 RESUME을 기다린다.
+void peer_link_connect(PeerLink *link, long long now) {
+    if (link->state == LINK_DOWN) {
+        int on = 1;
+        if (now < link->retry_usec) {
+            return;
+        }
+        if ((link->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+            link->retry_usec = now + PEER_RETRY_USEC;
+            return;
+        }
+        set_nonblocking(link->fd);
+        setsockopt(link->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        if (connect(link->fd, (struct sockaddr *)&link->addr, sizeof(link->addr)) < 0
+            && errno != EINPROGRESS) {
+            peer_link_down(link, now);
+            return;
+        }
+        link->state = LINK_CONNECTING;
+        link->connect_usec = now;
+    }
+
+    // select()/poll() 없이 연결 완료를 확인한다
+    if (connect(link->fd, (struct sockaddr *)&link->addr, sizeof(link->addr)) < 0) {
+        if (errno == EINPROGRESS || errno == EALREADY) {
+            return;
+        }
+        if (errno != EISCONN) {
+            peer_link_down(link, now);
+            return;
+        }
+    }
+
+    PeerFrame hello;
+    memset(&hello, 0, sizeof(hello));
+    hello.kind = PEER_HELLO;
+    hello.origin = node_id;
+    hello.epoch = node_epoch;
+    hello.seq = peer_next_seq - 1;
+    if (send(link->fd, &hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello)) {
+        peer_link_down(link, now);
+        return;
+    }
+    link->hello_seq = hello.seq;
+    link->rx_len = 0;
+    link->state = LINK_HELLO_SENT;
+}
+
+void peer_link_down(PeerLink *link, long long now) {
+    if (link->fd != -1) {
+        close(link->fd);
+        link->fd = -1;
+    }
+    if (link->state == LINK_UP) {
+        syslog(LOG_INFO, "peer link to %s:%d down", inet_ntoa(link->addr.sin_addr), ntohs(link->addr.sin_port));
+    }
+    link->state = LINK_DOWN;
+    link->retry_usec = now + PEER_RETRY_USEC;
+}
+
+// RESUME: 수신 측이 알려준 위치부터 이어서 보낸다. ACK: 적용된 위치를 기록한다.
+void peer_link_read(PeerLink *link, long long now) {
+    while (1) {
+        ssize_t n = recv(link->fd, (char *)&link->rx + link->rx_len, sizeof(PeerFrame) - link->rx_len, MSG_DONTWAIT);
+
+        if (n == 0 || (n < 0 && errno != EWOULDBLOCK && errno != EAGAIN)) {
+            peer_link_down(link, now);
+            return;
+        }
+        if (n < 0) {
+            return;
+        }
+        link->rx_len += n;
+        if (link->rx_len < sizeof(PeerFrame)) {
+            return;
+        }
+        link->rx_len = 0;
+
+        if (link->rx.kind == PEER_ACK && link->rx.epoch == node_epoch) {
+            link->acked_seq = link->rx.seq;
+        } else if (link->rx.kind == PEER_RESUME && link->state == LINK_HELLO_SENT) {
+            peer_link_resume(link);
+        }
+    }
+}
+
+void peer_link_resume(PeerLink *link) {
+    uint64_t last = peer_next_seq - 1;
+
+    if (link->rx.epoch != node_epoch) {
+        // 상대가 이번 실행의 프레임을 받은 적이 없다 (이쪽이나 상대가 재시작했다):
+        // 링에 남은 지난 프레임은 다시 보내지 않고 HELLO 다음부터 보내며,
+        // 디렉터리는 현재 접속자 목록을 다시 실어 보낸다
+        link->sent_seq = link->hello_seq;
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (client_sockets[i] != -1 && nicknames[i][0] != '\0') {
+                peer_publish_user(i, PEER_USER_ONLINE);
+            }
+        }
+    } else if (last - link->rx.seq > PEER_RING) {
+        // 링을 넘어서 놓친 프레임은 다시 보낼 수 없다
+        g_stats.peer_gap += last - link->rx.seq - PEER_RING;
+        link->sent_seq = last - PEER_RING;
+    } else {
+        link->sent_seq = link->rx.seq;
+    }
+    link->acked_seq = link->sent_seq;
+    link->sent_bytes = 0;
+    link->state = LINK_UP;
+    syslog(LOG_INFO, "peer link to %s:%d up, resuming after seq %llu",
+           inet_ntoa(link->addr.sin_addr), ntohs(link->addr.sin_port), (unsigned long long)link->sent_seq);
+}
+
+// 링에 쌓인 프레임을 writev()로 묶어서 보낸다
+void peer_link_flush(PeerLink *link) {
+    while (link->sent_seq + 1 < peer_next_seq) {
+        struct iovec iov[PEER_BATCH];
+        int iovcnt = 0;
+        size_t skip = link->sent_bytes;
+        uint64_t seq;
+
+        if (peer_next_seq - 1 - link->sent_seq > PEER_RING) {
+            // 링크가 너무 느려 링이 한 바퀴 돌았다
+            g_stats.peer_gap += peer_next_seq - 1 - link->sent_seq - PEER_RING;
+            link->sent_seq = peer_next_seq - 1 - PEER_RING;
+            link->sent_bytes = 0;
+            skip = 0;
+        }
+
+        for (seq = link->sent_seq + 1; seq < peer_next_seq && iovcnt < PEER_BATCH; seq++) {
+            iov[iovcnt].iov_base = (char *)&peer_ring[seq % PEER_RING] + skip;
+            iov[iovcnt].iov_len = sizeof(PeerFrame) - skip;
+            skip = 0;
+            iovcnt++;
+        }
+
+        ssize_t n = writev(link->fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno != EWOULDBLOCK && errno != EAGAIN) {
+                peer_link_down(link, now_usec());
+            }
+            return;
+        }
+        size_t total = link->sent_bytes + n;
+        link->sent_seq += total / sizeof(PeerFrame);
+        link->sent_bytes = total % sizeof(PeerFrame);
+        g_stats.peer_out += total / sizeof(PeerFrame);
+        if (link->sent_seq + 1 < peer_next_seq && total / sizeof(PeerFrame) < (size_t)iovcnt) {
+            return; // 소켓 버퍼가 찼다
+        }
+    }
+}
+
+void peer_inbound_read(PeerInbound *in) {
+    while (1) {
+        ssize_t n = recv(in->fd, (char *)&in->rx + in->rx_len, sizeof(PeerFrame) - in->rx_len, MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EWOULDBLOCK && errno != EAGAIN)) {
+            peer_inbound_close(in);
+            return;
+        }
+        if (n < 0) {
+            return;
+        }
+        in->rx_len += n;
+        if (in->rx_len < sizeof(PeerFrame)) {
+            return;
+        }
+        in->rx_len = 0;
+        peer_receive(in, &in->rx);
+    }
+}
+
+PeerOrigin *peer_origin(uint32_t origin) {
+    PeerOrigin *free_slot = NULL;
+
+    for (int i = 0; i < MAX_PEERS * 2; i++) {
+        if (peer_origins[i].in_use && peer_origins[i].origin == origin) {
+            return &peer_origins[i];
+        }
+        if (!peer_origins[i].in_use && free_slot == NULL) {
+            free_slot = &peer_origins[i];
+        }
+    }
+    if (free_slot != NULL) {
+        memset(free_slot, 0, sizeof(*free_slot));
+        free_slot->origin = origin;
+        free_slot->in_use = 1;
+    }
+    return free_slot;
+}
+
+void peer_receive(PeerInbound *in, PeerFrame *frame) {
+    PeerOrigin *po;
+
+    frame->room[ROOM_NAME_SIZE - 1] = '\0';
+    frame->msg.nickname[NICKNAME_SIZE - 1] = '\0';
+    frame->msg.content[BUF_SIZE - 1] = '\0';
+
+    // 자기 자신이 만든 프레임은 버린다 (잘못된 설정으로 생긴 루프 방지).
+    // 다른 서버가 같은 노드 id를 쓰면 그 서버의 프레임을 모두 잃으므로 링크마다 한 번 알린다.
+    if (frame->origin == node_id && frame->kind == PEER_HELLO && frame->epoch != node_epoch) {
+        syslog(LOG_ERR, "peer link from a node using our node id %u: its frames are dropped, set a distinct -N",
+               node_id);
+    }
+    if (frame->origin == node_id || (po = peer_origin(frame->origin)) == NULL) {
+        g_stats.peer_dup++;
+        return;
+    }
+
+    if (standby) {
+        standby_seen_primary = 1;
+        standby_last_rx = now_usec();
+    }
+
+    if (frame->kind == PEER_HELLO) {
+        PeerFrame resume;
+        memset(&resume, 0, sizeof(resume));
+        resume.kind = PEER_RESUME;
+        resume.origin = node_id;
+        in->origin = frame->origin;
+        in->acked = 0;
+        if (po->epoch != frame->epoch) {
+            // 처음 보는 실행이다 (상대나 이쪽이 재시작했다): 상대가 HELLO 전에 만든 프레임은
+            // 받지 않고 그 다음부터 받는다. epoch 0으로 답해서 상대가 링의 지난 프레임을 다시 보내지 않게 한다.
+            po->epoch = frame->epoch;
+            po->last_seq = frame->seq;
+            in->acked = frame->seq;
+            for (int i = 0; i < MAX_REMOTE_USERS; i++) {
+                if (remote_users[i].in_use && remote_users[i].origin == frame->origin) {
+                    presence_touch(find_room(remote_users[i].room));
+                    remote_users[i].in_use = 0;
+                }
+            }
+        } else {
+            resume.epoch = po->epoch;
+        }
+        resume.seq = po->last_seq;
+        peer_inbound_send(in, &resume);
+        return;
+    }
+
+    if (frame->epoch != po->epoch || frame->seq <= po->last_seq) {
+        g_stats.peer_dup++;
+        return;
+    }
+    if (frame->seq > po->last_seq + 1 && po->last_seq != 0) {
+        g_stats.peer_gap += frame->seq - po->last_seq - 1;
+    }
+    po->last_seq = frame->seq;
+    g_stats.peer_in++;
+
+    if (frame->kind == PEER_RELAY) {
+        // 로컬 클라이언트에게만 전달하고 다시 중계하지 않는다
+        int room = find_room(frame->room);
+        if (room >= 0) {
+            send_to_room(&frame->msg, room, -1);
+        }
+        if (frame->msg.type == MSG_CHAT) {
+            history_append(frame->room, &frame->msg);
+            watch_scan(-1, frame->room, &frame->msg);
+            if (room >= 0) {
+                react_track(room, &frame->msg);
+            }
+        }
+    } else if (frame->kind == PEER_USER_ONLINE || frame->kind == PEER_USER_OFFLINE) {
+        remote_directory_update(frame);
+    } else if (frame->kind == PEER_DIRECT) {
+        // 모든 노드가 받으므로 여기서는 보관하지 않는다 (보관은 보낸 사람의 노드만 한다)
+        dm_deliver_local(frame->room, &frame->msg);
+    }
+}
+
+void remote_directory_update(PeerFrame *frame) {
+    RemoteUser *free_slot = NULL;
+
+    for (int i = 0; i < MAX_REMOTE_USERS; i++) {
+        RemoteUser *u = &remote_users[i];
+        if (u->in_use && u->origin == frame->origin && strcmp(u->nickname, frame->msg.nickname) == 0) {
+            presence_touch(find_room(u->room));
+            presence_touch(find_room(frame->room));
+            if (frame->kind == PEER_USER_OFFLINE) {
+                u->in_use = 0;
+            } else {
+                strcpy(u->room, frame->room);
+            }
+            return;
+        }
+        if (!u->in_use && free_slot == NULL) {
+            free_slot = u;
+        }
+    }
+    if (frame->kind == PEER_USER_ONLINE && free_slot != NULL) {
+        presence_touch(find_room(frame->room));
+        free_slot->origin = frame->origin;
+        strcpy(free_slot->nickname, frame->msg.nickname);
+        strcpy(free_slot->room, frame->room);
+        free_slot->in_use = 1;
+    }
+}
+
+// 적용한 순번을 주기적으로 알려준다. 보내는 쪽은 이 응답을 기다리지 않는다.
+void peer_inbound_ack(PeerInbound *in, long long now) {
+    PeerOrigin *po;
+    PeerFrame ack;
+
+    if (in->origin == 0 || now - in->ack_usec < PEER_ACK_USEC) {
+        return;
+    }
+    if ((po = peer_origin(in->origin)) == NULL || po->last_seq == in->acked) {
+        return;
+    }
+    memset(&ack, 0, sizeof(ack));
+    ack.kind = PEER_ACK;
+    ack.origin = node_id;
+    ack.epoch = po->epoch;
+    ack.seq = po->last_seq;
+    if (peer_inbound_send(in, &ack) == 0) {
+        in->acked = po->last_seq;
+    }
+    in->ack_usec = now;
+}
+
+// 주 서버에서 FAILOVER_USEC 동안 아무 프레임도 없으면 승격해서 연결을 받기 시작한다
+void standby_check(long long now, int ssock, int backlog) {
+    if (!standby_seen_primary || now - standby_last_rx < FAILOVER_USEC) {
+        return;
+    }
+    // 소켓 활성화로 받은 소켓은 이미 listen 중이다 (다시 불러도 대기열 길이만 바뀐다)
+    if (listen(ssock, backlog) < 0) {
+        syslog(LOG_ERR, "standby: cannot listen after promotion: %m");
+        return;
+    }
+    standby = 0;
+
+    int remote = 0;
+    for (int i = 0; i < MAX_REMOTE_USERS; i++) {
+        remote += remote_users[i].in_use;
+    }
+    syslog(LOG_WARNING, "primary silent for %d ms, promoted to primary (history=%llu, users known=%d)",
+           FAILOVER_USEC / 1000, (unsigned long long)history_count, remote);
+}
+
+// 기록 파일을 열고 마지막 HISTORY_SIZE 개를 메모리로 읽어 온다
+int history_open(const char *path) {
+    struct stat st;
+    off_t start;
+
+    if ((history_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0) {
+        return -1;
+    }
+    if (fstat(history_fd, &st) < 0) {
+        return -1;
+    }
+
+    // 쓰다 만 마지막 레코드는 버린다
+    off_t whole = st.st_size - st.st_size % sizeof(HistoryRecord);
+    if (whole != st.st_size) {
+        ftruncate(history_fd, whole);
+    }
+    history_count = whole / sizeof(HistoryRecord);
+    start = (history_count > HISTORY_SIZE) ? (off_t)(history_count - HISTORY_SIZE) : 0;
+
+    for (uint64_t i = start; i < history_count; i++) {
+        if (pread(history_fd, &history[i % HISTORY_SIZE], sizeof(HistoryRecord),
+                  i * sizeof(HistoryRecord)) != sizeof(HistoryRecord)) {
+            return -1;
+        }
+    }
+    history_flushed = history_count;
+    return 0;
+}
+
+// 메모리 링에만 넣는다. 파일 쓰기는 루프 끝에서 history_flush()가 묶어서 한다.
+void history_append(const char *room, ChatMessage *message) {
+    HistoryRecord *rec = &history[history_count % HISTORY_SIZE];
+
+    if (history_count - history_flushed >= HISTORY_SIZE) {
+        history_flush();
+    }
+    memset(rec, 0, sizeof(*rec));
+    rec->time = time(NULL);
+    strncpy(rec->room, room, ROOM_NAME_SIZE - 1);
+    rec->msg = *message;
+    history_count++;
+}
+
+void history_flush(void) {
+    if (history_fd == -1) {
+        history_flushed = history_count;
+        return;
+    }
+    while (history_flushed < history_count) {
+        uint64_t first = history_flushed % HISTORY_SIZE;
+        uint64_t n = history_count - history_flushed;
+        if (first + n > HISTORY_SIZE) {
+            n = HISTORY_SIZE - first; // 링 끝까지 쓰고 나머지는 다음 바퀴에
+        }
+        ssize_t w = write(history_fd, &history[first], n * sizeof(HistoryRecord));
+        if (w < 0) {
+            syslog(LOG_ERR, "history write failed: %m");
+            history_flushed = history_count;
+            return;
+        }
+        history_flushed += w / sizeof(HistoryRecord);
+        if ((size_t)w < n * sizeof(HistoryRecord)) {
+            // 레코드 중간에서 끊기지 않도록 나머지 바이트는 다음에 다시 쓴다
+            off_t cut = lseek(history_fd, 0, SEEK_END) - w % sizeof(HistoryRecord);
+            ftruncate(history_fd, cut);
+            return;
+        }
+    }
+}
+
+// 방에 들어온 클라이언트에게 그 방의 최근 대화를 보여준다
+void history_replay(int client_index) {
+    const char *room = rooms[client_rooms[client_index]].name;
+    uint64_t oldest = (history_count > HISTORY_SIZE) ? history_count - HISTORY_SIZE : 0;
+    uint64_t from = history_count;
+    int found = 0;
+
+    if (history_count == 0) {
+        return;
+    }
+    while (from > oldest && found < HISTORY_REPLAY) {
+        from--;
+        if (strcmp(history[from % HISTORY_SIZE].room, room) == 0) {
+            found++;
+        }
+    }
+    for (uint64_t i = from; i < history_count; i++) {
+        if (strcmp(history[i % HISTORY_SIZE].room, room) == 0) {
+            send_to_client(client_index, &history[i % HISTORY_SIZE].msg);
+        }
+    }
+}
+
+// "<cert>[,<key>]" 를 읽어 서버 TLS 컨텍스트를 만든다. 키를 생략하면 인증서 파일에서 읽는다.
+int tls_init(const char *spec) {
+    char cert[256];
+    const char *key;
+    const char *comma = strchr(spec, ',');
+
+    if (comma != NULL) {
+        snprintf(cert, sizeof(cert), "%.*s", (int)(comma - spec), spec);
+        key = comma + 1;
+    } else {
+        snprintf(cert, sizeof(cert), "%s", spec);
+        key = cert;
+    }
+
+    if ((tls_ctx = SSL_CTX_new(TLS_server_method())) == NULL) {
+        return -1;
+    }
+    // OpenSSL 3.0은 TLS 1.3 수신 방향 kTLS를 지원하지 않으므로 1.2 + AES-GCM으로 고정한다
+    SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_max_proto_version(tls_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_cipher_list(tls_ctx, "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"
+                                     "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384");
+    SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_NO_TICKET);
+
+    if (SSL_CTX_use_certificate_chain_file(tls_ctx, cert) != 1
+        || SSL_CTX_use_PrivateKey_file(tls_ctx, key, SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(tls_ctx) != 1) {
+        SSL_CTX_free(tls_ctx);
+        tls_ctx = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// 자식 프로세스에서 핸드셰이크를 하고 송수신 모두 kTLS로 넘어갔는지 확인한다.
+// kTLS가 안 되면 부모가 평문 경로로 보낼 수 없으므로 연결을 거부한다.
+int tls_accept(int client_index) {
+    int sock = client_sockets[client_index];
+    struct timeval tv = {TLS_HANDSHAKE_TIMEOUT, 0};
+    int flags = fcntl(sock, F_GETFL, 0);
+    SSL *ssl;
+    int ok = -1;
+
+    // 부모는 핸드셰이크가 끝날 때까지 이 소켓을 건드리지 않는다
+    fcntl(sock, F_SETFL, flags & ~O_NONBLOCK);
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if ((ssl = SSL_new(tls_ctx)) == NULL || SSL_set_fd(ssl, sock) != 1) {
+        return -1;
+    }
+    if (SSL_accept(ssl) != 1) {
+        syslog(LOG_INFO, "client %d: TLS handshake failed", client_index);
+    } else if (BIO_get_ktls_send(SSL_get_wbio(ssl)) != 1 || BIO_get_ktls_recv(SSL_get_rbio(ssl)) != 1) {
+        syslog(LOG_ERR, "client %d: kernel TLS offload unavailable (is the tls module loaded?)", client_index);
+    } else {
+        ok = 0;
+    }
+
+    tv.tv_sec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    // 세션 키는 이제 커널에 있다. SSL_shutdown()은 close_notify를 보내므로 부르지 않는다.
+    SSL_free(ssl);
+    return ok;
+}
+
+// 자식 프로세스에서 핸드셰이크를 하고 결과를 부모에게 알린다 (실패하면 끝낸다)
+void tls_handshake(int client_index) {
+    ChatMessage tls_msg = {MSG_SESSION, "", ""};
+    int ok = tls_accept(client_index) == 0;
+
+    strcpy(tls_msg.content, ok ? "tls_ready" : "tls_failed");
+    write(pipes_to_parent[client_index][1], &tls_msg, sizeof(ChatMessage));
+    if (!ok) {
+        exit(1);
+    }
+}
+
+// 규칙 한 줄을 읽는다: "<drop|mask|flag> <패턴>" (#으로 시작하면 주석)
+int filter_parse_line(char *line, int *action, char **pattern, size_t *len) {
+    char *p = line + strspn(line, " \t");
+    size_t n = strcspn(p, " \t");
+
+    if (*p == '#' || n == 0) {
+        return -1;
+    } else if (n == 4 && strncmp(p, "drop", 4) == 0) {
+        *action = FILTER_DROP;
+    } else if (n == 4 && strncmp(p, "mask", 4) == 0) {
+        *action = FILTER_MASK;
+    } else if (n == 4 && strncmp(p, "flag", 4) == 0) {
+        *action = FILTER_FLAG;
+    } else {
+        return -1;
+    }
+
+    p += n;
+    p += strspn(p, " \t");
+    n = strcspn(p, "\r\n");
+    while (n > 0 && (p[n - 1] == ' ' || p[n - 1] == '\t')) {
+        n--;
+    }
+    // 메시지보다 긴 패턴은 걸릴 일이 없다
+    if (n == 0 || n > BUF_SIZE) {
+        return -1;
+    }
+    *pattern = p;
+    *len = n;
+    return 0;
+}
+
+size_t filter_table_size(const FilterTable *t) {
+    return sizeof(FilterTable)
+        + sizeof(int32_t) * ((size_t)t->nstates * t->nclasses + 2 * (size_t)t->nstates)
+        + sizeof(FilterRule) * t->nrules;
+}
+
+// 규칙 파일을 읽어 오토마톤으로 컴파일한다
+FilterTable *filter_compile(const char *path) {
+    FILE *fp = fopen(path, "r");
+    char line[512], *pattern;
+    char **patterns = NULL;
+    FilterRule *rules = NULL;
+    uint32_t nrules = 0, cap = 0, lineno = 0;
+    size_t len;
+    int action;
+    FilterTable *t = NULL;
+
+    if (fp == NULL) {
+        return NULL;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        if (filter_parse_line(line, &action, &pattern, &len) < 0) {
+            continue;
+        }
+        if (nrules == cap) {
+            char **p = realloc(patterns, sizeof(char *) * (cap * 2 + 64));
+            FilterRule *r = p != NULL ? realloc(rules, sizeof(FilterRule) * (cap * 2 + 64)) : NULL;
+            patterns = p != NULL ? p : patterns;
+            rules = r != NULL ? r : rules;
+            if (p == NULL || r == NULL) {
+                goto out;
+            }
+            cap = cap * 2 + 64;
+        }
+        if ((patterns[nrules] = malloc(len)) == NULL) {
+            goto out;
+        }
+        memcpy(patterns[nrules], pattern, len);
+        rules[nrules].action = action;
+        rules[nrules].len = len;
+        rules[nrules].line = lineno;
+        nrules++;
+    }
+    t = filter_build((const char *const *)patterns, rules, nrules);
+
+out:
+    for (uint32_t i = 0; i < nrules; i++) {
+        free(patterns[i]);
+    }
+    free(patterns);
+    free(rules);
+    fclose(fp);
+    return t;
+}
+
+// 패턴들을 Aho-Corasick 오토마톤으로 컴파일한다. 실패 링크를 미리 따라가 둔 DFA라서
+// 검사할 때는 바이트마다 표를 한 번만 찾는다. 패턴에 나오지 않는 바이트는 모두 0번 클래스로
+// 묶어 표의 폭을 줄인다. 규칙 i의 패턴은 patterns[i]이고 길이는 rules[i].len이다.
+FilterTable *filter_build(const char *const *patterns, const FilterRule *rules, uint32_t nrules) {
+    uint8_t classes[256] = {0};
+    uint32_t nclasses = 1, nstates = 1;
+    size_t total = 0;
+    int32_t *delta, *match, *link, *fail, *queue;
+    FilterTable *t = NULL;
+
+    // 1단계: 문자 클래스와 상태 수 상한
+    for (uint32_t r = 0; r < nrules; r++) {
+        for (size_t i = 0; i < rules[r].len; i++) {
+            unsigned char c = ASCII_FOLD((unsigned char)patterns[r][i]);
+            if (classes[c] == 0) {
+                classes[c] = nclasses++;
+            }
+        }
+        total += rules[r].len;
+    }
+    for (int c = 'A'; c <= 'Z'; c++) {
+        classes[c] = classes[ASCII_FOLD(c)];
+    }
+
+    delta = malloc(sizeof(int32_t) * (total + 1) * nclasses);
+    match = malloc(sizeof(int32_t) * (total + 1));
+    link = calloc(total + 1, sizeof(int32_t));
+    fail = calloc(total + 1, sizeof(int32_t));
+    queue = malloc(sizeof(int32_t) * (total + 1));
+    if (delta == NULL || match == NULL || link == NULL || fail == NULL || queue == NULL) {
+        goto out;
+    }
+    memset(delta, -1, sizeof(int32_t) * (total + 1) * nclasses);
+    memset(match, -1, sizeof(int32_t) * (total + 1));
+
+    // 2단계: 트라이
+    for (uint32_t r = 0; r < nrules; r++) {
+        int32_t s = 0;
+        for (size_t i = 0; i < rules[r].len; i++) {
+            int32_t *next = &delta[(size_t)s * nclasses + classes[(unsigned char)patterns[r][i]]];
+            if (*next < 0) {
+                *next = nstates++;
+            }
+            s = *next;
+        }
+        // 같은 패턴이 여러 번 나오면 강한 조치를 남긴다
+        if (match[s] < 0 || rules[match[s]].action < rules[r].action) {
+            match[s] = r;
+        }
+    }
+
+    // 3단계: 너비 우선으로 실패 링크를 구하고 빈 전이를 채운다.
+    // link는 실패 링크를 따라가며 처음 만나는 규칙이 끝나는 상태 (0이면 없음)
+    int head = 0, tail = 0;
+    for (uint32_t c = 0; c < nclasses; c++) {
+        if (delta[c] < 0) {
+            delta[c] = 0;
+        } else {
+            queue[tail++] = delta[c];
+        }
+    }
+    while (head < tail) {
+        int32_t u = queue[head++];
+        link[u] = match[fail[u]] >= 0 ? fail[u] : link[fail[u]];
+        for (uint32_t c = 0; c < nclasses; c++) {
+            int32_t *v = &delta[(size_t)u * nclasses + c];
+            int32_t via_fail = delta[(size_t)fail[u] * nclasses + c];
+            if (*v < 0) {
+                *v = via_fail;
+            } else {
+                fail[*v] = via_fail;
+                queue[tail++] = *v;
+            }
+        }
+    }
+
+    FilterTable head_only = {0};
+    head_only.nstates = nstates;
+    head_only.nclasses = nclasses;
+    head_only.nrules = nrules;
+    size_t size = filter_table_size(&head_only);
+    if (size <= FILTER_MAX_SIZE && (t = malloc(size)) != NULL) {
+        *t = head_only;
+        t->size = size;
+        memcpy(t->classes, classes, sizeof(classes));
+        for (size_t i = 0; i < (size_t)nstates * nclasses; i++) {
+            int32_t v = delta[i];
+            FILTER_DELTA(t)[i] = (uint32_t)v * nclasses | (match[v] >= 0 || link[v] > 0 ? FILTER_HIT : 0);
+        }
+        memcpy(FILTER_MATCH(t), match, sizeof(int32_t) * nstates);
+        memcpy(FILTER_LINK(t), link, sizeof(int32_t) * nstates);
+        memcpy(FILTER_RULES(t), rules, sizeof(FilterRule) * nrules);
+    }
+
+out:
+    free(delta);
+    free(match);
+    free(link);
+    free(fail);
+    free(queue);
+    return t;
+}
+
+// 본문을 한 번 훑어 가장 강한 조치를 돌려준다. mask 규칙에 걸린 바이트는 masked에 표시한다.
+int filter_scan(const FilterTable *t, const char *text, size_t len, unsigned char *masked, uint32_t *line) {
+    const uint32_t *delta = FILTER_DELTA(t);
+    const int32_t *match = FILTER_MATCH(t);
+    const int32_t *link = FILTER_LINK(t);
+    const FilterRule *rules = FILTER_RULES(t);
+    int action = FILTER_PASS;
+    uint32_t s = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        s = delta[(s & ~FILTER_HIT) + t->classes[(unsigned char)text[i]]];
+        if (!(s & FILTER_HIT)) {
+            continue;
+        }
+        int32_t state = (s & ~FILTER_HIT) / t->nclasses;
+        for (int32_t m = match[state] >= 0 ? state : link[state]; m > 0; m = link[m]) {
+            const FilterRule *rule = &rules[match[m]];
+            if (rule->action == FILTER_MASK) {
+                memset(masked + i + 1 - rule->len, 1, rule->len);
+            }
+            if (rule->action > action) {
+                action = rule->action;
+                *line = rule->line;
+            }
+        }
+    }
+    return action;
+}
+
+// 팬아웃 전 금지어 검사. 보내도 되면 1 (가릴 부분은 가린 뒤), 버리면 0.
+int filter_message(int client_index, ChatMessage *message) {
+    unsigned char masked[BUF_SIZE] = {0};
+    size_t len = strnlen(message->content, BUF_SIZE);
+    uint32_t line = 0;
+    int action;
+
+    if (filter_table == NULL) {
+        return 1;
+    }
+
+    long long start = cpu_nsec();
+    action = filter_scan(filter_table, message->content, len, masked, &line);
+    g_stats.filter_bytes += len;
+    g_stats.filter_nsec += cpu_nsec() - start;
+
+    if (action == FILTER_DROP) {
+        ChatMessage notice = {MSG_THROTTLE, "", ""};
+        snprintf(notice.content, BUF_SIZE, "금지어가 포함되어 메시지가 전달되지 않았습니다.");
+        send_to_client(client_index, &notice);
+        syslog(LOG_NOTICE, "filter: dropped message from %s (rule line %u)", nicknames[client_index], line);
+        g_stats.filter_dropped++;
+        return 0;
+    }
+    if (action == FILTER_FLAG) {
+        syslog(LOG_NOTICE, "filter: flagged message from %s (rule line %u): %.*s",
+               nicknames[client_index], line, (int)len, message->content);
+        g_stats.filter_flagged++;
+    }
+
+    // 가린 부분은 글자(UTF-8 문자)마다 * 하나로 바꾼다
+    char out[BUF_SIZE];
+    size_t o = 0;
+    int any = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (!masked[i]) {
+            out[o++] = message->content[i];
+        } else if (((unsigned char)message->content[i] & 0xC0) != 0x80) {
+            out[o++] = '*';
+            any = 1;
+        }
+    }
+    if (any) {
+        memcpy(message->content, out, o);
+        memset(message->content + o, 0, BUF_SIZE - o);
+        g_stats.filter_masked++;
+    }
+    return 1;
+}
+
+// 규칙 파일이 바뀌었으면 자식 프로세스에서 다시 컴파일한다 (큰 목록도 트래픽을 멈추지 않는다)
+void filter_poll(long long now) {
+    struct stat st;
+    sigset_t set, old;
+    int fds[2];
+    pid_t pid;
+
+    if (filter_pipe != -1) {
+        filter_receive();
+        return;
+    }
+    if (now - filter_check_usec < FILTER_CHECK_USEC) {
+        return;
+    }
+    filter_check_usec = now;
+    if (stat(filter_path, &st) < 0
+        || (st.st_mtim.tv_sec == filter_mtime.tv_sec && st.st_mtim.tv_nsec == filter_mtime.tv_nsec)) {
+        return;
+    }
+    filter_mtime = st.st_mtim;
+
+    if (pipe(fds) < 0) {
+        syslog(LOG_ERR, "filter: pipe: %m");
+        return;
+    }
+    // 자식이 pid를 기록하기 전에 끝나도 SIGCHLD에서 알아볼 수 있도록 막아 둔다
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, &old);
+    pid = fork();
+    if (pid == 0) {
+        struct rlimit rl;
+        child_default_signals();
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        // 결과 파이프만 3번으로 옮겨 두고 나머지(리스닝 소켓, 링크, 기록, 캡처, 클라이언트)는 모두 닫는다.
+        // 물려받은 채로 두면 부모가 닫은 연결이나 포트가 컴파일이 끝날 때까지 살아 있다.
+        if (dup2(fds[1], 3) < 0) {
+            _exit(1);
+        }
+        getrlimit(RLIMIT_NOFILE, &rl);
+        close_inherited_fds(3, 1, rl.rlim_cur);
+        FilterTable *t = filter_compile(filter_path);
+        size_t sent = 0;
+        while (t != NULL && sent < t->size) {
+            ssize_t n = write(3, (char *)t + sent, t->size - sent);
+            if (n <= 0) {
+                _exit(1);
+            }
+            sent += n;
+        }
+        _exit(t != NULL ? 0 : 1);
+    }
+    if (pid > 0) {
+        filter_pid = pid;
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    close(fds[1]);
+    if (pid < 0) {
+        syslog(LOG_ERR, "filter: fork: %m");
+        close(fds[0]);
+        return;
+    }
+    set_nonblocking(fds[0]);
+    filter_pipe = fds[0];
+    filter_rx_len = 0;
+}
+
+// 컴파일한 오토마톤을 받는다. 다 받으면 이전 것과 바꾼다.
+void filter_receive(void) {
+    ssize_t n;
+
+    if (filter_rx_len < sizeof(FilterTable)) {
+        n = read(filter_pipe, (char *)&filter_head + filter_rx_len, sizeof(FilterTable) - filter_rx_len);
+        if (n > 0 && (filter_rx_len += n) == sizeof(FilterTable)) {
+            if (filter_head.size != filter_table_size(&filter_head) || filter_head.size > FILTER_MAX_SIZE
+                || (filter_rx = malloc(filter_head.size)) == NULL) {
+                n = 0;
+            } else {
+                memcpy(filter_rx, &filter_head, sizeof(FilterTable));
+            }
+        }
+    } else {
+        n = read(filter_pipe, filter_rx + filter_rx_len, filter_head.size - filter_rx_len);
+        if (n > 0) {
+            filter_rx_len += n;
+        }
+    }
+
+    if (filter_rx != NULL && filter_rx_len == filter_head.size) {
+        free(filter_table);
+        filter_table = (FilterTable *)filter_rx;
+        g_stats.filter_reloads++;
+        syslog(LOG_INFO, "filter: reloaded %u rules, %u states", filter_table->nrules, filter_table->nstates);
+    } else if (n == 0 || (n < 0 && errno != EAGAIN)) {
+        // 규칙 파일이 잘못되었으면 이전 목록을 계속 쓴다
+        syslog(LOG_ERR, "filter: reload of %s failed, keeping previous rules", filter_path);
+        free(filter_rx);
+    } else {
+        return;
+    }
+    filter_rx = NULL;
+    close(filter_pipe);
+    filter_pipe = -1;
+}
+
+int capture_open(const char *path) {
+    CaptureHeader head = {CAPTURE_MAGIC, CAPTURE_VERSION, time(NULL)};
+
+    if ((capture_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        return -1;
+    }
+    if (write(capture_fd, &head, sizeof(head)) != sizeof(head)) {
+        return -1;
+    }
+    capture_last_usec = now_usec();
+    return 0;
+}
+
+// 캡처 버퍼에 레코드를 하나 쌓는다. 파일 쓰기는 루프 끝에서 capture_flush()가 묶어서 한다.
+void capture_event(int client_index, CaptureKind kind, ChatMessage *message) {
+    CaptureRecord rec;
+    long long now, delta;
+
+    if (capture_fd == -1) {
+        return;
+    }
+    if (kind == CAPTURE_OPEN) {
+        capture_ids[client_index] = capture_next_id++;
+    } else if (capture_ids[client_index] == 0) {
+        return;
+    }
+
+    now = now_usec();
+    delta = now - capture_last_usec;
+    capture_last_usec = now;
+    rec.usec_delta = delta > UINT32_MAX ? UINT32_MAX : (uint32_t)delta;
+    rec.conn = capture_ids[client_index];
+    rec.kind = kind;
+    rec.len = message != NULL ? frame_used(message) : 0;
+
+    if (capture_len + sizeof(rec) + rec.len > CAPTURE_BUF) {
+        capture_flush();
+    }
+    memcpy(capture_buf + capture_len, &rec, sizeof(rec));
+    if (rec.len > 0) {
+        memcpy(capture_buf + capture_len + sizeof(rec), message, rec.len);
+    }
+    capture_len += sizeof(rec) + rec.len;
+
+    if (kind == CAPTURE_FRAME) {
+        g_stats.captured++;
+    } else if (kind == CAPTURE_CLOSE) {
+        capture_ids[client_index] = 0;
+    }
+}
+
+void capture_flush(void) {
+    size_t off = 0;
+
+    while (off < capture_len) {
+        ssize_t w = write(capture_fd, capture_buf + off, capture_len - off);
+        if (w <= 0) {
+            // 디스크가 가득 차도 트래픽은 멈추지 않는다. 캡처만 멈춘다.
+            syslog(LOG_ERR, "capture write failed, capture stopped: %m");
+            close(capture_fd);
+            capture_fd = -1;
+            break;
+        }
+        off += w;
+    }
+    capture_len = 0;
+}
+
+// 낱말 해시 (FNV-1a). 영문 대소문자는 같게 본다.
+uint64_t search_hash(SearchKind kind, const char *s, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+
+    h = (h ^ (kind + 1)) * 1099511628211ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)ASCII_FOLD(s[i])) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// 본문을 색인 낱말로 나눈다. 영문과 숫자는 두 글자 이상인 단어를 그대로,
+// 한글 같은 나머지 글자는 이어진 두 글자씩(바이그램) 뽑는다. 조사가 붙어 있어도 찾을 수 있다.
+int search_tokens(const char *text, uint64_t *out, int max) {
+    const unsigned char *p = (const unsigned char *)text;
+    int n = 0;
+
+    while (*p != '\0' && n < max) {
+        const unsigned char *start = p;
+        if (*p < 0x80 && isalnum(*p)) {
+            while (*p != '\0' && *p < 0x80 && isalnum(*p)) {
+                p++;
+            }
+            if (p - start >= 2) {
+                out[n++] = search_hash(SEARCH_WORD, (const char *)start, p - start);
+            }
+        } else if (*p >= 0x80) {
+            const unsigned char *prev = NULL;
+            while (*p >= 0x80 && n < max) {
+                const unsigned char *ch = p++;
+                while ((*p & 0xC0) == 0x80) {
+                    p++; // UTF-8 글자의 나머지 바이트
+                }
+                if (prev != NULL) {
+                    out[n++] = search_hash(SEARCH_WORD, (const char *)prev, p - prev);
+                }
+                prev = ch;
+            }
+        } else {
+            p++;
+        }
+    }
+    return n;
+}
+
+// 세그먼트 목록을 읽는다. 아직 없으면 빈 목록이다.
+int search_load_manifest(const char *base, SearchManifest *m) {
+    char path[512];
+    int fd;
+    ssize_t n;
+
+    memset(m, 0, sizeof(*m));
+    memcpy(m->magic, SEARCH_MAGIC, 4);
+    m->version = SEARCH_VERSION;
+    snprintf(path, sizeof(path), "%s%s", base, SEARCH_SUFFIX);
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    n = read(fd, m, sizeof(*m));
+    close(fd);
+    if (n != sizeof(*m) || memcmp(m->magic, SEARCH_MAGIC, 4) != 0 || m->version != SEARCH_VERSION
+        || m->nsegs > SEARCH_MAX_SEGMENTS) {
+        return -1;
+    }
+    return 0;
+}
+
+int search_save_manifest(const char *base, SearchManifest *m) {
+    char path[512], tmp[512];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s%s", base, SEARCH_SUFFIX);
+    // 이름이 잘리면 다른 파일을 덮어쓰게 되므로 쓰지 않는다
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)
+        || (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        return -1;
+    }
+    if (write(fd, m, sizeof(*m)) != sizeof(*m)) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+    return rename(tmp, path);
+}
+
+// 색인 프로세스를 띄운다. 죽으면 SEARCH_RESTART_USEC 뒤에 다시 띄운다.
+void search_poll(long long now) {
+    sigset_t set, old;
+    pid_t pid;
+
+    if (search_pid != -1 || (search_start_usec != 0 && now - search_start_usec < SEARCH_RESTART_USEC)) {
+        return;
+    }
+    search_start_usec = now;
+
+    // 자식이 pid를 기록하기 전에 끝나도 SIGCHLD에서 알아볼 수 있도록 막아 둔다
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, &old);
+    pid = fork();
+    if (pid == 0) {
+        struct rlimit rl;
+        child_default_signals();
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        getrlimit(RLIMIT_NOFILE, &rl);
+        close_inherited_fds(0, 0, rl.rlim_cur);
+        search_indexer(search_base);
+    }
+    if (pid > 0) {
+        search_pid = pid;
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    if (pid < 0) {
+        syslog(LOG_ERR, "search: fork: %m");
+    }
+}
+
+// 색인 프로세스: 기록 파일 뒤를 따라가며 모은 낱말 목록을 세그먼트로 쓰고,
+// 같은 단계의 세그먼트가 SEARCH_MERGE_FANIN 개 모이면 하나로 합친다. 부모가 끝나면 같이 끝난다.
+void search_indexer(const char *base) {
+    pid_t parent = getppid();
+    HistoryRecord recs[256];
+    SearchManifest m;
+    char path[512];
+    long long buffered_usec = 0;
+    int fd, lock;
+
+    // 팬아웃과 CPU를 다투지 않도록 우선순위를 낮춘다
+    setpriority(PRIO_PROCESS, 0, 10);
+
+    // 무중단 재시작 중에는 이전 서버의 색인 프로세스가 끝날 때까지 기다린다
+    snprintf(path, sizeof(path), "%s%s.lock", base, SEARCH_SUFFIX);
+    if ((lock = open(path, O_RDWR | O_CREAT, 0644)) < 0 || flock(lock, LOCK_EX) < 0
+        || (fd = open(base, O_RDONLY)) < 0 || search_load_manifest(base, &m) < 0) {
+        syslog(LOG_ERR, "search: cannot open index for %s: %m", base);
+        _exit(1);
+    }
+    search_first = (m.nsegs > 0) ? m.segs[m.nsegs - 1].first_doc + m.segs[m.nsegs - 1].ndocs : 0;
+    search_docs = 0;
+
+    while (getppid() == parent) {
+        struct stat st;
+        uint64_t count, next = search_first + search_docs;
+        long long now = now_usec();
+
+        if (fstat(fd, &st) < 0) {
+            _exit(1);
+        }
+        count = st.st_size / sizeof(HistoryRecord);
+        if (count < next) {
+            // 기록 파일이 새로 만들어졌다. 모으던 목록을 버리고 색인도 처음부터 다시 만든다.
+            syslog(LOG_WARNING, "search: %s is shorter than its index, rebuilding", base);
+            for (uint32_t i = 0; i < m.nsegs; i++) {
+                snprintf(path, sizeof(path), "%s%s.%u", base, SEARCH_SUFFIX, m.segs[i].seq);
+                unlink(path);
+            }
+            m.nsegs = 0;
+            if (search_save_manifest(base, &m) < 0) {
+                _exit(1);
+            }
+            search_reset_postings();
+            search_first = 0;
+            search_docs = 0;
+            continue;
+        }
+
+        if (count > next && search_docs < SEARCH_SEGMENT_DOCS) {
+            uint64_t n = count - next;
+            if (n > sizeof(recs) / sizeof(recs[0])) {
+                n = sizeof(recs) / sizeof(recs[0]);
+            }
+            if (n > SEARCH_SEGMENT_DOCS - search_docs) {
+                n = SEARCH_SEGMENT_DOCS - search_docs;
+            }
+            ssize_t r = pread(fd, recs, n * sizeof(HistoryRecord), next * sizeof(HistoryRecord));
+            if (r < (ssize_t)sizeof(HistoryRecord)) {
+                _exit(1);
+            }
+            if (search_docs == 0) {
+                buffered_usec = now;
+            }
+            if (search_index_records(recs, r / sizeof(HistoryRecord), next) < 0) {
+                syslog(LOG_ERR, "search: out of memory while indexing");
+                _exit(1);
+            }
+        }
+
+        // 다 차면 바로, 아니면 늦어도 SEARCH_FLUSH_USEC 안에 세그먼트로 쓴다
+        if (search_docs >= SEARCH_SEGMENT_DOCS || (search_docs > 0 && now - buffered_usec >= SEARCH_FLUSH_USEC)) {
+            if (m.nsegs == SEARCH_MAX_SEGMENTS && search_merge(base, &m) < 0) {
+                _exit(1);
+            }
+            if (search_flush_segment(base, &m) < 0) {
+                syslog(LOG_ERR, "search: cannot write segment for %s: %m", base);
+                _exit(1);
+            }
+            while (m.nsegs >= SEARCH_MERGE_FANIN) {
+                uint32_t level = m.segs[m.nsegs - 1].level, i;
+                for (i = m.nsegs - SEARCH_MERGE_FANIN; i < m.nsegs && m.segs[i].level == level; i++) {
+                }
+                if (i < m.nsegs) {
+                    break;
+                }
+                if (search_merge(base, &m) < 0) {
+                    syslog(LOG_ERR, "search: cannot merge segments for %s: %m", base);
+                    _exit(1);
+                }
+            }
+        }
+        if (count == search_first + search_docs) {
+            usleep(SEARCH_POLL_USEC);
+        }
+    }
+    _exit(0);
+}
+
+// 기록 레코드를 낱말별 목록에 더한다 (레코드 번호는 모으고 있는 범위 안의 순번)
+int search_index_records(HistoryRecord *recs, int n, uint64_t first) {
+    for (int r = 0; r < n; r++) {
+        uint64_t terms[SEARCH_MAX_TERMS + 2];
+        uint32_t doc = (uint32_t)(first + r - search_first);
+        int nterms;
+
+        recs[r].msg.content[BUF_SIZE - 1] = '\0';
+        nterms = search_tokens(recs[r].msg.content, terms, SEARCH_MAX_TERMS);
+        terms[nterms++] = search_hash(SEARCH_ROOM, recs[r].room, strnlen(recs[r].room, ROOM_NAME_SIZE));
+        terms[nterms++] = search_hash(SEARCH_NICK, recs[r].msg.nickname, strnlen(recs[r].msg.nickname, NICKNAME_SIZE));
+
+        for (int t = 0; t < nterms; t++) {
+            SearchPosting *p;
+            uint32_t slot;
+
+            // 절반 넘게 차면 해시 표를 두 배로 늘린다
+            if ((search_npostings + 1) * 2 > search_nslots) {
+                uint32_t nslots = search_nslots ? search_nslots * 2 : 1 << 16;
+                uint32_t *slots = calloc(nslots, sizeof(uint32_t));
+                if (slots == NULL) {
+                    return -1;
+                }
+                for (uint32_t i = 0; i < search_npostings; i++) {
+                    slot = search_postings[i].hash & (nslots - 1);
+                    while (slots[slot] != 0) {
+                        slot = (slot + 1) & (nslots - 1);
+                    }
+                    slots[slot] = i + 1;
+                }
+                free(search_slots);
+                search_slots = slots;
+                search_nslots = nslots;
+            }
+
+            slot = terms[t] & (search_nslots - 1);
+            while (search_slots[slot] != 0 && search_postings[search_slots[slot] - 1].hash != terms[t]) {
+                slot = (slot + 1) & (search_nslots - 1);
+            }
+            if (search_slots[slot] == 0) {
+                if (search_npostings == search_cap) {
+                    uint32_t cap = search_cap ? search_cap * 2 : 4096;
+                    SearchPosting *grown = realloc(search_postings, cap * sizeof(SearchPosting));
+                    if (grown == NULL) {
+                        return -1;
+                    }
+                    search_postings = grown;
+                    search_cap = cap;
+                }
+                p = &search_postings[search_npostings++];
+                memset(p, 0, sizeof(*p));
+                p->hash = terms[t];
+                search_slots[slot] = search_npostings;
+            }
+
+            p = &search_postings[search_slots[slot] - 1];
+            if (p->n > 0 && p->docs[p->n - 1] == doc) {
+                continue; // 한 레코드에 같은 낱말이 또 나왔다
+            }
+            if (p->n == p->cap) {
+                uint32_t cap = p->cap ? p->cap * 2 : 4;
+                uint32_t *grown = realloc(p->docs, cap * sizeof(uint32_t));
+                if (grown == NULL) {
+                    return -1;
+                }
+                p->docs = grown;
+                p->cap = cap;
+            }
+            p->docs[p->n++] = doc;
+        }
+    }
+    search_docs += n;
+    return 0;
+}
+
+// 모으던 낱말 목록을 비운다 (해시 표와 목록 배열은 다음 세그먼트에 다시 쓴다)
+void search_reset_postings(void) {
+    for (uint32_t i = 0; i < search_npostings; i++) {
+        free(search_postings[i].docs);
+    }
+    search_npostings = 0;
+    if (search_slots != NULL) {
+        memset(search_slots, 0, search_nslots * sizeof(uint32_t));
+    }
+}
+
+int search_compare_postings(const void *a, const void *b) {
+    uint64_t x = ((const SearchPosting *)a)->hash, y = ((const SearchPosting *)b)->hash;
+    return (x > y) - (x < y);
+}
+
+// 모은 목록을 세그먼트 파일 하나로 쓰고 세그먼트 목록에 더한다
+int search_flush_segment(const char *base, SearchManifest *m) {
+    char path[512], tmp[512];
+    SearchWriter w;
+    int rc;
+
+    snprintf(path, sizeof(path), "%s%s.%u", base, SEARCH_SUFFIX, m->next_seq);
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        return -1;
+    }
+    qsort(search_postings, search_npostings, sizeof(SearchPosting), search_compare_postings);
+
+    rc = search_writer_open(&w, tmp);
+    for (uint32_t i = 0; i < search_npostings && rc == 0; i++) {
+        rc = search_writer_add(&w, search_postings[i].hash, search_postings[i].docs, search_postings[i].n);
+    }
+    if (search_writer_close(&w, search_first, search_docs) < 0 || rc < 0 || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    m->segs[m->nsegs].seq = m->next_seq++;
+    m->segs[m->nsegs].level = 0;
+    m->segs[m->nsegs].first_doc = search_first;
+    m->segs[m->nsegs].ndocs = search_docs;
+    m->nsegs++;
+    if (search_save_manifest(base, m) < 0) {
+        return -1;
+    }
+
+    search_reset_postings();
+    search_first += search_docs;
+    search_docs = 0;
+    return 0;
+}
+
+// 가장 최근 세그먼트 SEARCH_MERGE_FANIN 개를 하나로 합친다.
+// 세그먼트는 레코드 범위가 이어져 있으므로 낱말마다 목록을 순서대로 이어 붙이면 된다.
+int search_merge(const char *base, SearchManifest *m) {
+    SearchManifestEntry *in = &m->segs[m->nsegs - SEARCH_MERGE_FANIN];
+    SearchSegment *segs[SEARCH_MERGE_FANIN] = {NULL};
+    uint32_t pos[SEARCH_MERGE_FANIN] = {0};
+    uint32_t *docs = NULL, ndocs = 0, level = 0, seq = m->next_seq;
+    size_t cap = 0;
+    char path[512], tmp[512];
+    SearchWriter w;
+    SearchCursor c;
+    int rc = 0, opened = 0;
+
+    for (int k = 0; k < SEARCH_MERGE_FANIN; k++) {
+        if ((segs[k] = search_map(base, in[k].seq)) == NULL) {
+            rc = -1;
+        }
+        ndocs += in[k].ndocs;
+        level = (in[k].level > level) ? in[k].level : level;
+    }
+    snprintf(path, sizeof(path), "%s%s.%u", base, SEARCH_SUFFIX, seq);
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        rc = -1;
+    }
+    if (rc == 0) {
+        rc = search_writer_open(&w, tmp);
+        opened = rc == 0;
+    }
+
+    while (rc == 0) {
+        uint64_t hash = 0;
+        size_t n = 0;
+        int any = 0;
+
+        // 해시 순으로 정렬된 낱말 표들을 함께 훑는다
+        for (int k = 0; k < SEARCH_MERGE_FANIN; k++) {
+            const SearchTerm *terms = (const SearchTerm *)((const char *)segs[k] + segs[k]->terms_off);
+            if (pos[k] < segs[k]->nterms && (!any || terms[pos[k]].hash < hash)) {
+                hash = terms[pos[k]].hash;
+                any = 1;
+            }
+        }
+        if (!any) {
+            break;
+        }
+        for (int k = 0; k < SEARCH_MERGE_FANIN; k++) {
+            const SearchTerm *t = (const SearchTerm *)((const char *)segs[k] + segs[k]->terms_off) + pos[k];
+            uint32_t shift = (uint32_t)(segs[k]->first_doc - in[0].first_doc);
+            if (pos[k] >= segs[k]->nterms || t->hash != hash) {
+                continue;
+            }
+            if (n + t->df > cap) {
+                cap = (n + t->df) * 2;
+                uint32_t *grown = realloc(docs, cap * sizeof(uint32_t));
+                if (grown == NULL) {
+                    rc = -1;
+                    break;
+                }
+                docs = grown;
+            }
+            search_cursor_init(&c, segs[k], t);
+            for (uint32_t b = 0; b < t->nblocks; b++) {
+                search_cursor_load(&c, b);
+                for (int i = 0; i < c.ndocs; i++) {
+                    docs[n++] = c.docs[i] + shift;
+                }
+            }
+            pos[k]++;
+        }
+        if (rc == 0) {
+            rc = search_writer_add(&w, hash, docs, n);
+        }
+    }
+    free(docs);
+    if (opened && (search_writer_close(&w, in[0].first_doc, ndocs) < 0 || rc < 0 || rename(tmp, path) < 0)) {
+        unlink(tmp);
+        rc = -1;
+    }
+    for (int k = 0; k < SEARCH_MERGE_FANIN; k++) {
+        if (segs[k] != NULL) {
+            munmap(segs[k], segs[k]->size);
+        }
+    }
+    if (rc < 0) {
+        return -1;
+    }
+
+    // 목록을 바꾼 뒤에 이전 파일을 지운다. 이미 mmap한 검색은 그대로 끝까지 읽을 수 있다.
+    uint32_t old[SEARCH_MERGE_FANIN];
+    for (int k = 0; k < SEARCH_MERGE_FANIN; k++) {
+        old[k] = in[k].seq;
+    }
+    in[0].seq = seq;
+    in[0].level = level + 1;
+    in[0].ndocs = ndocs;
+    m->nsegs -= SEARCH_MERGE_FANIN - 1;
+    m->next_seq++;
+    if (search_save_manifest(base, m) < 0) {
+        return -1;
+    }
+    for (int k = 0; k < SEARCH_MERGE_FANIN; k++) {
+        snprintf(path, sizeof(path), "%s%s.%u", base, SEARCH_SUFFIX, old[k]);
+        unlink(path);
+    }
+    syslog(LOG_INFO, "search: merged %d segments into %u (%u docs, level %u)", SEARCH_MERGE_FANIN, seq, ndocs,
+           level + 1);
+    return 0;
+}
+
+int search_writer_open(SearchWriter *w, const char *path) {
+    SearchSegment head;
+
+    memset(w, 0, sizeof(*w));
+    memset(&head, 0, sizeof(head));
+    if ((w->fp = fopen(path, "w")) == NULL) {
+        return -1;
+    }
+    // 헤더 자리는 비워 두고 닫을 때 채운다
+    fwrite(&head, sizeof(head), 1, w->fp);
+    w->off = sizeof(head);
+    return 0;
+}
+
+// 정렬된 레코드 번호 목록 하나를 SEARCH_BLOCK 개씩 블록으로 나눠 쓴다
+int search_writer_add(SearchWriter *w, uint64_t hash, const uint32_t *docs, uint32_t n) {
+    static unsigned char *buf;
+    static size_t buf_cap;
+    static SearchSkip *skips;
+    static size_t skips_cap;
+    uint32_t nblocks = (n + SEARCH_BLOCK - 1) / SEARCH_BLOCK;
+    size_t len = 0, pad;
+
+    if ((size_t)n * 5 + 8 > buf_cap) {
+        unsigned char *grown = realloc(buf, (size_t)n * 5 * 2 + 8);
+        if (grown == NULL) {
+            return -1;
+        }
+        buf = grown;
+        buf_cap = (size_t)n * 5 * 2 + 8;
+    }
+    if (nblocks + 1 > skips_cap) {
+        SearchSkip *grown = realloc(skips, (nblocks + 1) * 2 * sizeof(SearchSkip));
+        if (grown == NULL) {
+            return -1;
+        }
+        skips = grown;
+        skips_cap = (nblocks + 1) * 2;
+    }
+    if (w->nterms == w->cap) {
+        uint32_t cap = w->cap ? w->cap * 2 : 4096;
+        SearchTerm *grown = realloc(w->terms, cap * sizeof(SearchTerm));
+        if (grown == NULL) {
+            return -1;
+        }
+        w->terms = grown;
+        w->cap = cap;
+    }
+
+    for (uint32_t b = 0; b < nblocks; b++) {
+        uint32_t from = b * SEARCH_BLOCK;
+        uint32_t to = (from + SEARCH_BLOCK < n) ? from + SEARCH_BLOCK : n;
+        skips[b].off = len;
+        skips[b].last = docs[to - 1];
+        for (uint32_t i = from; i < to; i++) {
+            uint32_t v = (i == from) ? docs[i] : docs[i] - docs[i - 1];
+            while (v >= 0x80) {
+                buf[len++] = (v & 0x7f) | 0x80;
+                v >>= 7;
+            }
+            buf[len++] = v;
+        }
+    }
+    skips[nblocks].last = 0;
+    skips[nblocks].off = len;
+
+    // 다음 목록의 건너뛰기 표와 낱말 표가 정렬되도록 8바이트 단위로 채운다 (건너뛰기 표는 8바이트 배수)
+    pad = (8 - len % 8) & 7;
+    memset(buf + len, 0, pad);
+
+    w->terms[w->nterms].hash = hash;
+    w->terms[w->nterms].off = w->off;
+    w->terms[w->nterms].df = n;
+    w->terms[w->nterms].nblocks = nblocks;
+    w->nterms++;
+    fwrite(skips, sizeof(SearchSkip), nblocks + 1, w->fp);
+    fwrite(buf, 1, len + pad, w->fp);
+    w->off += (nblocks + 1) * sizeof(SearchSkip) + len + pad;
+    return ferror(w->fp) ? -1 : 0;
+}
+
+// 낱말 표와 헤더를 쓰고 닫는다
+int search_writer_close(SearchWriter *w, uint64_t first_doc, uint32_t ndocs) {
+    SearchSegment head;
+    int rc;
+
+    if (w->fp == NULL) {
+        return -1;
+    }
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, SEARCH_MAGIC, 4);
+    head.version = SEARCH_VERSION;
+    head.first_doc = first_doc;
+    head.ndocs = ndocs;
+    head.nterms = w->nterms;
+    head.terms_off = w->off;
+    head.size = w->off + (uint64_t)w->nterms * sizeof(SearchTerm);
+    fwrite(w->terms, sizeof(SearchTerm), w->nterms, w->fp);
+    fseek(w->fp, 0, SEEK_SET);
+    fwrite(&head, sizeof(head), 1, w->fp);
+    rc = ferror(w->fp) ? -1 : 0;
+    if (fclose(w->fp) != 0) {
+        rc = -1;
+    }
+    free(w->terms);
+    w->fp = NULL;
+    w->terms = NULL;
+    return rc;
+}
+
+// 세그먼트 파일을 읽기 전용으로 mmap한다
+SearchSegment *search_map(const char *base, uint32_t seq) {
+    char path[512];
+    struct stat st;
+    SearchSegment *seg;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s%s.%u", base, SEARCH_SUFFIX, seq);
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SearchSegment)) {
+        close(fd);
+        return NULL;
+    }
+    seg = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg == MAP_FAILED) {
+        return NULL;
+    }
+    if (memcmp(seg->magic, SEARCH_MAGIC, 4) != 0 || seg->version != SEARCH_VERSION
+        || seg->size != (uint64_t)st.st_size
+        || seg->terms_off + (uint64_t)seg->nterms * sizeof(SearchTerm) > seg->size) {
+        munmap(seg, st.st_size);
+        return NULL;
+    }
+    return seg;
+}
+
+const SearchTerm *search_find_term(const SearchSegment *seg, uint64_t hash) {
+    const SearchTerm *terms = (const SearchTerm *)((const char *)seg + seg->terms_off);
+    uint32_t lo = 0, hi = seg->nterms;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (terms[mid].hash < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (lo < seg->nterms && terms[lo].hash == hash) ? &terms[lo] : NULL;
+}
+
+void search_cursor_init(SearchCursor *c, const SearchSegment *seg, const SearchTerm *t) {
+    c->skips = (const SearchSkip *)((const char *)seg + t->off);
+    c->data = (const unsigned char *)(c->skips + t->nblocks + 1);
+    c->nblocks = t->nblocks;
+    c->block = -1;
+    c->ndocs = 0;
+}
+
+// 블록 하나를 푼다
+int search_cursor_load(SearchCursor *c, int block) {
+    const unsigned char *p = c->data + c->skips[block].off;
+    const unsigned char *end = c->data + c->skips[block + 1].off;
+    uint32_t doc = 0;
+
+    c->ndocs = 0;
+    while (p < end && c->ndocs < SEARCH_BLOCK) {
+        uint32_t v = 0;
+        int shift = 0;
+        while (p < end && (*p & 0x80) && shift < 28) {
+            v |= (uint32_t)(*p++ & 0x7f) << shift;
+            shift += 7;
+        }
+        if (p < end) {
+            v |= (uint32_t)*p++ << shift;
+        }
+        doc = (c->ndocs == 0) ? v : doc + v;
+        c->docs[c->ndocs++] = doc;
+    }
+    c->block = block;
+    return c->ndocs;
+}
+
+// 목록에 레코드가 있는지 본다. 건너뛰기 표로 블록을 찾아 그 블록만 푼다.
+int search_cursor_has(SearchCursor *c, uint32_t doc) {
+    uint32_t lo = 0, hi = c->nblocks;
+    int a, b;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (c->skips[mid].last < doc) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == c->nblocks) {
+        return 0;
+    }
+    if (c->block != (int)lo) {
+        search_cursor_load(c, lo);
+    }
+    for (a = 0, b = c->ndocs; a < b;) {
+        int mid = (a + b) / 2;
+        if (c->docs[mid] < doc) {
+            a = mid + 1;
+        } else {
+            b = mid;
+        }
+    }
+    return a < c->ndocs && c->docs[a] == doc;
+}
+
+// "낱말 ... from:<닉네임> room:<방> since:<시간> until:<시간>" 을 읽는다.
+// 시간은 지금부터 거슬러 올라간 값(7d, 12h, 30m)이나 유닉스 시간이다.
+int search_parse(const char *text, SearchQuery *q) {
+    char buf[BUF_SIZE];
+    char *save, *tok;
+
+    memset(q, 0, sizeof(*q));
+    q->until = INT64_MAX;
+    snprintf(buf, sizeof(buf), "%s", text);
+    for (tok = strtok_r(buf, " \t", &save); tok != NULL; tok = strtok_r(NULL, " \t", &save)) {
+        if (strncmp(tok, "from:", 5) == 0) {
+            snprintf(q->nick, sizeof(q->nick), "%s", tok + 5);
+        } else if (strncmp(tok, "room:", 5) == 0) {
+            snprintf(q->room, sizeof(q->room), "%s", tok + 5);
+        } else if (strncmp(tok, "since:", 6) == 0 || strncmp(tok, "until:", 6) == 0) {
+            char *end;
+            long long v = strtoll(tok + 6, &end, 10);
+            int unit = (*end == 'd') ? 86400 : (*end == 'h') ? 3600 : (*end == 'm') ? 60 : 0;
+            int64_t t = unit ? (int64_t)time(NULL) - v * unit : v;
+            if (tok[0] == 's') {
+                q->since = t;
+            } else {
+                q->until = t;
+            }
+        } else if (q->nwords < SEARCH_MAX_WORDS) {
+            snprintf(q->words[q->nwords++], BUF_SIZE, "%s", tok);
+            q->nterms += search_tokens(tok, q->terms + q->nterms, SEARCH_MAX_TERMS - 2 - q->nterms);
+        }
+    }
+    if (q->nick[0] != '\0') {
+        q->terms[q->nterms++] = search_hash(SEARCH_NICK, q->nick, strlen(q->nick));
+    }
+    if (q->room[0] != '\0') {
+        q->terms[q->nterms++] = search_hash(SEARCH_ROOM, q->room, strlen(q->room));
+    }
+    // 색인으로 좁힐 수 있는 조건이 하나도 없으면 기록 전체를 훑어야 하므로 받지 않는다
+    return (q->nterms > 0 || q->since > 0) ? 0 : -1;
+}
+
+// 시각이 t 이상인 첫 레코드 순번 (기록은 시각 순서로 쌓인다)
+uint64_t search_time_to_doc(int64_t t, uint64_t count) {
+    uint64_t lo = 0, hi = count;
+
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        int64_t rt;
+        if (pread(search_fd, &rt, sizeof(rt), mid * sizeof(HistoryRecord) + offsetof(HistoryRecord, time))
+            != sizeof(rt) || rt >= t) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+// 후보 레코드를 기록 파일에서 읽어 조건을 모두 확인한다 (해시 충돌과 떨어진 바이그램을 걸러낸다)
+int search_match(SearchQuery *q, uint64_t doc) {
+    HistoryRecord rec;
+
+    if (pread(search_fd, &rec, sizeof(rec), doc * sizeof(rec)) != sizeof(rec)) {
+        return 0;
+    }
+    q->scanned++;
+    rec.room[ROOM_NAME_SIZE - 1] = '\0';
+    rec.msg.nickname[NICKNAME_SIZE - 1] = '\0';
+    rec.msg.content[BUF_SIZE - 1] = '\0';
+    if (rec.time < q->since || rec.time > q->until) {
+        return 0;
+    }
+    if ((q->room[0] != '\0' && strcasecmp(rec.room, q->room) != 0)
+        || (q->nick[0] != '\0' && strcasecmp(rec.msg.nickname, q->nick) != 0)) {
+        return 0;
+    }
+    for (int i = 0; i < q->nwords; i++) {
+        if (strcasestr(rec.msg.content, q->words[i]) == NULL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// 세그먼트 하나에서 [lo, hi) 범위의 레코드를 최신 것부터 찾는다.
+// 가장 짧은 목록을 뒤쪽 블록부터 풀고, 나머지 목록은 건너뛰기 표로 확인한다.
+void search_segment(SearchQuery *q, const SearchSegment *seg, uint64_t lo, uint64_t hi) {
+    SearchCursor cursors[SEARCH_MAX_TERMS];
+    uint32_t min_df = 0;
+    int driver = -1;
+
+    for (int i = 0; i < q->nterms; i++) {
+        const SearchTerm *t = search_find_term(seg, q->terms[i]);
+        if (t == NULL) {
+            return; // 이 세그먼트에는 없는 낱말이다
+        }
+        search_cursor_init(&cursors[i], seg, t);
+        if (driver == -1 || t->df < min_df) {
+            driver = i;
+            min_df = t->df;
+        }
+    }
+    if (lo < seg->first_doc) {
+        lo = seg->first_doc;
+    }
+    if (hi > seg->first_doc + seg->ndocs) {
+        hi = seg->first_doc + seg->ndocs;
+    }
+
+    if (driver == -1) {
+        // 시간 조건만 있다
+        for (uint64_t doc = hi; doc-- > lo && q->nhits < SEARCH_RESULTS;) {
+            if (search_match(q, doc)) {
+                q->hits[q->nhits++] = doc;
+            }
+        }
+        return;
+    }
+
+    SearchCursor *d = &cursors[driver];
+    for (int b = (int)d->nblocks - 1; b >= 0; b--) {
+        if (b > 0 && seg->first_doc + d->skips[b - 1].last + 1 >= hi) {
+            continue; // 블록 전체가 범위보다 뒤에 있다
+        }
+        search_cursor_load(d, b);
+        for (int i = d->ndocs - 1; i >= 0; i--) {
+            uint64_t doc = seg->first_doc + d->docs[i];
+            int j;
+            if (doc >= hi) {
+                continue;
+            }
+            if (doc < lo) {
+                return;
+            }
+            for (j = 0; j < q->nterms; j++) {
+                if (j != driver && !search_cursor_has(&cursors[j], d->docs[i])) {
+                    break;
+                }
+            }
+            if (j == q->nterms && search_match(q, doc)) {
+                q->hits[q->nhits++] = doc;
+                if (q->nhits == SEARCH_RESULTS) {
+                    return;
+                }
+            }
+        }
+    }
+}
+
+// 자식 프로세스에서 검색하고 결과를 부모에게 돌려준다 (부모는 요청한 클라이언트에게만 보낸다).
+// 결과는 오래된 것부터 한 줄씩, 마지막에 닉네임 없는 요약 한 줄을 보낸다.
+void search_run(int client_index, const char *text) {
+    SearchQuery q;
+    SearchManifest m;
+    ChatMessage reply = {MSG_SEARCH, "", ""};
+    long long start = now_usec();
+    uint64_t count, lo, hi, indexed = 0;
+    struct stat st;
+
+    if (search_base == NULL || (search_fd == -1 && (search_fd = open(search_base, O_RDONLY)) < 0)) {
+        strcpy(reply.content, "대화 기록(-H)을 쓰지 않는 서버라 검색할 수 없습니다.");
+        write(pipes_to_parent[client_index][1], &reply, sizeof(ChatMessage));
+        return;
+    }
+    if (search_parse(text, &q) < 0) {
+        strcpy(reply.content, "검색어는 두 글자 이상 (예: /search 회의 from:철수 room:lobby since:7d)");
+        write(pipes_to_parent[client_index][1], &reply, sizeof(ChatMessage));
+        return;
+    }
+
+    fstat(search_fd, &st);
+    count = st.st_size / sizeof(HistoryRecord);
+    lo = (q.since > 0) ? search_time_to_doc(q.since, count) : 0;
+    hi = (q.until != INT64_MAX) ? search_time_to_doc(q.until + 1, count) : count;
+
+    // 그사이 병합으로 세그먼트가 지워졌으면 목록을 다시 읽는다
+    for (int attempt = 0; attempt < 3; attempt++) {
+        int missing = 0;
+        uint64_t tail;
+
+        q.nhits = 0;
+        q.scanned = 0;
+        if (search_load_manifest(search_base, &m) < 0) {
+            m.nsegs = 0;
+        }
+        indexed = (m.nsegs > 0) ? m.segs[m.nsegs - 1].first_doc + m.segs[m.nsegs - 1].ndocs : 0;
+
+        // 아직 색인되지 않은 최근 기록은 직접 훑는다. 색인 프로세스가 밀려 있을 때는 최근 것만.
+        tail = (indexed > lo) ? indexed : lo;
+        if (count > 2 * SEARCH_SEGMENT_DOCS && tail < count - 2 * SEARCH_SEGMENT_DOCS) {
+            tail = count - 2 * SEARCH_SEGMENT_DOCS;
+        }
+        for (uint64_t doc = hi; doc-- > tail && q.nhits < SEARCH_RESULTS;) {
+            if (search_match(&q, doc)) {
+                q.hits[q.nhits++] = doc;
+            }
+        }
+
+        for (int i = (int)m.nsegs - 1; i >= 0 && q.nhits < SEARCH_RESULTS; i--) {
+            SearchSegment *seg;
+            if (m.segs[i].first_doc >= hi || m.segs[i].first_doc + m.segs[i].ndocs <= lo) {
+                continue;
+            }
+            if ((seg = search_map(search_base, m.segs[i].seq)) == NULL) {
+                missing = 1;
+                break;
+            }
+            search_segment(&q, seg, lo, hi);
+            munmap(seg, seg->size);
+        }
+        if (!missing) {
+            break;
+        }
+    }
+
+    for (int i = q.nhits - 1; i >= 0; i--) {
+        HistoryRecord rec;
+        struct tm tm;
+        time_t when;
+        char stamp[16];
+
+        if (pread(search_fd, &rec, sizeof(rec), q.hits[i] * sizeof(rec)) != sizeof(rec)) {
+            continue;
+        }
+        rec.room[ROOM_NAME_SIZE - 1] = '\0';
+        rec.msg.content[BUF_SIZE - 1] = '\0';
+        when = rec.time;
+        localtime_r(&when, &tm);
+        strftime(stamp, sizeof(stamp), "%m/%d %H:%M", &tm);
+        memcpy(reply.nickname, rec.msg.nickname, NICKNAME_SIZE);
+        reply.nickname[NICKNAME_SIZE - 1] = '\0';
+        // 시각과 방 이름이 붙은 만큼 내용 끝이 잘릴 수 있다. 잘리면 글자 경계에서 끊는다
+        if (snprintf(reply.content, BUF_SIZE, "%s #%s %s", stamp, rec.room, rec.msg.content) >= BUF_SIZE) {
+            utf8_trim(reply.content);
+        }
+        write(pipes_to_parent[client_index][1], &reply, sizeof(ChatMessage));
+    }
+
+    memset(reply.nickname, 0, NICKNAME_SIZE);
+    snprintf(reply.content, BUF_SIZE, "검색 결과 %d건 (%.1fms, 후보 %lu개%s)", q.nhits,
+             (now_usec() - start) / 1000.0, q.scanned,
+             (count > indexed + 2 * SEARCH_SEGMENT_DOCS) ? ", 색인 중" : "");
+    write(pipes_to_parent[client_index][1], &reply, sizeof(ChatMessage));
+}
+
+// 방의 접속자 목록이 바뀌었다고 표시한다 (room -1: 전체 목록만 보내면 된다).
+// 조용하다가 처음 바뀐 때부터 한 틱 동안 모았다가 한 번에 알린다.
+void presence_touch(int room) {
+    if (!presence_pending) {
+        presence_pending = 1;
+        presence_usec = now_usec();
+    }
+    if (room >= 0) {
+        presence_dirty[room] = 1;
+    }
+}
+
+int presence_compare(const void *a, const void *b) {
+    return strcmp(a, b);
+}
+
+// 방에 있는 사람의 닉네임을 모은다 (다른 서버의 사용자 포함, 정렬하고 중복은 뺀다)
+int presence_collect(int room, char names[][NICKNAME_SIZE]) {
+    int n = 0, unique = 0;
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (client_sockets[i] != -1 && nicknames[i][0] != '\0' && client_rooms[i] == room) {
+            strcpy(names[n++], nicknames[i]);
+        }
+    }
+    for (int i = 0; i < MAX_REMOTE_USERS; i++) {
+        if (remote_users[i].in_use && strcmp(remote_users[i].room, rooms[room].name) == 0) {
+            strcpy(names[n++], remote_users[i].nickname);
+        }
+    }
+    qsort(names, n, NICKNAME_SIZE, presence_compare);
+    for (int i = 0; i < n; i++) {
+        if (unique == 0 || strcmp(names[unique - 1], names[i]) != 0) {
+            memmove(names[unique++], names[i], NICKNAME_SIZE);
+        }
+    }
+    return unique;
+}
+
+// 목록 프레임에 항목 하나를 더한다. 앞 프레임이 가득 찼으면 새 프레임을 시작한다.
+int presence_add(ChatMessage *frames, int n, int room, char op, const char *name) {
+    size_t used = (n > 0) ? strlen(frames[n - 1].content) : BUF_SIZE;
+
+    if (used + strlen(name) + 2 > BUF_SIZE - 1) {
+        if (n == PRESENCE_FRAMES) {
+            return n;
+        }
+        memset(&frames[n], 0, sizeof(ChatMessage));
+        frames[n].type = MSG_PRESENCE;
+        strcpy(frames[n].nickname, rooms[room].name);
+        n++;
+        used = 0;
+    }
+    snprintf(frames[n - 1].content + used, BUF_SIZE - used, "%c%s\n", op, name);
+    return n;
+}
+
+// 틱마다 바뀐 방의 목록을 다시 모아 지난번에 알린 목록과 비교하고, 차이만 묶어서 보낸다.
+// 방을 옮겼거나 새로 구독한 클라이언트에게는 그 방의 전체 목록을 보낸다.
+void presence_flush(long long now) {
+    static char current[PRESENCE_MAX][NICKNAME_SIZE];
+    static ChatMessage frames[PRESENCE_FRAMES];
+    int n;
+
+    if (now - presence_usec < TICK_USEC) {
+        return;
+    }
+    presence_usec = now;
+    presence_pending = 0;
+
+    for (int room = 0; room < MAX_ROOMS; room++) {
+        char (*old)[NICKNAME_SIZE] = presence_names[room];
+        int count, a = 0, b = 0;
+
+        if (!presence_dirty[room]) {
+            continue;
+        }
+        presence_dirty[room] = 0;
+        count = presence_collect(room, current);
+
+        // 정렬된 두 목록을 나란히 훑어 빠진 사람과 새로 온 사람만 뽑는다
+        n = 0;
+        while (a < presence_counts[room] || b < count) {
+            int c = (a == presence_counts[room]) ? 1 : (b == count) ? -1 : strcmp(old[a], current[b]);
+            if (c < 0) {
+                n = presence_add(frames, n, room, '-', old[a++]);
+            } else if (c > 0) {
+                n = presence_add(frames, n, room, '+', current[b++]);
+            } else {
+                a++;
+                b++;
+            }
+        }
+        memcpy(old, current, (size_t)count * NICKNAME_SIZE);
+        presence_counts[room] = count;
+
+        for (int i = 0; i < MAX_CLIENTS && n > 0; i++) {
+            if (client_sockets[i] != -1 && presence_on[i] && presence_room[i] == room && client_rooms[i] == room) {
+                for (int f = 0; f < n; f++) {
+                    send_to_client(i, &frames[f]);
+                }
+                g_stats.presence_diffs += n;
+            }
+        }
+    }
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        int room = client_rooms[i];
+        if (client_sockets[i] == -1 || !presence_on[i] || presence_room[i] == room) {
+            continue;
+        }
+        if (nicknames[i][0] == '\0') {
+            presence_pending = 1; // 닉네임이 정해진 뒤에 보낸다
+            continue;
+        }
+        n = presence_add(frames, 0, room, '=', "");
+        for (int k = 0; k < presence_counts[room]; k++) {
+            n = presence_add(frames, n, room, '=', presence_names[room][k]);
+        }
+        for (int f = 0; f < n; f++) {
+            send_to_client(i, &frames[f]);
+        }
+        presence_room[i] = room;
+        g_stats.presence_full++;
+    }
+}
+
+// 귓속말: content는 "<받는 사람> <내용>". 대화 기록에는 남기지 않는다.
+// 이 서버에 있으면 바로, 다른 서버에 있으면 링크로 넘기고, 아무 데도 없으면 보관한다.
+void dm_send(int client_index, ChatMessage *mesg) {
+    ChatMessage out = {MSG_DIRECT, "", ""};
+    ChatMessage notice = {MSG_DIRECT, "", ""};
+    char to[NICKNAME_SIZE];
+    char *text;
+    size_t len;
+
+    mesg->content[BUF_SIZE - 1] = '\0';
+    text = strchr(mesg->content, ' ');
+    len = text != NULL ? (size_t)(text - mesg->content) : 0;
+    if (len == 0 || len >= NICKNAME_SIZE || text[1] == '\0') {
+        snprintf(notice.content, BUF_SIZE, "사용법: /dm <닉네임> <내용>");
+        send_to_client(client_index, &notice);
+        return;
+    }
+    memcpy(to, mesg->content, len);
+    to[len] = '\0';
+    strcpy(out.nickname, nicknames[client_index]);
+    snprintf(out.content, BUF_SIZE, "%s", text + 1);
+
+    if (!allow_message(client_index, &out) || !filter_message(client_index, &out)) {
+        return;
+    }
+    if (dm_deliver_local(to, &out) > 0) {
+        g_stats.dm_local++;
+        return;
+    }
+    for (int i = 0; i < MAX_REMOTE_USERS; i++) {
+        if (remote_users[i].in_use && strcmp(remote_users[i].nickname, to) == 0) {
+            peer_publish(PEER_DIRECT, to, &out);
+            g_stats.dm_remote++;
+            return;
+        }
+    }
+
+    if (spool_dir == NULL) {
+        snprintf(notice.content, BUF_SIZE, "%s 님은 접속 중이 아닙니다.", to);
+    } else {
+        switch (spool_append(to, &out)) {
+        case SPOOL_STORED:
+            snprintf(notice.content, BUF_SIZE, "%s 님이 접속하면 전달합니다.", to);
+            g_stats.spool_stored++;
+            break;
+        case SPOOL_QUOTA:
+            snprintf(notice.content, BUF_SIZE, "%s 님에게 보관된 메시지가 너무 많아 보내지 못했습니다.", to);
+            g_stats.spool_rejected++;
+            break;
+        default:
+            snprintf(notice.content, BUF_SIZE, "보관 공간이 부족해 %s 님에게 보내지 못했습니다.", to);
+            g_stats.spool_rejected++;
+            break;
+        }
+    }
+    send_to_client(client_index, &notice);
+}
+
+// 닉네임이 같은 이 서버의 클라이언트에게 보낸다. 보낸 수를 돌려준다.
+int dm_deliver_local(const char *nickname, ChatMessage *message) {
+    int n = 0;
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (client_sockets[i] != -1 && strcmp(nicknames[i], nickname) == 0) {
+            send_to_client(i, message);
+            n++;
+        }
+    }
+    return n;
+}
+
+// 닉네임은 어떤 바이트든 올 수 있으므로 16진수로 바꿔 파일 이름으로 쓴다
+void spool_path(const char *nickname, char *path, size_t size) {
+    int len = snprintf(path, size, "%s/", spool_dir);
+
+    for (const unsigned char *p = (const unsigned char *)nickname; *p != '\0' && len + 2 < (int)size; p++) {
+        len += snprintf(path + len, size - len, "%02x", *p);
+    }
+    snprintf(path + len, size - len, SPOOL_SUFFIX);
+}
+
+// 보관 파일을 연다. 첫 레코드의 순번과 레코드 수를 알려준다 (비어 있으면 0).
+// 쓰다 만 마지막 레코드는 버리고, 알아볼 수 없는 파일은 비우고 새로 시작한다.
+int spool_open(const char *path, int create, SpoolHeader *h, uint64_t *first, uint64_t *count) {
+    struct stat st;
+    SpoolRecord rec;
+    int fd;
+
+    *first = 0;
+    *count = 0;
+    if ((fd = open(path, O_RDWR | (create ? O_CREAT : 0), 0600)) < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size < (off_t)sizeof(*h) || pread(fd, h, sizeof(*h), 0) != sizeof(*h)
+        || memcmp(h->magic, SPOOL_MAGIC, 4) != 0 || h->version != SPOOL_VERSION) {
+        memset(h, 0, sizeof(*h));
+        memcpy(h->magic, SPOOL_MAGIC, 4);
+        h->version = SPOOL_VERSION;
+        if (ftruncate(fd, 0) < 0 || pwrite(fd, h, sizeof(*h), 0) != sizeof(*h)) {
+            close(fd);
+            return -1;
+        }
+        spool_bytes += (long long)sizeof(*h) - st.st_size;
+        return fd;
+    }
+
+    *count = (st.st_size - sizeof(*h)) / sizeof(SpoolRecord);
+    off_t whole = sizeof(*h) + *count * sizeof(SpoolRecord);
+    if (whole != st.st_size && ftruncate(fd, whole) == 0) {
+        spool_bytes -= st.st_size - whole;
+    }
+    if (*count > 0) {
+        if (pread(fd, &rec, sizeof(rec), sizeof(*h)) != sizeof(rec)) {
+            close(fd);
+            return -1;
+        }
+        *first = rec.seq;
+    }
+    return fd;
+}
+
+// 받는 사람의 보관 파일 끝에 덧붙인다
+SpoolResult spool_append(const char *nickname, ChatMessage *message) {
+    char path[SPOOL_PATH_SIZE];
+    SpoolHeader h;
+    SpoolRecord rec;
+    uint64_t first, count, done;
+    int fd;
+
+    if (spool_bytes + (long long)sizeof(SpoolRecord) > spool_budget) {
+        return SPOOL_FULL;
+    }
+    spool_path(nickname, path, sizeof(path));
+    if ((fd = spool_open(path, 1, &h, &first, &count)) < 0) {
+        syslog(LOG_ERR, "spool: cannot open %s: %m", path);
+        return SPOOL_ERROR;
+    }
+    done = (count > 0 && h.acked >= first) ? h.acked - first + 1 : 0;
+    if (count - done >= SPOOL_USER_MAX) {
+        close(fd);
+        return SPOOL_QUOTA;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    rec.time = time(NULL);
+    rec.seq = count > 0 ? first + count : h.acked + 1;
+    rec.msg = *message;
+    if (pwrite(fd, &rec, sizeof(rec), sizeof(h) + count * sizeof(rec)) != sizeof(rec)) {
+        syslog(LOG_ERR, "spool: write to %s failed: %m", path);
+        close(fd);
+        return SPOOL_ERROR;
+    }
+    spool_bytes += sizeof(rec);
+    close(fd);
+    return SPOOL_STORED;
+}
+
+// 확인받지 않은 보관 메시지를 SPOOL_BATCH 개씩 묶어 보내고 요약 프레임으로 끝낸다.
+// 클라이언트가 요약의 마지막 순번으로 확인 응답을 보내면 다음 묶음을 보낸다.
+void spool_deliver(int client_index) {
+    char path[SPOOL_PATH_SIZE];
+    SpoolHeader h;
+    SpoolRecord recs[SPOOL_BATCH];
+    ChatMessage summary = {MSG_SPOOL, "", ""};
+    uint64_t first, count, from;
+    int64_t oldest = time(NULL) - SPOOL_EXPIRE_SEC;
+    ssize_t r;
+    int fd, n, sent = 0;
+
+    if (spool_dir == NULL || nicknames[client_index][0] == '\0') {
+        return;
+    }
+    spool_path(nicknames[client_index], path, sizeof(path));
+    if ((fd = spool_open(path, 0, &h, &first, &count)) < 0) {
+        return;
+    }
+    from = (count > 0 && h.acked >= first) ? h.acked - first + 1 : 0;
+    n = count - from < SPOOL_BATCH ? (int)(count - from) : SPOOL_BATCH;
+    r = n > 0 ? pread(fd, recs, n * sizeof(SpoolRecord), sizeof(h) + from * sizeof(SpoolRecord)) : 0;
+    close(fd);
+    if (r < (ssize_t)sizeof(SpoolRecord)) {
+        return;
+    }
+    n = r / sizeof(SpoolRecord);
+
+    for (int i = 0; i < n; i++) {
+        // 기간이 지난 것은 보내지 않는다 (확인 응답을 받으면 같이 지워진다)
+        if (recs[i].time < oldest) {
+            continue;
+        }
+        recs[i].msg.type = MSG_SPOOL;
+        send_to_client(client_index, &recs[i].msg);
+        sent++;
+    }
+    snprintf(summary.content, BUF_SIZE, "%llu %d %llu", (unsigned long long)recs[n - 1].seq, sent,
+             (unsigned long long)(count - from - n));
+    send_to_client(client_index, &summary);
+    g_stats.spool_delivered += sent;
+}
+
+// 받은 데까지 확인 표시를 한다. 다 받았으면 파일을 지우고,
+// 확인받은 레코드가 절반을 넘으면 남은 것만 옮겨 쓴 뒤 다음 묶음을 보낸다.
+void spool_ack(int client_index, uint64_t seq) {
+    char path[SPOOL_PATH_SIZE];
+    SpoolHeader h;
+    uint64_t first, count;
+    int fd;
+
+    if (spool_dir == NULL || nicknames[client_index][0] == '\0') {
+        return;
+    }
+    spool_path(nicknames[client_index], path, sizeof(path));
+    if ((fd = spool_open(path, 0, &h, &first, &count)) < 0) {
+        return;
+    }
+    // 이미 확인했거나 이 파일에 없는 순번 (그사이 지워지고 새로 만들어진 파일)
+    if (count == 0 || seq <= h.acked || seq < first || seq >= first + count) {
+        close(fd);
+        return;
+    }
+
+    if (seq == first + count - 1) {
+        close(fd);
+        if (unlink(path) == 0) {
+            spool_bytes -= sizeof(h) + count * sizeof(SpoolRecord);
+        }
+        return;
+    }
+    h.acked = seq;
+    if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h)) {
+        syslog(LOG_ERR, "spool: cannot update %s: %m", path);
+    } else if (seq - first + 1 > count / 2) {
+        spool_compact(fd, path, &h, first, count);
+    }
+    close(fd);
+    spool_deliver(client_index);
+}
+
+// 확인받지 않은 레코드만 임시 파일에 쓰고 rename()으로 바꾼다
+void spool_compact(int fd, const char *path, SpoolHeader *h, uint64_t first, uint64_t count) {
+    char tmp[SPOOL_PATH_SIZE + 4];
+    uint64_t from = h->acked - first + 1;
+    size_t len = (count - from) * sizeof(SpoolRecord);
+    unsigned char *buf = malloc(len);
+    int out = -1;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (buf == NULL || pread(fd, buf, len, sizeof(*h) + from * sizeof(SpoolRecord)) != (ssize_t)len
+        || (out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0
+        || write(out, h, sizeof(*h)) != sizeof(*h) || write(out, buf, len) != (ssize_t)len
+        || rename(tmp, path) < 0) {
+        syslog(LOG_ERR, "spool: cannot compact %s: %m", path);
+        if (out != -1) {
+            unlink(tmp);
+        }
+    } else {
+        spool_bytes -= from * sizeof(SpoolRecord);
+    }
+    if (out != -1) {
+        close(out);
+    }
+    free(buf);
+}
+
+// 가장 최근 레코드까지 기간이 지난 파일을 지우고 전체 크기를 다시 센다
+void spool_sweep(void) {
+    DIR *dir;
+    struct dirent *de;
+    long long total = 0;
+    int64_t oldest = time(NULL) - SPOOL_EXPIRE_SEC;
+    size_t suffix = strlen(SPOOL_SUFFIX);
+
+    if ((dir = opendir(spool_dir)) == NULL) {
+        syslog(LOG_ERR, "spool: cannot read %s: %m", spool_dir);
+        return;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        char path[SPOOL_PATH_SIZE];
+        size_t nlen = strlen(de->d_name);
+        SpoolRecord last;
+        struct stat st;
+        int fd, expired = 1;
+
+        if (nlen <= suffix || strcmp(de->d_name + nlen - suffix, SPOOL_SUFFIX) != 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", spool_dir, de->d_name);
+        if ((fd = open(path, O_RDONLY)) < 0) {
+            continue;
+        }
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t)(sizeof(SpoolHeader) + sizeof(SpoolRecord))) {
+            off_t n = (st.st_size - sizeof(SpoolHeader)) / sizeof(SpoolRecord);
+            if (pread(fd, &last, sizeof(last), sizeof(SpoolHeader) + (n - 1) * sizeof(SpoolRecord)) == sizeof(last)
+                && last.time >= oldest) {
+                expired = 0;
+            }
+        }
+        close(fd);
+        if (!expired) {
+            total += st.st_size;
+        } else if (unlink(path) == 0) {
+            g_stats.spool_expired++;
+        }
+    }
+    closedir(dir);
+    spool_bytes = total;
+}
+
+// 첨부 파일 요청. data는 뒤따르는 원시 바이트를 받을 준비만 하고 실제로는 attach_receive()가 받는다.
+void attach_request(int client_index, ChatMessage *mesg) {
+    AttachUpload *up = &attach_up[client_index];
+    char name[ATTACH_NAME_SIZE];
+    long long size;
+    unsigned long n;
+    unsigned id;
+    int token;
+
+    mesg->content[BUF_SIZE - 1] = '\0';
+    if (sscanf(mesg->content, "put %d %lld %63[^\n]", &token, &size, name) == 3 && token > 0) {
+        attach_put(client_index, token, size, name);
+    } else if (sscanf(mesg->content, "data %d %lu", &token, &n) == 2) {
+        if (n > ATTACH_CHUNK) {
+            // 원시 바이트가 어디서 끝나는지 믿을 수 없으니 연결을 끊는다
+            syslog(LOG_WARNING, "client %d: attachment chunk too large (%lu)", client_index, n);
+            close_client_connection(client_index);
+            return;
+        }
+        // 올리는 중인 파일과 맞지 않는 조각도 스트림을 맞추려면 받아서 버려야 한다
+        up->left = n;
+        up->discard = up->token == 0 || token != up->token || up->slot < 0
+                      || attachments[up->slot].received + (off_t)n > attachments[up->slot].size;
+        if (n == 0) {
+            attach_chunk_done(client_index);
+        }
+    } else if (sscanf(mesg->content, "get %u", &id) == 1) {
+        attach_get(client_index, id);
+    }
+}
+
+// 올리기 시작: 크기만큼 자리를 잡아 두고 조각을 기다린다
+void attach_put(int client_index, int token, long long size, const char *name) {
+    AttachUpload *up = &attach_up[client_index];
+    Attachment *a;
+    char path[SPOOL_PATH_SIZE];
+    int slot, fd;
+
+    if (up->token != 0 && up->slot >= 0) {
+        attach_free(up->slot); // 끝내지 않고 새로 시작한 올리기
+    }
+    // 토큰은 자리를 잡은 뒤에 건다. 거절한 올리기의 조각은 토큰이 없으니 버려지고,
+    // 인계(handoff_to)도 올리는 중인 연결로 보고 넘기지 않는 일이 없다.
+    up->token = 0;
+    up->slot = -1;
+    if (attach_dir == NULL) {
+        attach_notify(client_index, "이 서버는 첨부 파일을 받지 않습니다.");
+        return;
+    }
+    if (size <= 0 || size > attach_budget || (slot = attach_alloc(size)) < 0) {
+        attach_notify(client_index, "첨부 파일 공간이 부족합니다.");
+        g_stats.attach_rejected++;
+        return;
+    }
+
+    // 이름 없는 임시 파일: 서버가 죽어도 남지 않는다
+    snprintf(path, sizeof(path), "%s/attach.XXXXXX", attach_dir);
+    if ((fd = mkstemp(path)) < 0) {
+        syslog(LOG_ERR, "attach: cannot create temp file in %s: %m", attach_dir);
+        attach_notify(client_index, "첨부 파일을 저장할 수 없습니다.");
+        return;
+    }
+    unlink(path);
+    if (posix_fallocate(fd, 0, size) != 0) {
+        close(fd);
+        attach_notify(client_index, "첨부 파일 공간이 부족합니다.");
+        g_stats.attach_rejected++;
+        return;
+    }
+
+    a = &attachments[slot];
+    memset(a, 0, sizeof(*a));
+    a->fd = fd;
+    a->id = attach_next_id++;
+    a->size = size;
+    a->uploading = 1;
+    strcpy(a->owner, nicknames[client_index]);
+    // 받는 쪽에서 파일 이름으로 쓰므로 경로와 제어 문자를 뺀다
+    const char *base = strrchr(name, '/') != NULL ? strrchr(name, '/') + 1 : name;
+    for (size_t i = 0, o = 0; base[i] != '\0' && o < ATTACH_NAME_SIZE - 1; i++) {
+        a->name[o++] = (unsigned char)base[i] < 0x20 ? '_' : base[i];
+    }
+    if (a->name[0] == '\0' || strcmp(a->name, ".") == 0 || strcmp(a->name, "..") == 0) {
+        strcpy(a->name, "file");
+    }
+    attach_bytes += size;
+    up->token = token;
+    up->slot = slot;
+}
+
+// 다 받은 첨부 파일을 이 클라이언트의 다운로드 목록에 넣는다
+void attach_get(int client_index, uint32_t id) {
+    ChatMessage begin = {MSG_FILE, "", ""};
+    Attachment *a = NULL;
+    int slot;
+
+    for (slot = 0; slot < ATTACH_MAX; slot++) {
+        if (attachments[slot].fd != -1 && attachments[slot].id == id && !attachments[slot].uploading) {
+            a = &attachments[slot];
+            break;
+        }
+    }
+    if (a == NULL) {
+        attach_notify(client_index, "없는 첨부 파일입니다.");
+        return;
+    }
+    if (attach_ndown[client_index] == ATTACH_DOWNLOADS) {
+        attach_notify(client_index, "동시에 받을 수 있는 파일 수를 넘었습니다.");
+        return;
+    }
+    attach_down[client_index][attach_ndown[client_index]].slot = slot;
+    attach_down[client_index][attach_ndown[client_index]].off = 0;
+    attach_ndown[client_index]++;
+    a->readers++;
+
+    strcpy(begin.nickname, a->owner);
+    snprintf(begin.content, BUF_SIZE, "begin %u %lld %s", a->id, (long long)a->size, a->name);
+    send_to_client(client_index, &begin);
+}
+
+void attach_notify(int client_index, const char *text) {
+    ChatMessage notice = {MSG_FILE, "", ""};
+
+    snprintf(notice.content, BUF_SIZE, "error %s", text);
+    send_to_client(client_index, &notice);
+}
+
+// size 바이트를 둘 빈 칸을 찾는다. 모자라면 아무도 받고 있지 않은 오래된 것부터 지운다.
+int attach_alloc(long long size) {
+    int slot = -1;
+
+    for (;;) {
+        int oldest = -1;
+        slot = -1;
+        for (int i = 0; i < ATTACH_MAX; i++) {
+            Attachment *a = &attachments[i];
+            if (a->fd == -1) {
+                slot = slot < 0 ? i : slot;
+            } else if (!a->uploading && a->readers == 0 && (oldest < 0 || a->usec < attachments[oldest].usec)) {
+                oldest = i;
+            }
+        }
+        if (slot >= 0 && attach_bytes + size <= attach_budget) {
+            return slot;
+        }
+        if (oldest < 0) {
+            return -1;
+        }
+        attach_free(oldest);
+        g_stats.attach_evicted++;
+    }
+}
+
+void attach_free(int slot) {
+    Attachment *a = &attachments[slot];
+
+    if (a->fd == -1) {
+        return;
+    }
+    close(a->fd);
+    a->fd = -1;
+    attach_bytes -= a->size;
+}
+
+// 이미 받아 둔 바이트로 지금 조각을 채운다 (압축 연결의 수신 버퍼에 딸려 온 것). 쓴 바이트 수를 돌려준다.
+size_t attach_take(int client_index, const unsigned char *buf, size_t len) {
+    AttachUpload *up = &attach_up[client_index];
+    size_t n = len < up->left ? len : up->left;
+
+    if (n == 0) {
+        return 0;
+    }
+    if (!up->discard) {
+        Attachment *a = &attachments[up->slot];
+        if (pwrite(a->fd, buf, n, a->received) != (ssize_t)n) {
+            syslog(LOG_ERR, "attach: write failed: %m");
+        }
+        a->received += n;
+    }
+    up->left -= n;
+    if (up->left == 0) {
+        attach_chunk_done(client_index);
+    }
+    return n;
+}
+
+// 소켓에서 파이프를 거쳐 파일로 옮긴다. 한 번에 한 조각까지만 받아 다른 연결을 기다리게 하지 않는다.
+void attach_receive(int client_index) {
+    AttachUpload *up = &attach_up[client_index];
+    Attachment *a = up->discard ? NULL : &attachments[up->slot];
+    ssize_t n;
+
+    if (attach_pipe[0] == -1 && pipe(attach_pipe) < 0) {
+        syslog(LOG_ERR, "attach: pipe: %m");
+        close_client_connection(client_index);
+        return;
+    }
+    if (a == NULL) {
+        // 버릴 조각은 그냥 읽어 버린다
+        static unsigned char scratch[ATTACH_CHUNK];
+        n = recv(client_sockets[client_index], scratch, up->left, MSG_DONTWAIT);
+        if (n > 0) {
+            attach_take(client_index, scratch, n);
+        }
+    } else {
+        n = splice(client_sockets[client_index], NULL, attach_pipe[1], NULL, up->left,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        for (ssize_t moved = 0; n > 0 && moved < n;) {
+            loff_t off = a->received;
+            ssize_t m = splice(attach_pipe[0], NULL, a->fd, &off, n - moved, SPLICE_F_MOVE);
+            if (m <= 0) {
+                // 파이프에 남은 바이트는 다음 조각과 섞이므로 연결을 끊는다
+                syslog(LOG_ERR, "attach: splice to file failed: %m");
+                close_client_connection(client_index);
+                return;
+            }
+            moved += m;
+            a->received += m;
+            up->left -= m;
+            g_stats.attach_in += m;
+        }
+        if (n > 0 && up->left == 0) {
+            attach_chunk_done(client_index);
+        }
+    }
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        close_client_connection(client_index);
+    } else if (n > 0) {
+        heartbeat_touch(client_index);
+    }
+}
+
+// 한 조각을 다 받았다. 파일을 다 받았으면 방에 알린다.
+void attach_chunk_done(int client_index) {
+    AttachUpload *up = &attach_up[client_index];
+    Attachment *a;
+    ChatMessage notice = {MSG_FILE, "", ""};
+
+    if (up->discard || up->slot < 0) {
+        return;
+    }
+    a = &attachments[up->slot];
+    if (a->received < a->size) {
+        return;
+    }
+    a->uploading = 0;
+    a->usec = now_usec();
+    up->token = 0;
+    up->slot = -1;
+    g_stats.attach_uploads++;
+
+    strcpy(notice.nickname, a->owner);
+    snprintf(notice.content, BUF_SIZE, "new %u %lld %s", a->id, (long long)a->size, a->name);
+    send_to_room(&notice, client_rooms[client_index], -1);
+}
+
+int attach_busy(int client_index) {
+    return attach_tx[client_index].hdr.len != 0;
+}
+
+// 조각 하나를 보낸다: 머리 프레임을 보내고 원시 바이트를 sendfile()로 잇는다.
+// 밀린 채팅 프레임이 있으면 조각을 시작하지 않으므로 채팅은 많아야 한 조각만 기다린다.
+void attach_send(int client_index) {
+    AttachChunk *c = &attach_tx[client_index];
+    int sock = client_sockets[client_index];
+    ssize_t n;
+
+    if (!attach_busy(client_index)) {
+        int unsent = 0;
+        if (out_queues[client_index].count > 0 || attach_ndown[client_index] == 0) {
+            return;
+        }
+        // 앞 조각이 아직 소켓 버퍼에 남아 있으면 기다린다. 버퍼에 쌓인 만큼 뒤에 오는 채팅이 늦어진다.
+        if (ioctl(sock, SIOCOUTQ, &unsent) == 0 && unsent > ATTACH_INFLIGHT - ATTACH_CHUNK) {
+            return;
+        }
+        // 받는 중인 파일들을 돌아가며 한 조각씩
+        int k = attach_rr[client_index]++ % attach_ndown[client_index];
+        AttachDownload *d = &attach_down[client_index][k];
+        Attachment *a = &attachments[d->slot];
+        ChatMessage hdr = {MSG_FILE, "", ""};
+        size_t len = a->size - d->off < ATTACH_CHUNK ? (size_t)(a->size - d->off) : ATTACH_CHUNK;
+
+        snprintf(hdr.content, BUF_SIZE, "data %u %lld %zu", a->id, (long long)d->off, len);
+        c->hdr = *encode_frame(client_zlevel[client_index], &hdr);
+        c->hdr_sent = 0;
+        c->slot = d->slot;
+        c->off = d->off;
+        c->left = len;
+        d->off += len;
+        c->last = d->off == a->size;
+        if (c->last) {
+            attach_down[client_index][k] = attach_down[client_index][--attach_ndown[client_index]];
+        }
+    }
+
+    while (c->hdr_sent < c->hdr.len) {
+        n = send(sock, c->hdr.data + c->hdr_sent, c->hdr.len - c->hdr_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n <= 0) {
+            return; // 소켓 버퍼가 찼거나 끊겼다 (끊긴 것은 수신 쪽에서 정리한다)
+        }
+        c->hdr_sent += n;
+        g_stats.send_calls++;
+    }
+    while (c->left > 0) {
+        n = sendfile(sock, attachments[c->slot].fd, &c->off, c->left);
+        if (n <= 0) {
+            return;
+        }
+        c->left -= n;
+        g_stats.attach_out += n;
+        g_stats.send_calls++;
+    }
+
+    g_stats.attach_chunks++;
+    g_stats.frames_out++;
+    if (c->last) {
+        attachments[c->slot].readers--;
+        g_stats.attach_downloads++;
+    }
+    c->hdr.len = 0;
+    // 조각을 보내는 동안 쌓인 채팅 프레임을 바로 내보낸다
+    flush_client(client_index);
+}
+
+// 다 올린 지 오래된 첨부 파일을 지우고, 연결마다 한 조각씩 보낸다
+void attach_poll(long long now) {
+    for (int i = 0; i < ATTACH_MAX; i++) {
+        Attachment *a = &attachments[i];
+        if (a->fd != -1 && !a->uploading && a->readers == 0 && now - a->usec >= ATTACH_EXPIRE_USEC) {
+            attach_free(i);
+        }
+    }
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (client_sockets[i] != -1 && !tls_pending[i] && (attach_busy(i) || attach_ndown[i] > 0)) {
+            attach_send(i);
+        }
+    }
+}
+
+// 연결이 끊기면 올리던 파일은 버리고 받던 파일의 사용 표시를 푼다
+void attach_reset(int client_index) {
+    AttachUpload *up = &attach_up[client_index];
+
+    if (up->token != 0 && up->slot >= 0) {
+        attach_free(up->slot);
+    }
+    memset(up, 0, sizeof(*up));
+    up->slot = -1;
+    for (int k = 0; k < attach_ndown[client_index]; k++) {
+        attachments[attach_down[client_index][k].slot].readers--;
+    }
+    attach_ndown[client_index] = 0;
+    if (attach_busy(client_index) && attach_tx[client_index].last) {
+        attachments[attach_tx[client_index].slot].readers--;
+    }
+    attach_tx[client_index].hdr.len = 0;
+}
+
+// 알림 구독 요청: 켜고 끄기, 키워드 추가/삭제, 목록
+void watch_request(int client_index, ChatMessage *mesg) {
+    char *text = mesg->content;
+    char *room, *end;
+    int *count = &watch_counts[client_index];
+    char reply[BUF_SIZE];
+    int k;
+
+    text[BUF_SIZE - 1] = '\0';
+    if ((end = strchr(text, '\n')) != NULL) {
+        *end = '\0';
+    }
+    if (strcmp(text, "on") == 0 || strcmp(text, "off") == 0) {
+        watch_on[client_index] = text[1] == 'n';
+        watch_dirty = 1;
+        return;
+    }
+    if (strcmp(text, "list") == 0) {
+        size_t len = snprintf(reply, sizeof(reply), "알림 키워드 %d개:", *count);
+        for (k = 0; k < *count && len < sizeof(reply); k++) {
+            const char *room_glob = watch_rooms[client_index][k];
+            len += snprintf(reply + len, sizeof(reply) - len, room_glob[0] != '\0' ? " %s(%s)" : " %s",
+                            watch_keywords[client_index][k], room_glob);
+        }
+        watch_reply(client_index, reply);
+        return;
+    }
+    if (text[0] != '+' && text[0] != '-') {
+        watch_reply(client_index, "사용법: +<키워드> [room:<방 패턴>], -<키워드>, list");
+        return;
+    }
+
+    // "+키워드 room:패턴"에서 방 패턴을 떼어 내고 앞뒤 공백을 지운다
+    if ((room = strstr(text, " room:")) != NULL) {
+        *room = '\0';
+        room += 6;
+    }
+    char *keyword = text + 1;
+    while (*keyword == ' ') {
+        keyword++;
+    }
+    end = keyword + strlen(keyword);
+    while (end > keyword && end[-1] == ' ') {
+        *--end = '\0';
+    }
+    if (end - keyword < 2 || end - keyword >= WATCH_PATTERN_SIZE
+        || (room != NULL && (room[0] == '\0' || strlen(room) >= ROOM_NAME_SIZE))) {
+        snprintf(reply, sizeof(reply), "키워드는 2~%d바이트, 방 패턴은 %d바이트까지입니다.",
+                 WATCH_PATTERN_SIZE - 1, ROOM_NAME_SIZE - 1);
+        watch_reply(client_index, reply);
+        return;
+    }
+
+    // 오토마톤이 영문 대소문자를 구분하지 않으므로 같은 키워드도 그렇게 찾는다
+    for (k = 0; k < *count && strcasecmp(watch_keywords[client_index][k], keyword) != 0; k++) {
+    }
+    if (text[0] == '-') {
+        if (k == *count) {
+            snprintf(reply, sizeof(reply), "구독하지 않은 키워드입니다: %s", keyword);
+        } else {
+            (*count)--;
+            memmove(watch_keywords[client_index][k], watch_keywords[client_index][k + 1],
+                    (size_t)(*count - k) * WATCH_PATTERN_SIZE);
+            memmove(watch_rooms[client_index][k], watch_rooms[client_index][k + 1], (size_t)(*count - k) * ROOM_NAME_SIZE);
+            snprintf(reply, sizeof(reply), "알림 키워드를 지웠습니다: %s", keyword);
+            watch_dirty = 1;
+        }
+    } else if (k == WATCH_MAX) {
+        snprintf(reply, sizeof(reply), "알림 키워드는 %d개까지 구독할 수 있습니다.", WATCH_MAX);
+    } else {
+        if (k == *count) {
+            (*count)++;
+        }
+        strcpy(watch_keywords[client_index][k], keyword);
+        strcpy(watch_rooms[client_index][k], room != NULL ? room : "");
+        snprintf(reply, sizeof(reply), "알림 키워드를 구독합니다: %s%s%s", keyword, room != NULL ? " (방 " : "",
+                 room != NULL ? room : "");
+        if (room != NULL) {
+            strcat(reply, ")");
+        }
+        watch_on[client_index] = 1;
+        watch_dirty = 1;
+    }
+    watch_reply(client_index, reply);
+}
+
+void watch_reply(int client_index, const char *text) {
+    ChatMessage reply = {MSG_WATCH, "", ""};
+    strncpy(reply.content, text, BUF_SIZE - 1);
+    send_to_client(client_index, &reply);
+}
+
+int watch_compare(const void *a, const void *b) {
+    return strcasecmp(((const WatchEntry *)a)->pattern, ((const WatchEntry *)b)->pattern);
+}
+
+// 모든 클라이언트의 구독을 모아 같은 패턴끼리 묶고 오토마톤을 다시 만든다
+void watch_rebuild(void) {
+    static WatchEntry entries[MAX_CLIENTS * (WATCH_MAX + 1)];
+    static const char *patterns[MAX_CLIENTS * (WATCH_MAX + 1)];
+    static FilterRule rules[MAX_CLIENTS * (WATCH_MAX + 1)];
+    static char mentions[MAX_CLIENTS][NICKNAME_SIZE + 1];
+    uint32_t n = 0, npatterns = 0;
+
+    watch_dirty = 0;
+    g_stats.watch_rebuilds++;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (client_sockets[i] == -1 || !watch_on[i] || nicknames[i][0] == '\0') {
+            continue;
+        }
+        snprintf(mentions[i], sizeof(mentions[i]), "@%.*s", NICKNAME_SIZE - 1, nicknames[i]);
+        entries[n].pattern = mentions[i];
+        entries[n].sub.client = i;
+        entries[n++].sub.slot = -1;
+        for (int k = 0; k < watch_counts[i]; k++) {
+            entries[n].pattern = watch_keywords[i][k];
+            entries[n].sub.client = i;
+            entries[n++].sub.slot = k;
+        }
+    }
+    qsort(entries, n, sizeof(WatchEntry), watch_compare);
+
+    free(watch_starts);
+    free(watch_subs);
+    free(watch_table);
+    watch_table = NULL;
+    watch_starts = malloc(sizeof(uint32_t) * (n + 1));
+    watch_subs = malloc(sizeof(WatchSub) * (n + 1));
+    if (watch_starts == NULL || watch_subs == NULL) {
+        syslog(LOG_ERR, "watch: out of memory");
+        return;
+    }
+    for (uint32_t e = 0; e < n; e++) {
+        if (e == 0 || strcasecmp(entries[e].pattern, entries[e - 1].pattern) != 0) {
+            watch_starts[npatterns] = e;
+            patterns[npatterns] = entries[e].pattern;
+            rules[npatterns].action = FILTER_FLAG;
+            rules[npatterns].len = strlen(entries[e].pattern);
+            rules[npatterns].line = 0;
+            npatterns++;
+        }
+        watch_subs[e] = entries[e].sub;
+    }
+    watch_starts[npatterns] = n;
+    if (npatterns > 0 && (watch_table = filter_build(patterns, rules, npatterns)) == NULL) {
+        syslog(LOG_ERR, "watch: cannot build automaton for %u patterns", npatterns);
+    }
+}
+
+// 메시지를 한 번 훑어 걸린 패턴의 구독자마다 알림을 보낸다 (sender_index가 -1이면 다른 서버에서 온 메시지)
+void watch_scan(int sender_index, const char *room, ChatMessage *message) {
+    if (watch_dirty) {
+        watch_rebuild();
+    }
+    if (watch_table == NULL) {
+        return;
+    }
+
+    const FilterTable *t = watch_table;
+    const uint32_t *delta = FILTER_DELTA(t);
+    const int32_t *match = FILTER_MATCH(t);
+    const int32_t *link = FILTER_LINK(t);
+    const char *text = message->content;
+    size_t len = strnlen(text, BUF_SIZE);
+    long long start = cpu_nsec();
+    uint32_t s = 0;
+
+    watch_serial++;
+    for (size_t i = 0; i < len; i++) {
+        s = delta[(s & ~FILTER_HIT) + t->classes[(unsigned char)text[i]]];
+        if (!(s & FILTER_HIT)) {
+            continue;
+        }
+        // 언급은 닉네임이 끝나는 곳에서만 인정한다 (@bob이 @bobby에 걸리지 않게)
+        unsigned char next = i + 1 < len ? text[i + 1] : '\0';
+        int boundary = !(isalnum(next) || next == '_');
+        int32_t state = (s & ~FILTER_HIT) / t->nclasses;
+        for (int32_t m = match[state] >= 0 ? state : link[state]; m > 0; m = link[m]) {
+            for (uint32_t k = watch_starts[match[m]]; k < watch_starts[match[m] + 1]; k++) {
+                if (watch_subs[k].slot >= 0 || boundary) {
+                    watch_notify(&watch_subs[k], sender_index, room, message);
+                }
+            }
+        }
+    }
+    g_stats.watch_scans++;
+    g_stats.watch_bytes += len;
+    g_stats.watch_nsec += cpu_nsec() - start;
+}
+
+void watch_notify(const WatchSub *sub, int sender_index, const char *room, ChatMessage *message) {
+    int c = sub->client;
+    ChatMessage note = {MSG_WATCH, "", ""};
+
+    // 한 메시지에 여러 키워드가 걸려도 알림은 한 번, 자기 메시지는 알리지 않는다
+    if (watch_stamp[c] == watch_serial || c == sender_index || client_sockets[c] == -1
+        || strcmp(nicknames[c], message->nickname) == 0) {
+        return;
+    }
+    if (sub->slot >= 0 && watch_rooms[c][sub->slot][0] != '\0' && fnmatch(watch_rooms[c][sub->slot], room, 0) != 0) {
+        return;
+    }
+    watch_stamp[c] = watch_serial;
+    memcpy(note.nickname, message->nickname, NICKNAME_SIZE);
+    note.nickname[NICKNAME_SIZE - 1] = '\0';
+    int n = snprintf(note.content, BUF_SIZE, "%s\n", room);
+    strncpy(note.content + n, message->content, BUF_SIZE - 1 - n);
+    send_to_client(c, &note);
+    g_stats.watch_notified++;
+}
+
+// 새 연결을 받을지 정한다. 토큰이 있고 루프가 밀리지 않았으면 받는다 (토큰은 여기서 꺼낸다).
+// 아니면 listen 대기열에 여유가 있는 동안은 미루고, 넘칠 지경이거나 자리가 없으면 거절한다.
+// 세션 하나를 더 만들면 메모리 상한(-m)을 넘을 때도 거절한다 (연결이 줄어야 풀리므로 미루지 않는다).
+AdmitDecision admit_check(int ssock, int *retry_msec, const char **reason) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    int overloaded = admit_lag_usec > 0 && loop_lag_usec > admit_lag_usec;
+    unsigned queued = 0, limit = 0;
+
+    if (mem_over(session_estimate())) {
+        *retry_msec = ADMIT_FULL_RETRY_MSEC;
+        *reason = "memory";
+        return ADMIT_REJECT;
+    }
+    if (g_noc < MAX_CLIENTS && !overloaded
+        && (admit_limit.msgs_per_sec <= 0 || bucket_take(&admit_bucket, &admit_limit, 0))) {
+        return ADMIT_ACCEPT;
+    }
+    if (g_noc >= MAX_CLIENTS) {
+        *retry_msec = ADMIT_FULL_RETRY_MSEC;
+        *reason = "full";
+        return ADMIT_REJECT;
+    }
+
+    // 리스닝 소켓의 tcpi_unacked는 accept를 기다리는 연결 수, tcpi_sacked는 대기열 길이다
+    if (getsockopt(ssock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+        queued = info.tcpi_unacked;
+        limit = info.tcpi_sacked;
+    }
+    if (queued > g_stats.admit_queue_max) {
+        g_stats.admit_queue_max = queued;
+    }
+    if (queued < limit / 4 * 3) {
+        return ADMIT_DEFER;
+    }
+
+    // 밀린 연결을 지금 속도로 다 받는 데 걸리는 시간 뒤에 다시 오라고 한다
+    double rate = admit_limit.msgs_per_sec > 0 ? admit_limit.msgs_per_sec : ADMIT_RATE;
+    long long wait = ADMIT_RETRY_MSEC + (long long)(queued * 1000 / rate);
+    *retry_msec = wait < ADMIT_RETRY_MAX_MSEC ? wait : ADMIT_RETRY_MAX_MSEC;
+    return ADMIT_REJECT;
+}
+
+// 세션을 만들지 않고 재시도 시각만 알려 주고 끊는다. 클라이언트가 먼저 보낸 닉네임 프레임을
+// 읽지 않은 채 닫으면 RST가 나가 알림이 사라질 수 있으므로 받은 것을 비우고 닫는다.
+// TLS 연결은 핸드셰이크 전이라 평문 프레임을 보낼 수 없으므로 그냥 끊는다.
+void admit_reject(int csock, int retry_msec, const char *reason) {
+    ChatMessage retry = {MSG_RETRY, "", ""};
+    char drain[512];
+
+    if (tls_ctx == NULL) {
+        snprintf(retry.content, BUF_SIZE, "%d %s", retry_msec, reason);
+        send(csock, &retry, sizeof(retry), MSG_DONTWAIT);
+    }
+    shutdown(csock, SHUT_WR);
+    while (recv(csock, drain, sizeof(drain), MSG_DONTWAIT) > 0) {
+    }
+    close(csock);
+    g_stats.admit_rejected++;
+    if (strcmp(reason, "memory") == 0) {
+        g_stats.mem_rejected++;
+    }
+}
+
+// 크기별 풀에서 블록을 빌린다. 돌려받아 둔 것이 없을 때만 malloc()한다.
+void *pool_alloc(PoolClass c) {
+    MemPool *p = &pools[c];
+    PoolBlock *b = p->free_list;
+
+    if (b != NULL) {
+        p->free_list = b->next;
+        p->nfree--;
+        if (p->nfree < p->low) {
+            p->low = p->nfree;
+        }
+    } else if ((b = malloc(p->size)) == NULL) {
+        return NULL;
+    } else {
+        p->allocs++;
+    }
+    p->used++;
+    return b;
+}
+
+void pool_free(PoolClass c, void *block) {
+    MemPool *p = &pools[c];
+    PoolBlock *b = block;
+
+    if (b == NULL) {
+        return;
+    }
+    b->next = p->free_list;
+    p->free_list = b;
+    p->nfree++;
+    p->used--;
+}
+
+// 지난 주기 동안 한 번도 꺼내지 않은 만큼 돌려준다. 접속이 몰렸다 빠지면 몇 주기에 걸쳐 줄어든다.
+void pool_trim(void) {
+    int trimmed = 0;
+
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        MemPool *p = &pools[c];
+        for (unsigned long n = p->low; n > 0 && p->free_list != NULL; n--) {
+            PoolBlock *b = p->free_list;
+            p->free_list = b->next;
+            free(b);
+            p->nfree--;
+            p->trimmed++;
+            trimmed = 1;
+        }
+        p->low = p->nfree;
+    }
+    if (trimmed) {
+        // 작은 블록은 힙 안에 남으므로 비어 있는 페이지를 운영체제에 돌려준다
+        malloc_trim(0);
+    }
+}
+
+// 송신 대기열이 need칸을 담을 수 있게 한다. 처음 빌리는 가장 작은 칸은 메모리 상한과 상관없이
+// 빌려 주고 (부분 전송한 프레임을 들고 있어야 한다), 더 키우는 것은 상한을 넘지 않을 때만 한다.
+int outq_reserve(int client_index, int need) {
+    OutQueue *q = &out_queues[client_index];
+    WireFrame *frames;
+    int c = 0, old = 0;
+
+    if (need <= q->cap) {
+        return 0;
+    } else if (need > OUTQ_SIZE) {
+        return -1;
+    }
+    while (outq_caps[c] < need) {
+        c++;
+    }
+    if (q->cap > 0 && mem_over(pools[c].size)) {
+        g_stats.mem_shed++;
+        return -1;
+    }
+    if ((frames = pool_alloc(c)) == NULL) {
+        return -1;
+    }
+    if (q->cap > 0) {
+        memcpy(frames, q->frames, q->count * sizeof(WireFrame));
+        while (outq_caps[old] != q->cap) {
+            old++;
+        }
+        pool_free(old, q->frames);
+    }
+    q->frames = frames;
+    q->cap = outq_caps[c];
+    return 0;
+}
+
+// 대기열을 비우고 칸을 풀에 돌려준다
+void outq_release(int client_index) {
+    OutQueue *q = &out_queues[client_index];
+    int c = 0;
+
+    if (q->cap > 0) {
+        while (outq_caps[c] != q->cap) {
+            c++;
+        }
+        pool_free(c, q->frames);
+    }
+    q->frames = NULL;
+    q->cap = 0;
+    q->count = 0;
+    q->sent_bytes = 0;
+    q->urgent_end = 0;
+}
+
+// 연결 하나가 늘 차지하는 고정 레코드 (클라이언트 번호로 찾는 배열의 한 칸씩)
+size_t session_record_bytes(void) {
+    return (sizeof(client_sockets) + sizeof(pipes_to_child) + sizeof(pipes_to_parent) + sizeof(nicknames)
+            + sizeof(child_pids) + sizeof(out_queues) + sizeof(client_rooms) + sizeof(client_buckets)
+            + sizeof(throttle_notified) + sizeof(throttle_counts) + sizeof(timers) + sizeof(ping_pending)
+            + sizeof(capture_ids) + sizeof(inbox) + sizeof(inbox_ready) + sizeof(tls_pending)
+            + sizeof(client_zlevel) + sizeof(rx_bufs) + sizeof(rx_lens) + sizeof(presence_on)
+            + sizeof(presence_room) + sizeof(attach_up) + sizeof(attach_down) + sizeof(attach_ndown)
+            + sizeof(attach_rr) + sizeof(attach_tx) + sizeof(watch_on) + sizeof(watch_keywords)
+            + sizeof(watch_rooms) + sizeof(watch_counts) + sizeof(watch_stamp) + sizeof(child_mem)
+            + sizeof(eph_on) + sizeof(typing_until) + sizeof(typing_shown) + sizeof(eph_pending))
+           / MAX_CLIENTS;
+}
+
+// 세션을 하나 더 만들면 늘어날 메모리: 레코드와 대기열 가장 작은 칸, 세션 자식 프로세스 평균
+long long session_estimate(void) {
+    long long bytes = session_record_bytes() + pools[POOL_OUTQ_S].size;
+    int children = 0;
+
+    if (!lean_sessions) {
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            children += child_pids[i] != -1;
+        }
+        if (children > 0) {
+            bytes += child_mem_total / children;
+        }
+    }
+    return bytes;
+}
+
+// 풀이 들고 있는 메모리 (빌려 준 것과 돌려받아 둔 것)
+long long mem_pooled(void) {
+    long long bytes = 0;
 
-// 시그널 처리를 위한 플래그
-volatile sig_atomic_t sigusr1_received = 0; // 새 클라이언트 연결 시그널
-volatile sig_atomic_t sigusr2_received = 0; // 클라이언트 연결 종료 시그널
-volatile sig_atomic_t all_childr_terminated = 0; // 모든 자식 프로세스 종료 확인
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        bytes += (long long)(pools[c].used + pools[c].nfree) * pools[c].size;
+    }
+    return bytes;
+}
 
-void sigchld_handler(int s);
-void sigusr1_handler(int signo);
-void sigusr2_handler(int signo);
-void set_nonblocking(int sock);
-void send_message(ChatMessage *message, int sender_index);
-void handle_client(int client_index);
-void close_client_connection(int client_index);
+long long mem_total(void) {
+    return (long long)session_record_bytes() * g_noc + mem_pooled() + child_mem_total;
+}
 
-int main(int argc, char **argv) {
-    int ssock, portno;
-    socklen_t clen;
-    struct sockaddr_in servaddr, cliaddr;
-    struct sigaction sa_chld, sa_usr1, sa_usr2, sa;
-    struct rlimit rl;
-    int fd0, fd1, fd2, i;
-    pid_t pid;
+// 연결 하나가 지금 쓰는 메모리
+long long mem_client(int client_index) {
+    return session_record_bytes() + (long long)out_queues[client_index].cap * sizeof(WireFrame)
+           + (rx_bufs[client_index] != NULL ? RX_BUF_SIZE : 0) + child_mem[client_index];
+}
 
-    // 데몬 서버 설정
-    umask(0);
+// extra 바이트를 더 쓰면 메모리 상한(-m)을 넘는지
+int mem_over(long long extra) {
+    return mem_budget > 0 && mem_total() + extra > mem_budget;
+}
 
-    if(getrlimit(RLIMIT_NOFILE, &rl) < 0){
-        perror("getlimit()");
-    }
+// 자식 프로세스만 쓰는 메모리: 복사 중 쓰기로 갈라진 페이지와 스택(smaps_rollup의 Private_*),
+// 그리고 페이지 표(VmPTE). 부모와 함께 쓰는 페이지는 넣지 않는다. (커널 스택 등은 빠진다)
+long long child_private_bytes(pid_t pid) {
+    char path[64], line[128];
+    long long kb = 0, n;
+    FILE *fp;
 
-    if((pid = fork()) < 0){
-        perror("error()");
-    } else if(pid != 0){
-        return 0;
+    snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", (int)pid);
+    if ((fp = fopen(path, "r")) != NULL) {
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            if (sscanf(line, "Private_Clean: %lld", &n) == 1 || sscanf(line, "Private_Dirty: %lld", &n) == 1) {
+                kb += n;
+            }
+        }
+        fclose(fp);
     }
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    if ((fp = fopen(path, "r")) != NULL) {
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            if (sscanf(line, "VmPTE: %lld", &n) == 1) {
+                kb += n;
+            }
+        }
+        fclose(fp);
+    }
+    return kb * 1024;
+}
 
-    setsid();
-
-    sa.sa_handler = SIG_IGN;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
-    if(sigaction(SIGHUP, &sa, NULL) < 0){
-        perror("sigaction() : Can't ignore SIGHUP");
+// 자식 프로세스(세션, -L이면 잠깐 띄운 것)의 메모리를 다시 잰다
+void mem_sample(void) {
+    child_mem_total = 0;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        child_mem[i] = child_pids[i] != -1 ? child_private_bytes(child_pids[i]) : 0;
+        child_mem_total += child_mem[i];
     }
+}
 
-    if(chdir("/") < 0){
-        perror("cd()");
+// 클라이언트가 보낸 프레임을 세션에 넘긴다. 보통은 세션 자식 프로세스에 쓰고,
+// -L이면 자식이 하던 일(handle_client)을 여기서 하고 자식이 돌려줄 프레임을 바로 처리한다.
+void session_frame(int client_index, ChatMessage *mesg) {
+    if (!lean_sessions) {
+        write(pipes_to_child[client_index][1], mesg, sizeof(ChatMessage));
+        return;
     }
 
-    if(rl.rlim_max == RLIM_INFINITY){
-        rl.rlim_max = 1024;
+    // 아래에서 route_child_message()로 바로 넘기므로 자식만 보내는 세션 알림은 여기서 막는다
+    if (mesg->type == MSG_SESSION) {
+        return;
     }
 
-    for(i = 0; i < rl.rlim_max; i++){
-        close(i);
+    if (mesg->type == MSG_NICKNAME) {
+        ChatMessage complete_msg = {MSG_SESSION, "", "nickname"};
+        snprintf(complete_msg.nickname, NICKNAME_SIZE, "%.*s", NICKNAME_SIZE - 1, mesg->nickname);
+        printf("클라이언트 %d의 닉네임: %s\n", client_index, complete_msg.nickname);
+        route_child_message(client_index, &complete_msg);
+    } else if (mesg->type == MSG_LOGOUT) {
+        ChatMessage logout_msg = {MSG_LOGOUT, "", ""};
+        printf("클라이언트 %s(ID: %d) 연결 종료\n", nicknames[client_index], client_index);
+        snprintf(logout_msg.content, BUF_SIZE, "[%s] 님께서 퇴장했습니다.\n", nicknames[client_index]);
+        route_child_message(client_index, &logout_msg);
+        close_client_connection(client_index);
+    } else if (mesg->type == MSG_SEARCH) {
+        // 검색은 잠깐 띄운 자식이 해서 팬아웃을 막지 않는다. 결과는 파이프로 돌아온다.
+        if (pipes_to_parent[client_index][0] != -1) {
+            ChatMessage reply = {MSG_SEARCH, "", "이전 검색이 아직 끝나지 않았습니다."};
+            send_to_client(client_index, &reply);
+        } else if (session_helper(client_index, -1) == 0) {
+            mesg->content[BUF_SIZE - 1] = '\0';
+            search_run(client_index, mesg->content);
+            exit(0);
+        }
+    } else {
+        route_child_message(client_index, mesg);
     }
+    fflush(stdout);
+}
 
-    fd0 = open("/dev/null", O_RDWR);
-    fd1 = dup(0);
-    fd2 = dup(0);
+// -L: 오래 걸리는 일(TLS 핸드셰이크, 검색)만 자식 프로세스에 맡긴다. 결과는 세션 자식과 같은
+// 파이프(pipes_to_parent)로 돌아오고, 자식이 끝나 파이프가 닫히면 부모도 닫는다.
+// 자식에서는 0, 부모에서는 1, 실패하면 -1을 돌려준다.
+int session_helper(int client_index, int ssock) {
+    int fds[2];
+    pid_t pid;
 
-    openlog(argv[1], LOG_CONS, LOG_DAEMON);
-    if(fd0 != 0 || fd1 != 1 || fd2 != 2){
-        syslog(LOG_ERR, "unexpected file descriptors %d %d %d", fd0, fd1, fd2);
+    if (pipe(fds) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    fflush(stdout);
+    if ((pid = fork()) == 0) {
+        child_default_signals();
+        close(fds[0]);
+        close_server_sockets(ssock);
+        close_other_clients(client_index);
+        pipes_to_parent[client_index][1] = fds[1];
+        return 0;
+    } else if (pid < 0) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
         return -1;
     }
+    close(fds[1]);
+    set_nonblocking(fds[0]);
+    pipes_to_parent[client_index][0] = fds[0];
+    child_pids[client_index] = pid;
+    g_stats.helpers++;
+    return 1;
+}
 
-    syslog(LOG_INFO, "Daemon Process");
+// "<cpu>[,<cpu>...]" 형식의 코어 목록을 읽는다
+int parse_cpu_list(const char *arg) {
+    const char *p = arg;
+    char *end;
 
-    sa_chld.sa_handler = sigchld_handler;
-    sigemptyset(&sa_chld.sa_mask);
-    sa_chld.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-    if (sigaction(SIGCHLD, &sa_chld, NULL) == -1) {
-        perror("sigaction (SIGCHLD)");
-        exit(1);
+    router_count = 0;
+    while (*p != '\0') {
+        long cpu = strtol(p, &end, 10);
+        if (end == p || cpu < 0 || cpu >= CPU_SETSIZE || router_count == ROUTER_MAX) {
+            return -1;
+        }
+        router_cpus[router_count++] = cpu;
+        p = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != '\0') {
+            return -1;
+        }
     }
+    return router_count > 0 ? 0 : -1;
+}
 
-    sa_usr1.sa_handler = sigusr1_handler;
-    sigemptyset(&sa_usr1.sa_mask);
-    sa_usr1.sa_flags = 0;
-    if (sigaction(SIGUSR1, &sa_usr1, NULL) == -1) {
-        perror("sigaction (SIGUSR1)");
-        exit(1);
+// 라우터마다 SO_REUSEPORT 리스닝 소켓을 차례로 연다. listen()한 순서가 그룹 안의 번호이므로
+// 라우터 i의 소켓은 i번이다. 그룹에 붙이는 CBPF 프로그램은 SYN을 처리한 코어를 읽어 그 코어의
+// 라우터 번호를 돌려주고, 목록에 없는 코어면 라우터 수로 나눈 나머지를 돌려준다.
+// 소켓을 다 연 뒤 라우터 1..n-1을 fork하고, 각 프로세스는 자기 소켓만 남기고 코어에 고정한다.
+int router_listen(int port, int backlog) {
+    struct sockaddr_in addr;
+    int socks[ROUTER_MAX];
+    sigset_t set, old;
+    int on = 1, i;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    for (i = 0; i < router_count; i++) {
+        if ((socks[i] = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+            perror("socket()");
+            return -1;
+        }
+        setsockopt(socks[i], SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        setsockopt(socks[i], SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+        // CBPF가 없거나 범위를 벗어나면 커널은 같은 코어를 적어 둔 리스닝 소켓을 먼저 고른다
+        setsockopt(socks[i], SOL_SOCKET, SO_INCOMING_CPU, &router_cpus[i], sizeof(int));
+        if (bind(socks[i], (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(socks[i], backlog) < 0) {
+            perror("bind()/listen()");
+            return -1;
+        }
     }
 
-    sa_usr2.sa_handler = sigusr2_handler;
-    sigemptyset(&sa_usr2.sa_mask);
-    sa_usr2.sa_flags = 0;
-    if (sigaction(SIGUSR2, &sa_usr2, NULL) == -1) {
-        perror("sigaction (SIGUSR2)");
-        exit(1);
+    for (i = 0; i < router_count; i++) {
+        router_slots[i] = i;
+        router_pids[i] = -1;
     }
+    router_live = router_count;
+    router_attach(socks[0]);
 
-    if ((ssock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket()");
-        return -1;
+    // 라우터가 pid를 기록하기 전에 끝나도 SIGCHLD에서 알아볼 수 있도록 막아 둔다
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, &old);
+    fflush(stdout);
+    for (i = 1; i < router_count; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            // 라우터 0이 끝나면 함께 끝난다
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            router_index = i;
+            memset(router_pids, -1, sizeof(router_pids));
+            break;
+        } else if (pid < 0) {
+            perror("fork");
+            return -1;
+        }
+        router_pids[i] = pid;
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    for (int k = 0; k < router_count; k++) {
+        if (k != router_index) {
+            close(socks[k]);
+        }
+    }
+    router_pin();
+    return socks[router_index];
+}
+
+// 이 라우터를 맡은 코어에 고정한다
+void router_pin(void) {
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(router_cpus[router_index], &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        syslog(LOG_ERR, "router %d: cannot pin to cpu %d: %m", router_index, router_cpus[router_index]);
+        return;
     }
+    syslog(LOG_INFO, "router %d/%d pinned to cpu %d", router_index, router_count, router_cpus[router_index]);
+}
 
-    
-    portno = (argc == 2) ? atoi(argv[1]) : TCP_PORT;
-    memset(&servaddr, 0, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servaddr.sin_port = htons(portno);
+// 받은 연결의 소켓 설정: busy-poll, 그리고 패킷이 이 라우터의 코어로 들어오는지 확인
+void session_tune(int csock) {
+    static int busy_poll_warned = 0;
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
 
-    if (bind(ssock, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
-        perror("bind()");
-        return -1;
+    if (busy_poll_usec > 0 && setsockopt(csock, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_usec, sizeof(int)) < 0
+        && !busy_poll_warned) {
+        syslog(LOG_WARNING, "SO_BUSY_POLL %dus failed: %m", busy_poll_usec);
+        busy_poll_warned = 1;
+    }
+    if (router_count > 0 && getsockopt(csock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0) {
+        if (cpu == router_cpus[router_index]) {
+            g_stats.steer_local++;
+        } else {
+            g_stats.steer_remote++;
+        }
     }
+}
 
-    if (listen(ssock, 50) < 0) {
-        perror("listen()");
-        return -1;
+// 잘린 끝이 UTF-8 글자 중간이면 그 글자를 뺀다
+void utf8_trim(char *s) {
+    size_t len = strlen(s), c;
+
+    for (c = len; c > 0 && (s[c - 1] & 0xC0) == 0x80; c--) {
+    }
+    if (c > 0 && (unsigned char)s[c - 1] >= 0xC0) {
+        unsigned char lead = s[c - 1];
+        size_t need = (lead >= 0xF0) ? 4 : (lead >= 0xE0) ? 3 : 2;
+        if (c - 1 + need > len) {
+            s[c - 1] = '\0';
+        }
     }
+}
 
-    printf("채팅 서버가 시작되었습니다. 포트 %d에서 대기 중...\n", portno);
-    fflush(stdout);
+// 입력 중 표시/반응 요청. 기록하거나 중계하지 않고 방의 상태만 바꾼다.
+void ephemeral_request(int client_index, ChatMessage *mesg) {
+    char emoji[REACT_EMOJI_SIZE];
+    int back = 1;
 
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        client_sockets[i] = -1;
-        pipes_to_child[i][0] = -1;
-        pipes_to_child[i][1] = -1;
-        pipes_to_parent[i][0] = -1;
-        pipes_to_parent[i][1] = -1;
-        nicknames[i][0] = '\0';
-        child_pids[i] = -1;
+    mesg->content[BUF_SIZE - 1] = '\0';
+    g_stats.ephemeral_in++;
+    // -C로 라우터가 여럿이면 같은 방 사람이 다른 라우터에 있을 수 있다. 상태를 라우터끼리
+    // 나누지 않으므로 일부만 보이는 목록을 보내는 대신 켜지 않는다.
+    if (router_count > 1) {
+        if (strcmp(mesg->content, "on") == 0) {
+            ChatMessage notice = {MSG_EPHEMERAL, "", "이 서버(-C)에서는 입력 중 표시와 반응을 쓸 수 없습니다."};
+            send_to_client(client_index, &notice);
+        }
+        return;
     }
+    if (strcmp(mesg->content, "on") == 0 || strcmp(mesg->content, "off") == 0) {
+        // 구독하면 지금 방에 입력 중인 사람이 있을 때 목록부터 보낸다
+        eph_on[client_index] = mesg->content[1] == 'n';
+        eph_pending[client_index] = eph_on[client_index] ? EPH_TYPING_BIT : 0;
+        typing_shown[client_index] = 0;
+        eph_waiting |= eph_on[client_index];
+    } else if (nicknames[client_index][0] == '\0') {
+        return; // 닉네임이 정해지기 전에는 보여 줄 이름이 없다
+    } else if (strcmp(mesg->content, "typing") == 0) {
+        typing_set(client_index, now_usec() + TYPING_EXPIRE_USEC);
+    } else if (strcmp(mesg->content, "idle") == 0) {
+        typing_set(client_index, 0);
+    } else if (sscanf(mesg->content, "react %11s %d", emoji, &back) >= 1) {
+        utf8_trim(emoji);
+        react_toggle(client_index, emoji, back);
+    }
+}
 
-    clen = sizeof(cliaddr);
-    set_nonblocking(ssock);
+// 바뀐 것이 있다고 표시한다. 조용하다가 처음 바뀐 때부터 한 틱 동안 모았다가 한 번에 알린다.
+void ephemeral_touch(void) {
+    if (!eph_dirty) {
+        eph_dirty = 1;
+        eph_usec = now_usec();
+    }
+}
 
-    while (!all_childr_terminated) {
-        int csock = accept(ssock, (struct sockaddr *)&cliaddr, &clen);
-        if (csock > 0) {
-            char ip[BUF_SIZE];
-            inet_ntop(AF_INET, &cliaddr.sin_addr, ip, BUF_SIZE);
-            int client_index;
-            for (client_index = 0; client_index < MAX_CLIENTS; client_index++) {
-                if (client_sockets[client_index] == -1) {
-                    break;
-                }
-            }
-            printf("새 클라이언트 연결: ID %d, IP %s\n", client_index, ip);
-            fflush(stdout);
+// 입력 중 표시를 켜거나 끈다 (until 0: 끈다). 이미 켜져 있으면 만료 시각만 늦춘다.
+void typing_set(int client_index, long long until) {
+    if ((typing_until[client_index] != 0) != (until != 0)) {
+        typing_count += until != 0 ? 1 : -1;
+        eph_rooms[client_rooms[client_index]].typing_dirty = 1;
+        ephemeral_touch();
+    }
+    typing_until[client_index] = until;
+}
 
-            if (g_noc >= MAX_CLIENTS) {
-                printf("최대 클라이언트 수 초과\n");
-                close(csock);
-            } else {
-                client_sockets[client_index] = csock;
-                if (pipe(pipes_to_child[client_index]) == -1 || pipe(pipes_to_parent[client_index]) == -1) {
-                    perror("pipe");
-                    close(csock);
-                } else {
-                    g_noc++;
-                    pid_t pid = fork(); // fork()를 사용하여 멀티 프로세스  
-                    if (pid == 0) {  // 자식 프로세스
-                        close(ssock);
-                        close(pipes_to_child[client_index][1]);
-                        close(pipes_to_parent[client_index][0]);
-                        handle_client(client_index);
-                        exit(0);
-                    } else if (pid > 0) {  // 부모 프로세스
-                        close(pipes_to_child[client_index][0]);
-                        close(pipes_to_parent[client_index][1]);
-                        set_nonblocking(csock);
-                        set_nonblocking(pipes_to_parent[client_index][0]);
-                        child_pids[client_index] = pid;
-                    } else {
-                        perror("fork");
-                        close(csock);
-                        close(pipes_to_child[client_index][0]);
-                        close(pipes_to_child[client_index][1]);
-                        close(pipes_to_parent[client_index][0]);
-                        close(pipes_to_parent[client_index][1]);
-                        g_noc--;
-                    }
-                }
-            }
-        } else if (csock < 0 && errno != EWOULDBLOCK) {
-            perror("accept()");
+// 방을 옮기거나(closing 0) 연결이 끊기면 입력 중 표시를 지운다. 끊기면 누른 반응도 거둔다.
+// 방을 옮긴 클라이언트는 다음 틱에 새 방의 입력 중 목록을 받는다.
+void ephemeral_reset(int client_index, int closing) {
+    typing_set(client_index, 0);
+    if (!closing) {
+        eph_pending[client_index] = eph_on[client_index] ? EPH_TYPING_BIT : 0;
+        if (typing_shown[client_index] != 0) {
+            typing_shown[client_index] = TYPING_UNKNOWN;
         }
+        eph_waiting |= eph_on[client_index];
+        return;
+    }
 
-        // 모든 클라이언트로부터 메시지 읽기
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            if (client_sockets[i] != -1) {
-                ChatMessage mesg;
-                ssize_t str_len = recv(client_sockets[i], &mesg, sizeof(ChatMessage), MSG_DONTWAIT);
-                if (str_len > 0) {
-                    write(pipes_to_child[i][1], &mesg, sizeof(ChatMessage));
-                } else if (str_len == 0 || (str_len == -1 && errno != EWOULDBLOCK)) {
-                    // 클라이언트 연결 종료 처리
-                    close_client_connection(i);
+    for (int room = 0; room < MAX_ROOMS; room++) {
+        for (int k = 0; k < REACT_RECENT; k++) {
+            ReactTarget *t = &eph_rooms[room].targets[k];
+            for (int e = 0; e < REACT_KINDS; e++) {
+                if (t->reactors[e] & (1ULL << client_index)) {
+                    t->reactors[e] &= ~(1ULL << client_index);
+                    t->dirty = 1;
+                    ephemeral_touch();
                 }
             }
         }
+    }
+    eph_on[client_index] = 0;
+    eph_pending[client_index] = 0;
+    typing_shown[client_index] = 0;
+}
 
-        // 자식 프로세스로부터 메시지 읽기 및 메시지 보내기
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            if (pipes_to_parent[i][0] != -1) {
-                ChatMessage mesg;
-                ssize_t str_len = read(pipes_to_parent[i][0], &mesg, sizeof(ChatMessage));
-                if (str_len > 0) {
-                    if (strncmp(mesg.content, "[NICKNAME_SET]", 14) == 0) {
-                        int client_id = atoi(mesg.content + 14);
-                        printf("클라이언트 %d의 닉네임이 설정되었습니다: %s\n", client_id, nicknames[client_id]);
-                    } else {
-                        send_message(&mesg, i);
-                    }
-                }
-            }
+// 방에 새 메시지가 오면 가장 오래된 칸을 비워 반응을 받을 자리를 만든다
+void react_track(int room, ChatMessage *message) {
+    EphemeralRoom *er = &eph_rooms[room];
+    uint32_t id = ++er->next_id;
+    int slot = id % REACT_RECENT;
+    ReactTarget *t = &er->targets[slot];
+
+    // 밀려난 메시지의 반응은 아직 못 보냈어도 더 보내지 않는다
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (client_rooms[i] == room) {
+            eph_pending[i] &= ~(1u << slot);
         }
+    }
+    memset(t, 0, sizeof(*t));
+    t->id = id;
+    snprintf(t->sender, sizeof(t->sender), "%.*s", NICKNAME_SIZE - 1, message->nickname);
+    // 앞부분만 보여 주므로 잘리는 것이 맞다. 잘린 끝은 아래에서 글자 경계로 맞춘다
+    snprintf(t->excerpt, sizeof(t->excerpt), "%.*s", REACT_EXCERPT - 1, message->content);
+    t->excerpt[strcspn(t->excerpt, "\r\n")] = '\0';
+    utf8_trim(t->excerpt);
+}
 
-        // SIGUSR1 처리 (새 클라이언트 연결)
-        if (sigusr1_received) {
-            printf("새 클라이언트가 연결되었습니다. 현재 연결 수: %d\n", g_noc);
-            sigusr1_received = 0;
+// 지금 방의 back번째 전 메시지(1: 마지막 메시지)에 반응을 누르거나, 이미 눌렀으면 거둔다
+void react_toggle(int client_index, const char *emoji, int back) {
+    EphemeralRoom *er = &eph_rooms[client_rooms[client_index]];
+    ChatMessage notice = {MSG_EPHEMERAL, "", ""};
+    uint64_t bit = 1ULL << client_index;
+    ReactTarget *t;
+    uint32_t id;
+    int free_kind = -1, e;
+
+    if (back < 1 || back > REACT_RECENT || (uint32_t)back > er->next_id) {
+        snprintf(notice.content, BUF_SIZE, "반응할 메시지가 없습니다. (최근 %d개까지)", REACT_RECENT);
+        send_to_client(client_index, &notice);
+        return;
+    }
+    if (emoji[0] == '\0' || strchr(emoji, ':') != NULL) {
+        snprintf(notice.content, BUF_SIZE, "잘못된 반응입니다.");
+        send_to_client(client_index, &notice);
+        return;
+    }
+    id = er->next_id - (back - 1);
+    t = &er->targets[id % REACT_RECENT];
+
+    for (e = 0; e < REACT_KINDS; e++) {
+        if (t->reactors[e] != 0 && strcmp(t->emoji[e], emoji) == 0) {
+            break;
+        }
+        if (t->reactors[e] == 0 && free_kind < 0) {
+            free_kind = e;
         }
+    }
+    if (e == REACT_KINDS) {
+        if (free_kind < 0) {
+            snprintf(notice.content, BUF_SIZE, "이 메시지에는 반응을 %d가지까지만 남길 수 있습니다.", REACT_KINDS);
+            send_to_client(client_index, &notice);
+            return;
+        }
+        e = free_kind;
+        strcpy(t->emoji[e], emoji);
+    }
+    t->reactors[e] ^= bit;
+    t->dirty = 1;
+    ephemeral_touch();
+}
 
-        // SIGUSR2 처리 (클라이언트 연결 종료)
-        if (sigusr2_received) {
-            printf("클라이언트 연결이 종료되었습니다. 현재 연결 수: %d\n", g_noc);
-            sigusr2_received = 0;
+// 틱마다 만료된 입력 중 표시를 지우고, 바뀐 방의 구독자에게 보낼 상태를 비트로 표시한다.
+// 아직 보내지 못한 같은 비트가 남아 있으면 그 중간 상태는 건너뛴다.
+void ephemeral_flush(long long now) {
+    unsigned bits[MAX_ROOMS] = {0};
+
+    if (now - eph_usec < TICK_USEC) {
+        return;
+    }
+    eph_usec = now;
+    eph_dirty = 0;
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (typing_until[i] != 0 && (client_sockets[i] == -1 || now >= typing_until[i])) {
+            typing_set(i, 0);
         }
+    }
+    eph_dirty = 0; // 위에서 지운 것은 이번 틱에 보낸다
 
-        // 모든 자식 프로세스가 종료되었는지 확인
-        if (all_childr_terminated) {
-            printf("모든 자식 프로세스가 종료되었습니다. 서버를 종료합니다.\n");
-            break;
+    for (int room = 0; room < MAX_ROOMS; room++) {
+        EphemeralRoom *er = &eph_rooms[room];
+        if (er->typing_dirty) {
+            bits[room] |= EPH_TYPING_BIT;
+            er->typing_dirty = 0;
+        }
+        for (int k = 0; k < REACT_RECENT; k++) {
+            if (er->targets[k].dirty) {
+                bits[room] |= 1u << k;
+                er->targets[k].dirty = 0;
+            }
         }
     }
 
-    // 서버 종료 전 정리 작업
     for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (client_sockets[i] != -1) {
-            close_client_connection(i);
+        unsigned add;
+        if (client_sockets[i] == -1 || !eph_on[i] || (add = bits[client_rooms[i]]) == 0) {
+            continue;
         }
+        g_stats.ephemeral_superseded += __builtin_popcount(eph_pending[i] & add);
+        eph_pending[i] |= add;
+        eph_waiting = 1;
     }
-    close(ssock);
-    printf("서버가 정상적으로 종료되었습니다.\n");
+}
 
-    closelog();
-    return 0;
+// 보낼 상태가 있는 클라이언트 중 송신 대기열이 빈 곳에만 지금 상태를 바로 보낸다.
+// 대기열에 넣지 않으므로 채팅 프레임을 늦추지 않고, 밀린 클라이언트는 비트만 남겨 두었다가 나중에 받는다.
+void ephemeral_send(void) {
+    ChatMessage frame;
+
+    eph_waiting = 0;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (eph_pending[i] == 0) {
+            continue;
+        }
+        if (client_sockets[i] == -1) {
+            eph_pending[i] = 0;
+            continue;
+        }
+        for (int k = 0; k <= REACT_RECENT && eph_pending[i] != 0; k++) {
+            unsigned bit = (k == REACT_RECENT) ? EPH_TYPING_BIT : 1u << k;
+            if (!(eph_pending[i] & bit)) {
+                continue;
+            }
+            if (tls_pending[i] || out_queues[i].count > 0 || attach_busy(i)) {
+                break;
+            }
+            eph_pending[i] &= ~bit;
+            if (k == REACT_RECENT ? typing_frame(i, &frame) : react_frame(client_rooms[i], k, &frame)) {
+                send_direct(i, &frame);
+                g_stats.ephemeral_out++;
+            }
+        }
+        eph_waiting |= eph_pending[i] != 0;
+    }
 }
 
-void sigchld_handler(int s) {
-    int saved_errno = errno;
-    while (waitpid(-1, NULL, WNOHANG) > 0) {
-        g_noc--;
+// 받는 사람에게 보일 입력 중 목록 ("typing <수>" 뒤로 줄마다 이름). 자기 자신은 빼고, 이름은 TYPING_NAMES명까지.
+// 지난번에 보낸 목록과 같으면 0을 돌려준다.
+int typing_frame(int client_index, ChatMessage *frame) {
+    int room = client_rooms[client_index];
+    uint64_t mask = 0;
+    int count = 0;
+    size_t len;
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (i != client_index && typing_until[i] != 0 && client_sockets[i] != -1 && client_rooms[i] == room) {
+            mask |= 1ULL << i;
+        }
+    }
+    if (mask == typing_shown[client_index]) {
+        return 0;
     }
-    if (g_noc == 0) {
-        all_childr_terminated = 1;
+    typing_shown[client_index] = mask;
+
+    memset(frame, 0, sizeof(ChatMessage));
+    frame->type = MSG_EPHEMERAL;
+    strcpy(frame->nickname, rooms[room].name);
+    len = snprintf(frame->content, BUF_SIZE, "typing %d", __builtin_popcountll(mask));
+    for (int i = 0; i < MAX_CLIENTS && count < TYPING_NAMES; i++) {
+        if (mask & (1ULL << i)) {
+            len += snprintf(frame->content + len, BUF_SIZE - len, "\n%s", nicknames[i]);
+            count++;
+        }
     }
-    errno = saved_errno;
+    return 1;
 }
 
-void sigusr1_handler(int signo) {
-    sigusr1_received = 1;
-}
+// 메시지 하나의 반응 수 ("react <id> <이모지>:<수> ..." 뒤 줄에 "<보낸 사람>: <메시지 앞부분>").
+// 반응이 모두 거둬졌어도 보낸다 (받는 사람이 표시를 지울 수 있도록). 길이가 넘치면 둘째 줄을 자른다.
+int react_frame(int room, int slot, ChatMessage *frame) {
+    ReactTarget *t = &eph_rooms[room].targets[slot];
+    size_t len;
 
-void sigusr2_handler(int signo) {
-    sigusr2_received = 1;
+    if (t->id == 0) {
+        return 0;
+    }
+    memset(frame, 0, sizeof(ChatMessage));
+    frame->type = MSG_EPHEMERAL;
+    strcpy(frame->nickname, rooms[room].name);
+    len = snprintf(frame->content, BUF_SIZE, "react %u", t->id);
+    for (int e = 0; e < REACT_KINDS; e++) {
+        if (t->reactors[e] != 0) {
+            len += snprintf(frame->content + len, BUF_SIZE - len, " %s:%d", t->emoji[e],
+                            __builtin_popcountll(t->reactors[e]));
+        }
+    }
+    snprintf(frame->content + len, BUF_SIZE - len, "\n%s: %s", t->sender, t->excerpt);
+    utf8_trim(frame->content);
+    return 1;
 }
 
-void set_nonblocking(int sock) {
-    int flags = fcntl(sock, F_GETFL, 0);
-    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+// 수신 링크로 RESUME/ACK 한 프레임을 보낸다. 앞 프레임이 아직 나가는 중이면 -1 (ACK는 다음 주기에 다시 보낸다).
+// 소켓 버퍼가 차서 일부만 나가면 나머지는 루프마다 peer_inbound_flush()가 이어서 보낸다.
+int peer_inbound_send(PeerInbound *in, PeerFrame *frame) {
+    if (in->tx_len > 0) {
+        return -1;
+    }
+    in->tx = *frame;
+    in->tx_len = sizeof(PeerFrame);
+    in->tx_sent = 0;
+    peer_inbound_flush(in);
+    return 0;
 }
 
-void send_message(ChatMessage *message, int sender_index) {
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (client_sockets[i] != -1 && i != sender_index) {
-            send(client_sockets[i], message, sizeof(ChatMessage), 0);
+void peer_inbound_flush(PeerInbound *in) {
+    while (in->tx_sent < in->tx_len) {
+        ssize_t n = send(in->fd, (char *)&in->tx + in->tx_sent, in->tx_len - in->tx_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno != EWOULDBLOCK && errno != EAGAIN) {
+                peer_inbound_close(in);
+            }
+            return;
         }
+        in->tx_sent += n;
     }
-    printf("[%s] %s", message->nickname, message->content);
-    fflush(stdout);
+    in->tx_len = 0;
 }
 
-void handle_client(int client_index) {
-    ChatMessage message;
-    ssize_t str_len;
+void peer_inbound_close(PeerInbound *in) {
+    close(in->fd);
+    in->fd = -1;
+    in->tx_len = 0;
+}
 
-    while (1) {
-        str_len = read(pipes_to_child[client_index][0], &message, sizeof(ChatMessage));
-        if (str_len > 0) {
-            if (message.type == MSG_NICKNAME) {
-                strncpy(nicknames[client_index], message.nickname, NICKNAME_SIZE - 1);
-                nicknames[client_index][NICKNAME_SIZE - 1] = '\0';
-                printf("클라이언트 %d의 닉네임: %s\n", client_index, nicknames[client_index]);
-                
-                // 닉네임 설정 메시지 
-                ChatMessage complete_msg = {MSG_CHAT, "", ""};
-                snprintf(complete_msg.content, BUF_SIZE, "[NICKNAME_SET]%d", client_index);
-                write(pipes_to_parent[client_index][1], &complete_msg, sizeof(ChatMessage));
-                
-                // 새 클라이언트 연결을 알림
-                kill(getppid(), SIGUSR1);
-            } else if (message.type == MSG_LOGOUT) {
-                printf("클라이언트 %s(ID: %d) 연결 종료\n", nicknames[client_index], client_index);
-                ChatMessage logout_msg = {MSG_LOGOUT, "", ""};
-                snprintf(logout_msg.content, BUF_SIZE, "[%s] 님께서 퇴장했습니다.\n", nicknames[client_index]);
-                write(pipes_to_parent[client_index][1], &logout_msg, sizeof(ChatMessage));
-                
-                // 클라이언트 연결 종료를 알림
-                kill(getppid(), SIGUSR2);
+// -N 을 주지 않았을 때의 노드 id: 호스트 이름, 루프백이 아닌 첫 IPv4 주소, 포트의 FNV-1a 해시.
+// 라우터 번호를 곱해 붙일 자리를 남기도록 24비트로 줄이고 0은 피한다.
+uint32_t node_id_derive(int port) {
+    char host[256] = "";
+    struct ifaddrs *ifs, *ifa;
+    uint32_t h = 2166136261u;
+
+    gethostname(host, sizeof(host) - 1);
+    for (const char *p = host; *p != '\0'; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    if (getifaddrs(&ifs) == 0) {
+        for (ifa = ifs; ifa != NULL; ifa = ifa->ifa_next) {
+            if (ifa->ifa_addr != NULL && ifa->ifa_addr->sa_family == AF_INET && !(ifa->ifa_flags & IFF_LOOPBACK)) {
+                uint32_t addr = ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr.s_addr;
+                for (int i = 0; i < 4; i++) {
+                    h = (h ^ ((addr >> (i * 8)) & 0xff)) * 16777619u;
+                }
                 break;
-            } else {
-                write(pipes_to_parent[client_index][1], &message, sizeof(ChatMessage));
             }
-            fflush(stdout);
-        } else if (str_len <= 0) {
-            break;
         }
+        freeifaddrs(ifs);
     }
+    h = (h ^ (port & 0xff)) * 16777619u;
+    h = (h ^ ((port >> 8) & 0xff)) * 16777619u;
+    h &= 0xffffff;
+    return h != 0 ? h : 1;
+}
 
-    close(client_sockets[client_index]);
-    close(pipes_to_child[client_index][0]);
-    close(pipes_to_parent[client_index][1]);
-    exit(0);
+// 그룹에 CBPF 프로그램을 붙인다. SYN을 처리한 코어의 라우터가 그룹에 남아 있으면 그 칸을,
+// 아니면 남은 소켓 수로 나눈 나머지를 돌려준다.
+void router_attach(int sock) {
+    struct sock_filter code[2 * ROUTER_MAX + 3];
+    struct sock_fprog prog;
+    int len = 0;
+
+    code[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (int g = 0; g < router_live; g++) {
+        code[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, router_cpus[router_slots[g]], 0, 1);
+        code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, g);
+    }
+    code[len++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, router_live);
+    code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+    prog.len = len;
+    prog.filter = code;
+    if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+        syslog(LOG_WARNING, "SO_ATTACH_REUSEPORT_CBPF failed, steering by SO_INCOMING_CPU only: %m");
+    }
 }
 
-void close_client_connection(int client_index) {
-    if (client_sockets[client_index] != -1) {
-        close(client_sockets[client_index]);
-        client_sockets[client_index] = -1;
+// 라우터 0: 끝난 라우터의 소켓은 그룹에서 빠지고 마지막 칸의 소켓이 그 자리로 옮겨 온다.
+// 표를 같은 규칙으로 고치고 프로그램을 다시 붙여 남은 라우터가 연결을 나눠 받게 한다.
+void router_rebalance(int sock) {
+    router_exited = 0;
+    for (int k = 1; k < router_count; k++) {
+        int g;
+        if (router_pids[k] != -1) {
+            continue;
+        }
+        for (g = 0; g < router_live && router_slots[g] != k; g++) {
+        }
+        if (g == router_live) {
+            continue; // 이미 정리했다
+        }
+        router_slots[g] = router_slots[--router_live];
+        syslog(LOG_WARNING, "router %d (cpu %d) exited, %d routers left in the listening group",
+               k, router_cpus[k], router_live);
     }
+    router_attach(sock);
+}
+
+// 인계 레코드를 비우고 형식 정보와 종류를 채운다
+void handoff_header(HandoffRecord *rec, HandoffKind kind) {
+    memset(rec, 0, sizeof(*rec));
+    rec->magic = HANDOFF_MAGIC;
+    rec->version = HANDOFF_VERSION;
+    rec->size = sizeof(HandoffRecord);
+    rec->kind = kind;
+}
+
+// 받은 레코드가 이 바이너리와 같은 형식인지 확인한다 (n: recv_with_fd가 돌려준 길이)
+int handoff_valid(const HandoffRecord *rec, ssize_t n) {
+    return n == (ssize_t)sizeof(HandoffRecord) && rec->magic == HANDOFF_MAGIC
+        && rec->version == HANDOFF_VERSION && rec->size == sizeof(HandoffRecord);
+}
+
+// 새 프로세스로 넘긴 연결의 이 프로세스 쪽 사본을 닫는다. 연결과 상태는 새 프로세스가 이어 가므로
+// close_client_connection처럼 퇴장을 알리거나 첨부 파일, 방 상태를 건드리지 않는다.
+void close_handed_off(int client_index) {
+    close(client_sockets[client_index]);
+    client_sockets[client_index] = -1;
     if (pipes_to_child[client_index][1] != -1) {
         close(pipes_to_child[client_index][1]);
         pipes_to_child[client_index][1] = -1;
@@ -376,6 +7119,34 @@ void close_client_connection(int client_index) {
         kill(child_pids[client_index], SIGTERM);
         child_pids[client_index] = -1;
     }
+    handed_off[client_index] = 0;
     g_noc--;
-    printf("클라이언트 %d 연결이 종료되었습니다. 현재 연결 수: %d\n", client_index, g_noc);
+}
+
+// 아직 없을 수도 있는 파일의 절대 경로. 디렉터리만 realpath()로 풀고 파일 이름을 붙인다.
+char *path_resolve(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char dir[PATH_MAX], *real, *full;
+
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else if (slash == path) {
+        strcpy(dir, "/");
+    } else if (slash - path < (long)sizeof(dir)) {
+        memcpy(dir, path, slash - path);
+        dir[slash - path] = '\0';
+    } else {
+        return NULL;
+    }
+    if ((real = realpath(dir, NULL)) == NULL) {
+        return NULL;
+    }
+    const char *base = slash != NULL ? slash + 1 : path;
+    if (*base == '\0' || (full = malloc(strlen(real) + strlen(base) + 2)) == NULL) {
+        free(real);
+        return NULL;
+    }
+    sprintf(full, "%s/%s", strcmp(real, "/") == 0 ? "" : real, base);
+    free(real);
+    return full;
 }